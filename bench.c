@@ -0,0 +1,705 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <linux/falloc.h>
+#include "lcopy.h"
+
+/*
+ * Benchmark of digest generation, digest comparison and copy, built by
+ * make bench. Files and trees of pseudo random data, the same for a
+ * given seed, are changed by a pattern and copied over an unchanged
+ * copy. Each phase is sampled for wall and cpu time and the counters
+ * of /proc/self/io, results are written as JSON.
+ *
+ * bytes_read, bytes_written and the syscall counts cover read and write
+ * system calls only. Chunk I/O through io_uring, copy_file_range and
+ * reflinks is not in them, so the psync engine is the default here;
+ * disk_read and disk_written count what reached the block layer.
+ */
+
+/* Change patterns applied to the source. */
+typedef enum {
+        PAT_NONE,       /* Unchanged. */
+        PAT_SCATTERED,  /* A few bytes in 1% of chunks. */
+        PAT_RUNS,       /* A contiguous run of 5% of the file. */
+        PAT_APPEND,     /* 1% appended. */
+        PAT_INSERT,     /* 4K inserted in the middle. */
+        PAT_SPARSE,     /* A quarter punched to a hole. */
+        PAT_COUNT
+} Pattern;
+
+static const char *pattern_str[] = {
+        "none",
+        "scattered",
+        "runs",
+        "append",
+        "insert",
+        "sparse"
+};
+
+/* Counters of /proc/self/io and their names in results. */
+#define IO_COUNTERS 6
+
+static const char *io_keys[IO_COUNTERS] = {
+        "rchar", "wchar", "syscr", "syscw", "read_bytes", "write_bytes"
+};
+
+static const char *io_names[IO_COUNTERS] = {
+        "bytes_read", "bytes_written", "read_syscalls", "write_syscalls",
+        "disk_read", "disk_written"
+};
+
+struct sample {
+        double wall;
+        double cpu;
+        unsigned long long io[IO_COUNTERS];
+};
+
+/* Block of generated data. */
+#define GEN_BLOCK (1024*1024)
+
+/* Tree files are spread over this many directories. */
+#define TREE_DIRS 10
+
+/* Every TREE_CHANGE'th file of a tree gets the pattern. */
+#define TREE_CHANGE 16
+
+static FILE *out;
+static int nresults;
+static int drop_caches;
+static uint64_t rng_state;
+
+/* xorshift64*, reproducible data for a seed. */
+static uint64_t rng(void) {
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void rng_fill(unsigned char *buf, size_t len) {
+        uint64_t v;
+        size_t i;
+
+        for (i = 0; i + 8 <= len; i += 8) {
+                v = rng();
+                memcpy(buf + i, &v, 8);
+        }
+        for (; i < len; i++)
+                buf[i] = rng();
+}
+
+static void pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+        ssize_t r;
+        size_t n;
+
+        for (n = 0; n < len; n += r) {
+                r = pwrite(fd, (const char *)buf + n, len - n, off + n);
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                r = 0;
+                                continue;
+                        }
+                        handle_error("pwrite");
+                }
+        }
+}
+
+/* Writes size bytes of data of seed to path. */
+static void gen_file(const char *path, off_t size, uint64_t seed) {
+        unsigned char *buf = malloc(GEN_BLOCK);
+        off_t off;
+        size_t len;
+        int fd;
+
+        if (buf == NULL)
+                handle_error("malloc");
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+                handle_error(path);
+        rng_state = seed | 1;
+        for (off = 0; off < size; off += len) {
+                len = size - off < GEN_BLOCK ? size - off : GEN_BLOCK;
+                rng_fill(buf, len);
+                pwrite_all(fd, buf, len, off);
+        }
+        close(fd);
+        free(buf);
+}
+
+/* Inserts len random bytes at off of path, through a temporary file. */
+static void insert_bytes(const char *path, off_t size, off_t off, size_t len) {
+        unsigned char *buf = malloc(GEN_BLOCK);
+        char tmp[PATH_MAX];
+        off_t n;
+        ssize_t r;
+        int in;
+        int fd;
+
+        if (buf == NULL)
+                handle_error("malloc");
+        snprintf(tmp, sizeof(tmp), "%s.ins", path);
+        in = open(path, O_RDONLY | O_CLOEXEC);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (in < 0 || fd < 0)
+                handle_error(path);
+        for (n = 0; n < size; n += r) {
+                if (n == off) {
+                        rng_fill(buf, len);
+                        pwrite_all(fd, buf, len, off);
+                }
+                r = pread(in, buf, off > n && off - n < GEN_BLOCK ?
+                        off - n : GEN_BLOCK, n);
+                if (r <= 0)
+                        handle_error("pread");
+                pwrite_all(fd, buf, r, n < off ? n : n + (off_t)len);
+        }
+        close(in);
+        close(fd);
+        if (rename(tmp, path) != 0)
+                handle_error("rename");
+        free(buf);
+}
+
+/* Applies pattern to the file path of size bytes. */
+static void mutate(const char *path, off_t size, int pattern) {
+        unsigned char buf[4096];
+        off_t off;
+        off_t len;
+        struct timespec times[2];
+        struct stat st;
+        long n;
+        int fd;
+
+        if (pattern == PAT_NONE)
+                return;
+        if (pattern == PAT_INSERT) {
+                insert_bytes(path, size, size / 2, sizeof(buf));
+                return;
+        }
+
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) != 0)
+                handle_error(path);
+        switch (pattern) {
+        case PAT_SCATTERED:
+                for (n = CHUNK_COUNT(size) / 100 + 1; n > 0 && size; n--) {
+                        off = rng() % size;
+                        len = size - off < 8 ? size - off : 8;
+                        rng_fill(buf, len);
+                        pwrite_all(fd, buf, len, off);
+                }
+                break;
+        case PAT_RUNS:
+                len = size / 20 + 1;
+                for (off = size / 3; len > 0 && off < size; off += n) {
+                        n = len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf);
+                        rng_fill(buf, n);
+                        pwrite_all(fd, buf, n, off);
+                        len -= n;
+                }
+                break;
+        case PAT_APPEND:
+                for (len = size / 100 + 1, off = size; len > 0; off += n) {
+                        n = len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf);
+                        rng_fill(buf, n);
+                        pwrite_all(fd, buf, n, off);
+                        len -= n;
+                }
+                break;
+        case PAT_SPARSE:
+                off = size / 4 & ~(off_t)4095;
+                len = size / 4 & ~(off_t)4095;
+                if (len && fallocate(fd, FALLOC_FL_PUNCH_HOLE |
+                                        FALLOC_FL_KEEP_SIZE, off, len) != 0)
+                        zero_range(fd, off, len);
+                break;
+        }
+
+        /*
+         * A change within a clock tick of file creation keeps its mtime,
+         * it is moved on so that digests of the file are seen stale.
+         */
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1] = st.st_mtim;
+        times[1].tv_sec++;
+        futimens(fd, times);
+        close(fd);
+}
+
+static void sample_take(struct sample *s) {
+        struct timespec ts;
+        struct rusage ru;
+        char key[32];
+        unsigned long long v;
+        FILE *f;
+        int i;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        s->wall = ts.tv_sec + ts.tv_nsec / 1e9;
+        getrusage(RUSAGE_SELF, &ru);
+        s->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+                ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+        memset(s->io, 0, sizeof(s->io));
+        f = fopen("/proc/self/io", "r");
+        if (f == NULL)
+                return;
+        while (fscanf(f, "%31[^:]: %llu\n", key, &v) == 2)
+                for (i = 0; i < IO_COUNTERS; i++)
+                        if (!strcmp(key, io_keys[i]))
+                                s->io[i] = v;
+        fclose(f);
+}
+
+/* Empties the page cache with --drop-caches, so that phases run cold. */
+static void cache_drop(void) {
+        int fd;
+
+        if (!drop_caches)
+                return;
+        sync();
+        fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+        if (fd < 0 || write(fd, "3", 1) != 1) {
+                perror("drop_caches");
+                drop_caches = 0;
+        }
+        if (fd >= 0)
+                close(fd);
+}
+
+/*
+ * Writes the result of a phase between samples a and b, over bytes of
+ * data. changed is left out if negative.
+ */
+static void report(const char *workload, off_t size, int pattern,
+                const char *phase, int run, off_t bytes, long changed,
+                const struct sample *a, const struct sample *b) {
+        double wall = b->wall - a->wall;
+        int i;
+
+        fprintf(out, "%s\n    {\"workload\": \"%s\", \"size\": %lld, "
+                "\"pattern\": \"%s\", \"phase\": \"%s\", \"run\": %d, "
+                "\"wall_s\": %.6f, \"cpu_s\": %.6f, "
+                "\"throughput_mbs\": %.1f",
+                nresults++ ? "," : "", workload, (long long)size,
+                pattern_str[pattern], phase, run, wall, b->cpu - a->cpu,
+                wall > 0 ? bytes / wall / 1e6 : 0.0);
+        for (i = 0; i < IO_COUNTERS; i++)
+                fprintf(out, ", \"%s\": %llu", io_names[i],
+                        b->io[i] - a->io[i]);
+        if (changed >= 0)
+                fprintf(out, ", \"chunks_changed\": %ld", changed);
+        fprintf(out, "}");
+        fflush(out);
+}
+
+/* Digests of path, generated unless fresh. */
+static void digest(const char *path) {
+        FILE *f = fopen(path, "r");
+
+        if (f == NULL)
+                handle_error(path);
+        store_close(open_digest_file(path, f), path);
+        fclose(f);
+}
+
+static void copy_file(const char *from, const char *to) {
+        unsigned char buf[65536];
+        ssize_t r;
+        off_t off = 0;
+        int in = open(from, O_RDONLY | O_CLOEXEC);
+        int fd = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (in < 0 || fd < 0)
+                handle_error(from);
+        while ((r = read(in, buf, sizeof(buf))) > 0) {
+                pwrite_all(fd, buf, r, off);
+                off += r;
+        }
+        close(in);
+        close(fd);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                struct FTW *ftw) {
+        (void)st;
+        (void)flag;
+        (void)ftw;
+        return remove(path);
+}
+
+static void remove_tree(const char *path) {
+        nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * File workload: digest generation of the source, copy of the changed
+ * source over its old copy, then comparison of the new source digests
+ * with the digests the destination had.
+ */
+static void bench_file(const char *dir, off_t size, int pattern, int run,
+                uint64_t seed) {
+        char src[PATH_MAX];
+        char dest[PATH_MAX];
+        char old[PATH_MAX];
+        struct digs src_digs;
+        struct digs old_digs;
+        struct sample a;
+        struct sample b;
+        struct stat st;
+        uint64_t *bitmap;
+        long changed;
+        char *digs_path;
+        int src_fd;
+        int old_fd;
+
+        snprintf(src, sizeof(src), "%s/lcbench.src", dir);
+        snprintf(dest, sizeof(dest), "%s/lcbench.dest", dir);
+        snprintf(old, sizeof(old), "%s/lcbench.old", dir);
+        gen_file(src, size, seed);
+        gen_file(dest, size, seed);
+
+        cache_drop();
+        sample_take(&a);
+        digest(src);
+        sample_take(&b);
+        report("file", size, pattern, "digest", run, size, -1, &a, &b);
+
+        /* Digests the destination has before the copy. */
+        digest(dest);
+        digs_path = get_digs_filepath(dest);
+        copy_file(digs_path, old);
+        free(digs_path);
+
+        rng_state = seed ^ 0x9E3779B97F4A7C15ULL;
+        mutate(src, size, pattern);
+        if (stat(src, &st) != 0)
+                handle_error("stat");
+
+        cache_drop();
+        sample_take(&a);
+        lcopy(src, dest, 0);
+        sample_take(&b);
+        report("file", size, pattern, "copy", run, st.st_size, -1, &a, &b);
+
+        /* Source digests are fresh after the copy. */
+        digest(src);
+        digs_path = get_digs_filepath(src);
+        src_fd = open(digs_path, O_RDONLY | O_CLOEXEC);
+        old_fd = open(old, O_RDONLY | O_CLOEXEC);
+        if (src_fd < 0 || old_fd < 0)
+                handle_error(digs_path);
+        if (digs_map(src_fd, &src_digs) != 0 ||
+                        digs_map(old_fd, &old_digs) != 0)
+                handle_error("mmap");
+        free(digs_path);
+        bitmap = calloc(BITMAP_WORDS(src_digs.count) + 1, sizeof(uint64_t));
+        if (bitmap == NULL)
+                handle_error("calloc");
+
+        sample_take(&a);
+        changed = digs_diff(&src_digs, &old_digs, bitmap);
+        sample_take(&b);
+        report("file", size, pattern, "compare", run, st.st_size, changed,
+                &a, &b);
+
+        free(bitmap);
+        digs_unmap(&src_digs);
+        digs_unmap(&old_digs);
+        close(src_fd);
+        close(old_fd);
+
+        digs_path = get_digs_filepath(src);
+        unlink(digs_path);
+        free(digs_path);
+        digs_path = get_digs_filepath(dest);
+        unlink(digs_path);
+        free(digs_path);
+        unlink(src);
+        unlink(dest);
+        unlink(old);
+}
+
+/*
+ * Tree workload: files files of size / files bytes in TREE_DIRS
+ * directories. Digest generation of the source tree with its directory
+ * digests, then the recursive copy of the changed tree over its copy.
+ */
+static void bench_tree(const char *dir, off_t size, int files, int pattern,
+                int run, uint64_t seed) {
+        char src[PATH_MAX];
+        char dest[PATH_MAX];
+        char *srcs[1] = { src };
+        char target[PATH_MAX + 16];
+        char path[PATH_MAX + 64];
+        unsigned char root[MAX_DIGEST_SIZE];
+        off_t fsize = size / files;
+        char *digs_path;
+        struct sample a;
+        struct sample b;
+        int i;
+        int k;
+
+        snprintf(src, sizeof(src), "%s/lcbench.tsrc", dir);
+        snprintf(dest, sizeof(dest), "%s/lcbench.tdest", dir);
+        remove_tree(src);
+        remove_tree(dest);
+        if (mkdir(src, 0755) != 0 || mkdir(dest, 0755) != 0)
+                handle_error("mkdir");
+        snprintf(target, sizeof(target), "%s/lcbench.tsrc", dest);
+        if (mkdir(target, 0755) != 0)
+                handle_error("mkdir");
+        for (k = 0; k < TREE_DIRS; k++) {
+                snprintf(path, sizeof(path), "%s/d%02d", src, k);
+                if (mkdir(path, 0755) != 0)
+                        handle_error("mkdir");
+                snprintf(path, sizeof(path), "%s/lcbench.tsrc/d%02d", dest, k);
+                if (mkdir(path, 0755) != 0)
+                        handle_error("mkdir");
+        }
+        for (i = 0; i < files; i++) {
+                snprintf(path, sizeof(path), "%s/d%02d/f%06d", src,
+                        i % TREE_DIRS, i);
+                gen_file(path, fsize, seed + i);
+                snprintf(path, sizeof(path), "%s/lcbench.tsrc/d%02d/f%06d",
+                        dest, i % TREE_DIRS, i);
+                gen_file(path, fsize, seed + i);
+        }
+
+        cache_drop();
+        sample_take(&a);
+        dir_root(src, root);
+        sample_take(&b);
+        report("tree", size, pattern, "digest", run, fsize * files, -1,
+                &a, &b);
+
+        snprintf(target, sizeof(target), "%s/lcbench.tsrc", dest);
+        dir_root(target, root);
+        rng_state = seed ^ 0x9E3779B97F4A7C15ULL;
+        for (i = 0; i < files; i += TREE_CHANGE) {
+                snprintf(path, sizeof(path), "%s/d%02d/f%06d", src,
+                        i % TREE_DIRS, i);
+                mutate(path, fsize, pattern);
+        }
+
+        /* Roots are refreshed after the copy, as lcopy -r does. */
+        cache_drop();
+        sample_take(&a);
+        lcopy(src, dest, 1);
+        dir_roots(srcs, 1, dest);
+        sample_take(&b);
+        report("tree", size, pattern, "copy", run, fsize * files, -1,
+                &a, &b);
+
+        remove_tree(src);
+        remove_tree(dest);
+        digs_path = get_digs_filepath(src);
+        unlink(digs_path);
+        free(digs_path);
+}
+
+static void usage () {
+        printf("Usage:\n"
+               "\tbench [OPTIONS]\n"
+               "\tBenchmark digest generation, comparison and copy.\n"
+               "\nOptions:\n"
+               "\t-d,--dir DIR\n"
+               "\t        Directory of the test files (default: .)\n"
+               "\t-s,--sizes N[K|M|G],...\n"
+               "\t        File and tree sizes (default: 64K,16M,256M)\n"
+               "\t-p,--patterns P,...\n"
+               "\t        none, scattered, runs, append, insert, sparse\n"
+               "\t        (default: all)\n"
+               "\t-n,--runs N\n"
+               "\t        Runs of each workload (default: 3)\n"
+               "\t-t,--tree-files N\n"
+               "\t        Also copy trees of N files of each size\n"
+               "\t-j,--threads N\n"
+               "\t        Digest threads (default: one per cpu)\n"
+               "\t--hash, --chunk-size, --io-engine\n"
+               "\t        As for lcopy, the engine defaults to psync\n"
+               "\t--seed N\n"
+               "\t        Seed of the generated data (default: 1)\n"
+               "\t--drop-caches\n"
+               "\t        Empty the page cache before each phase (root)\n"
+               "\t-o,--output FILE\n"
+               "\t        Write JSON results to FILE (default: stdout)\n");
+}
+
+int main (int argc, char *argv[]) {
+        static struct option long_options[] = {
+                {"dir", required_argument, NULL, 'd'},
+                {"sizes", required_argument, NULL, 's'},
+                {"patterns", required_argument, NULL, 'p'},
+                {"runs", required_argument, NULL, 'n'},
+                {"tree-files", required_argument, NULL, 't'},
+                {"threads", required_argument, NULL, 'j'},
+                {"hash", required_argument, NULL, 'H'},
+                {"chunk-size", required_argument, NULL, 'C'},
+                {"io-engine", required_argument, NULL, 'E'},
+                {"seed", required_argument, NULL, 'S'},
+                {"drop-caches", no_argument, NULL, 'D'},
+                {"output", required_argument, NULL, 'o'},
+                {"help", no_argument, NULL, 'h'},
+                {NULL, 0, NULL, 0}
+        };
+        const char *dir = ".";
+        char default_sizes[] = "64K,16M,256M";
+        char *sizes = default_sizes;
+        char *patterns = NULL;
+        char *output = NULL;
+        int runs = 3;
+        int tree_files = 0;
+        uint64_t seed = 1;
+        int pattern_on[PAT_COUNT];
+        off_t size;
+        char *s;
+        char *save;
+        int devnull;
+        int ch;
+        int run;
+        int p;
+
+        io_engine = IO_PSYNC;
+        while ((ch = getopt_long(argc, argv, "d:s:p:n:t:j:o:h",
+                                long_options, NULL)) != -1) {
+                switch (ch) {
+                case 'd':
+                        dir = optarg;
+                        break;
+                case 's':
+                        sizes = optarg;
+                        break;
+                case 'p':
+                        patterns = optarg;
+                        break;
+                case 'n':
+                        runs = atoi(optarg);
+                        break;
+                case 't':
+                        tree_files = atoi(optarg);
+                        break;
+                case 'j':
+                        nthreads = atoi(optarg);
+                        break;
+                case 'H':
+                        for (hash_algo = 0; hash_algo < HASH_COUNT; hash_algo++)
+                                if (!strcmp(optarg, hash_str[hash_algo]))
+                                        break;
+                        if (hash_algo == HASH_COUNT ||
+                                        !hash_available(hash_algo)) {
+                                fprintf(stderr, "Hash %s is not available.\n",
+                                        optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        digest_size = hash_size(hash_algo);
+                        break;
+                case 'C':
+                        if (set_chunk_size(parse_size(optarg)) != 0) {
+                                fprintf(stderr, "Invalid chunk size %s.\n",
+                                        optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'E':
+                        for (io_engine = IO_URING; io_engine >= 0; io_engine--)
+                                if (!strcmp(optarg, io_engine_str[io_engine]))
+                                        break;
+                        if (io_engine < 0) {
+                                usage();
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'S':
+                        seed = strtoull(optarg, NULL, 0);
+                        break;
+                case 'D':
+                        drop_caches = 1;
+                        break;
+                case 'o':
+                        output = optarg;
+                        break;
+                case 'h':
+                        usage();
+                        exit(EXIT_SUCCESS);
+                default:
+                        usage();
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (runs < 1 || tree_files < 0 || nthreads < 0) {
+                usage();
+                exit(EXIT_FAILURE);
+        }
+        if (nthreads == 0) {
+                nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+                if (nthreads < 1)
+                        nthreads = 1;
+        }
+
+        for (p = 0; p < PAT_COUNT; p++)
+                pattern_on[p] = patterns == NULL;
+        for (s = patterns ? strtok_r(patterns, ",", &save) : NULL; s != NULL;
+                        s = strtok_r(NULL, ",", &save)) {
+                for (p = 0; p < PAT_COUNT; p++)
+                        if (!strcmp(s, pattern_str[p]))
+                                break;
+                if (p == PAT_COUNT) {
+                        fprintf(stderr, "Unknown pattern %s.\n", s);
+                        exit(EXIT_FAILURE);
+                }
+                pattern_on[p] = 1;
+        }
+
+        /* lcopy prints progress to stdout, results get their own stream. */
+        out = output ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+        if (out == NULL)
+                handle_error(output ? output : "fdopen");
+        devnull = open("/dev/null", O_WRONLY);
+        if (devnull < 0 || dup2(devnull, STDOUT_FILENO) < 0)
+                handle_error("/dev/null");
+
+        fprintf(out, "{\n  \"benchmark\": \"lcopy\",\n  \"config\": {"
+                "\"hash\": \"%s\", \"chunk_size\": %ld, \"threads\": %d, "
+                "\"io_engine\": \"%s\", \"runs\": %d, \"seed\": %llu, "
+                "\"tree_files\": %d, \"drop_caches\": %d},\n"
+                "  \"results\": [", hash_str[hash_algo], chunk_size,
+                nthreads, io_engine_str[io_engine], runs,
+                (unsigned long long)seed, tree_files, drop_caches);
+
+        for (s = strtok_r(sizes, ",", &save); s != NULL;
+                        s = strtok_r(NULL, ",", &save)) {
+                size = parse_size(s);
+                if (size <= 0) {
+                        fprintf(stderr, "Invalid size %s.\n", s);
+                        exit(EXIT_FAILURE);
+                }
+                for (p = 0; p < PAT_COUNT; p++) {
+                        if (!pattern_on[p])
+                                continue;
+                        for (run = 0; run < runs; run++) {
+                                bench_file(dir, size, p, run, seed + run);
+                                if (tree_files > 0 && size >= tree_files)
+                                        bench_tree(dir, size, tree_files, p,
+                                                run, seed + run);
+                        }
+                }
+        }
+
+        fprintf(out, "\n  ]\n}\n");
+        fclose(out);
+        store_finish();
+
+        return 0;
+}
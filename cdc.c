@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include "lcopy.h"
+
+/*
+ * Content defined chunking. Chunk boundaries are cut where a Gear
+ * rolling hash of the last 64 bytes has its top bits clear, so an
+ * insertion or deletion only moves the boundaries around it. Cuts are
+ * normalized as in FastCDC: below the average size a cut needs one more
+ * clear bit, above it one less, chunks are chunk_size/4 to 4*chunk_size
+ * bytes long and average about chunk_size.
+ */
+
+/* Random byte values of the Gear hash, the same on every run. */
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* Fills gear with splitmix64 of a fixed seed. */
+static void gear_init(void) {
+        uint64_t x = 0x6c636f7079636463ULL; /* "lcopycdc" */
+        uint64_t z;
+        int i;
+
+        for (i = 0; i < 256; i++) {
+                z = (x += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                gear[i] = z ^ (z >> 31);
+        }
+}
+
+/* Returns length of the chunk starting at p, n bytes are left. */
+static size_t cdc_cut(const unsigned char *p, size_t n) {
+        uint64_t mask_s = ~0ULL << (64 - (chunk_shift + 1));
+        uint64_t mask_l = ~0ULL << (64 - (chunk_shift - 1));
+        size_t min = chunk_size / 4;
+        size_t max = chunk_size * 4;
+        size_t normal = chunk_size;
+        uint64_t h = 0;
+        size_t i;
+
+        if (n <= min)
+                return n;
+        if (n > max)
+                n = max;
+        if (normal > n)
+                normal = n;
+
+        for (i = min; i < normal; i++) {
+                h = (h << 1) + gear[p[i]];
+                if (!(h & mask_s))
+                        return i + 1;
+        }
+        for (; i < n; i++) {
+                h = (h << 1) + gear[p[i]];
+                if (!(h & mask_l))
+                        return i + 1;
+        }
+
+        return n;
+}
+
+/*
+ * Cuts the file open on fd into content defined chunks and digests them
+ * with ctx, chunks of zeros get the zero digest. The file is read with
+ * pread through a window of two maximal chunks, a file that shrinks
+ * meanwhile is cut where its reads end. Sets *digests and *lens to
+ * malloc'ed arrays of the digest and length of each chunk.
+ * Returns number of chunks.
+ */
+long cdc_digest(int fd, struct hash_ctx *ctx, unsigned char **digests,
+                uint32_t **lens) {
+        unsigned char *buf;
+        size_t window = chunk_size * 8;
+        size_t have = 0;
+        size_t pos = 0;
+        size_t len;
+        off_t off = 0;
+        ssize_t r;
+        long count = 0;
+        long size = 64;
+        int eof = 0;
+
+        pthread_once(&gear_once, gear_init);
+
+        io_sequential(fd);
+
+        buf = malloc(window);
+        *digests = malloc((size_t)size * digest_size);
+        *lens = malloc(size * sizeof(uint32_t));
+        if (buf == NULL || *digests == NULL || *lens == NULL)
+                handle_error("malloc");
+
+        for (;;) {
+                /* Keep at least one maximal chunk ahead of pos. */
+                if (!eof && have - pos < window / 2) {
+                        memmove(buf, buf + pos, have - pos);
+                        have -= pos;
+                        pos = 0;
+                        while (have < window) {
+                                r = pread(fd, buf + have, window - have, 
+                                        off);
+                                if (r < 0) {
+                                        if (errno == EINTR)
+                                                continue;
+                                        handle_error("pread");
+                                }
+                                if (r == 0) {
+                                        eof = 1;
+                                        break;
+                                }
+                                have += r;
+                                off += r;
+                        }
+                }
+                if (pos == have)
+                        break;
+
+                if (count == size) {
+                        size *= 2;
+                        *digests = realloc(*digests, 
+                                (size_t)size * digest_size);
+                        *lens = realloc(*lens, size * sizeof(uint32_t));
+                        if (*digests == NULL || *lens == NULL)
+                                handle_error("realloc");
+                }
+
+                len = cdc_cut(buf + pos, have - pos);
+                if (buf[pos] == 0 && !memcmp(buf + pos, buf + pos + 1, 
+                                        len - 1))
+                        memset(*digests + count * digest_size, 0, 
+                                digest_size);
+                else if (hash_digest(ctx, buf + pos, len, 
+                                *digests + count * digest_size) 
+                                != digest_size)
+                        handle_error("hash_digest");
+                (*lens)[count++] = len;
+                pos += len;
+        }
+
+        free(buf);
+
+        return count;
+}
@@ -1,29 +1,202 @@
 #include <openssl/evp.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif /* HAVE_XXHASH */
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif /* HAVE_BLAKE3 */
+#include "lcopy.h"
 
 #define ALGO EVP_md5()
 
+/* String representation of hash algorithms, indexed by HashAlgo. */
+const char* hash_str[] = {
+        "md5",
+        "sha256",
+        "blake2s",
+        "xxh128",
+        "blake3"
+};
+
+/* Hash context, reusable across hash_digest calls. */
+struct hash_ctx {
+        int algo;
+        const EVP_MD *md;       /* OpenSSL algorithms. */
+        EVP_MD_CTX *evp;
+#ifdef HAVE_BLAKE3
+        blake3_hasher blake3;
+#endif /* HAVE_BLAKE3 */
+};
+
+/** returns OpenSSL digest of algo, NULL if it is not an OpenSSL one */
+static const EVP_MD *hash_md(int algo) {
+        switch (algo) {
+        case HASH_MD5:
+                return EVP_md5();
+        case HASH_SHA256:
+                return EVP_sha256();
+        case HASH_BLAKE2S:
+                return EVP_blake2s256();
+        }
+
+        return NULL;
+}
+
+/** returns non-zero if algo is compiled in */
+int hash_available(int algo) {
+        switch (algo) {
+        case HASH_MD5:
+        case HASH_SHA256:
+        case HASH_BLAKE2S:
+                return hash_md(algo) != NULL;
+#ifdef HAVE_XXHASH
+        case HASH_XXH128:
+                return 1;
+#endif /* HAVE_XXHASH */
+#ifdef HAVE_BLAKE3
+        case HASH_BLAKE3:
+                return 1;
+#endif /* HAVE_BLAKE3 */
+        }
+
+        return 0;
+}
+
+/** returns digest size of algo in bytes */
+int hash_size(int algo) {
+        switch (algo) {
+        case HASH_MD5:
+        case HASH_XXH128:
+                return 16;
+        case HASH_SHA256:
+        case HASH_BLAKE2S:
+        case HASH_BLAKE3:
+                return 32;
+        }
+
+        return -1;
+}
+
+/** allocate a context of algo
+ returns NULL if algo is not available or on allocation failure
+*/
+struct hash_ctx *hash_ctx_new(int algo) {
+        struct hash_ctx *ctx;
+
+        if (!hash_available(algo))
+                return NULL;
+
+        ctx = calloc(1, sizeof(*ctx));
+        if (ctx == NULL)
+                return NULL;
+
+        ctx->algo = algo;
+        ctx->md = hash_md(algo);
+        if (ctx->md != NULL) {
+                ctx->evp = EVP_MD_CTX_new();
+                if (ctx->evp == NULL) {
+                        free(ctx);
+                        return NULL;
+                }
+        }
+
+        return ctx;
+}
+
+/** release a context allocated with hash_ctx_new */
+void hash_ctx_free(struct hash_ctx *ctx) {
+        if (ctx == NULL)
+                return;
+        EVP_MD_CTX_free(ctx->evp);
+        free(ctx);
+}
+
+/** get a bufffer and calculate its digest with the algorithm of ctx
+ @ctx hash context, reinitialized on every call
+ @buffer to find checksum
+ @dgst an array with at least hash_size(algo) bytes to put the result
+ @n size of the buffer
+ returns digest size, negative on error
+*/
+int hash_digest(struct hash_ctx *ctx, const void *buffer, size_t n,
+                unsigned char *dgst) {
+        unsigned int ds;
+
+        switch (ctx->algo) {
+#ifdef HAVE_XXHASH
+        case HASH_XXH128: {
+                XXH128_canonical_t canon;
+
+                XXH128_canonicalFromHash(&canon, XXH3_128bits(buffer, n));
+                memcpy(dgst, canon.digest, sizeof(canon.digest));
+                return sizeof(canon.digest);
+        }
+#endif /* HAVE_XXHASH */
+#ifdef HAVE_BLAKE3
+        case HASH_BLAKE3:
+                blake3_hasher_init(&ctx->blake3);
+                blake3_hasher_update(&ctx->blake3, buffer, n);
+                blake3_hasher_finalize(&ctx->blake3, dgst, 32);
+                return 32;
+#endif /* HAVE_BLAKE3 */
+        }
+
+        if (!EVP_DigestInit_ex(ctx->evp, ctx->md, NULL))
+                return -1;
+        EVP_DigestUpdate(ctx->evp, buffer, n);
+        EVP_DigestFinal_ex(ctx->evp, dgst, &ds);
+
+        return ds;
+}
+
+/** calculate digests of n buffers with the algorithm of ctx
+ MD5 digests several buffers at once on one core, see md5mb.c
+ @bufs buffers to find checksums of, lens[i] bytes each
+ @dgsts n arrays with at least hash_size(algo) bytes to put the results
+ returns digest size, negative on error
+*/
+int hash_digest_many(struct hash_ctx *ctx, const void **bufs,
+                const size_t *lens, int n, unsigned char **dgsts) {
+        int ds = hash_size(ctx->algo);
+        int i;
+
+        if (ctx->algo == HASH_MD5) {
+                md5_many((const unsigned char **)bufs, lens, n, dgsts);
+                return ds;
+        }
+
+        for (i = 0; i < n; i++)
+                if (hash_digest(ctx, bufs[i], lens[i], dgsts[i]) != ds)
+                        return -1;
+
+        return ds;
+}
+
 /** get a bufffer and calculate md5 sum of the buffer
  @buffer to find checksum
  @dgst an array with at least EVP_MD_size(md) bytes to put the result
  @n size of the buffer
 */
 int digmd5(const char *buffer, char *dgst, int n) {
-        size_t r;
-        int m = 0;
-        int ds;
-
-        EVP_MD_CTX ctx;
+        unsigned int ds;
+        EVP_MD_CTX *ctx;
         const EVP_MD *md;
 
         md = ALGO;
         if (md == NULL) /* invalid ALGO */
                 return -2;
 
-        EVP_DigestInit(&ctx, md);
-        ds = EVP_MD_size(md);
-        EVP_DigestUpdate(&ctx, buffer, n);
-        EVP_DigestFinal(&ctx, dgst, &ds);
+        ctx = EVP_MD_CTX_new();
+        if (ctx == NULL)
+                return -1;
+
+        EVP_DigestInit_ex(ctx, md, NULL);
+        EVP_DigestUpdate(ctx, buffer, n);
+        EVP_DigestFinal_ex(ctx, (unsigned char *)dgst, &ds);
+        EVP_MD_CTX_free(ctx);
 
         return ds;
 }
@@ -0,0 +1,658 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <immintrin.h>
+#include "lcopy.h"
+
+/* Nanoseconds of a timestamp. */
+static int64_t timespec_ns(const struct timespec *ts) {
+        return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/*
+ * Returns non-zero if h is a header of the current version, digest
+ * algorithm and chunk size, written for the file described by st.
+ */
+int digs_header_match(const struct digs_header *h, const struct stat *st) {
+        return !memcmp(h->magic, DIGS_MAGIC, sizeof(h->magic)) &&
+                h->version == DIGS_VERSION &&
+                h->header_size == DIGS_HEADER_SIZE &&
+                h->algo == (uint32_t)hash_algo &&
+                h->digest_size == (uint32_t)digest_size &&
+                h->chunk_size == (uint64_t)chunk_size &&
+                h->size == (uint64_t)st->st_size &&
+                h->mtime_ns == timespec_ns(&st->st_mtim) &&
+                h->ctime_ns == timespec_ns(&st->st_ctim) &&
+                h->ino == (uint64_t)st->st_ino &&
+                h->dev == (uint64_t)st->st_dev &&
+                h->flags == (uint32_t)(cdc ? DIGS_CDC : 0);
+}
+
+/*
+ * Returns non-zero if the digest file open on digs_fd holds valid digests
+ * of the file open on fd. Costs one fstat and one header read, the
+ * digests themselves are not read.
+ */
+int digs_fresh(int digs_fd, int fd) {
+        return digs_root(digs_fd, fd, NULL);
+}
+
+/*
+ * Like digs_fresh, also sets root, unless NULL, to the root digest of a
+ * fresh digest file.
+ */
+int digs_root(int digs_fd, int fd, unsigned char *root) {
+        struct digs_header h;
+        struct stat st;
+        ssize_t r;
+
+        if (fstat(fd, &st) != 0)
+                handle_error("fstat");
+
+        r = pread(digs_fd, &h, sizeof(h), 0);
+
+        if (r != sizeof(h) || !digs_header_match(&h, &st))
+                return 0;
+        if (root != NULL)
+                memcpy(root, h.root, digest_size);
+
+        return 1;
+}
+
+/* Writes len bytes of buf at off of fd. */
+static void digs_pwrite(int fd, const void *buf, size_t len, off_t off) {
+        size_t n;
+        ssize_t r;
+
+        for (n = 0; n < len; n += r) {
+                r = pwrite(fd, (const char *)buf + n, len - n, off + n);
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                r = 0;
+                                continue;
+                        }
+                        handle_error("pwrite");
+                }
+        }
+}
+
+/* Number of tree levels above count digests, the top one has one node. */
+static int tree_levels(long count) {
+        int levels = 0;
+
+        do {
+                count = (count + DIGS_FANOUT - 1) / DIGS_FANOUT;
+                levels++;
+        } while (count > 1);
+
+        return levels;
+}
+
+/*
+ * Builds the tree levels above count digests into tree, level by level
+ * bottom up, and copies the root to root.
+ * Returns number of tree nodes.
+ */
+static long tree_build(const unsigned char *digests, long count,
+                unsigned char *tree, unsigned char *root) {
+        struct hash_ctx *ctx = pool_local_worker()->hash;
+        const unsigned char *below = digests;
+        unsigned char *node = tree;
+        long nodes = 0;
+        long n = count;
+        long m;
+        long i;
+
+        do {
+                m = (n + DIGS_FANOUT - 1) / DIGS_FANOUT;
+                if (m == 0)
+                        m = 1;
+                for (i = 0; i < m; i++) {
+                        if (hash_digest(ctx, below + i * DIGS_FANOUT * 
+                                        digest_size, (n - i * DIGS_FANOUT < 
+                                        DIGS_FANOUT ? n - i * DIGS_FANOUT : 
+                                        DIGS_FANOUT) * digest_size, 
+                                        node + i * digest_size) 
+                                        != digest_size)
+                                handle_error("hash_digest");
+                }
+                below = node;
+                node += m * digest_size;
+                nodes += m;
+                n = m;
+        } while (n > 1);
+
+        memcpy(root, node - digest_size, digest_size);
+
+        return nodes;
+}
+
+/*
+ * Writes count digests and a header describing the file open on fd to
+ * the digest file open on digs_fd. With --cdc, lens holds the length of
+ * each chunk and is written after the digests. The Merkle tree over the
+ * digests is written last. The header goes last, so an
+ * interrupted write leaves a header that does not match the file.
+ */
+void digs_write(int digs_fd, int fd, const unsigned char *digests,
+                const uint32_t *lens, long count) {
+        struct digs_header h;
+        struct stat st;
+        unsigned char *tree;
+        size_t len = (size_t)count * digest_size;
+        long nodes;
+
+        memset(&h, 0, sizeof(h));
+
+        digs_pwrite(digs_fd, digests, len, DIGS_HEADER_SIZE);
+        if (lens != NULL) {
+                digs_pwrite(digs_fd, lens, count * sizeof(uint32_t),
+                        DIGS_HEADER_SIZE + len);
+                len += count * sizeof(uint32_t);
+        }
+
+        /* Every level has at most a DIGS_FANOUT'th of the nodes below. */
+        tree = malloc(((size_t)count / (DIGS_FANOUT - 1) + 
+                        DIGS_MAX_LEVELS) * digest_size);
+        if (tree == NULL)
+                handle_error("malloc");
+        nodes = tree_build(digests, count, tree, h.root);
+        digs_pwrite(digs_fd, tree, nodes * digest_size, 
+                DIGS_HEADER_SIZE + len);
+        len += nodes * digest_size;
+        free(tree);
+
+        if (ftruncate(digs_fd, DIGS_HEADER_SIZE + len) != 0)
+                handle_error("ftruncate");
+
+        if (fstat(fd, &st) != 0)
+                handle_error("fstat");
+
+        memcpy(h.magic, DIGS_MAGIC, sizeof(h.magic));
+        h.version = DIGS_VERSION;
+        h.header_size = DIGS_HEADER_SIZE;
+        h.algo = hash_algo;
+        h.digest_size = digest_size;
+        h.chunk_size = chunk_size;
+        h.count = count;
+        h.size = st.st_size;
+        h.mtime_ns = timespec_ns(&st.st_mtim);
+        h.ctime_ns = timespec_ns(&st.st_ctim);
+        h.ino = st.st_ino;
+        h.dev = st.st_dev;
+        h.flags = cdc ? DIGS_CDC : 0;
+
+        if (pwrite(digs_fd, &h, sizeof(h), 0) != sizeof(h))
+                handle_error("pwrite");
+}
+
+/*
+ * Maps the digest file open on fd read only. A file without a valid
+ * header maps as zero digests.
+ * Returns 0 on success.
+ */
+int digs_map(int fd, struct digs *d) {
+        struct digs_header h;
+        struct stat info;
+        size_t off;
+        void *map;
+        int l;
+
+        memset(d, 0, sizeof(*d));
+        d->size = digest_size;
+
+        if (fstat(fd, &info) != 0)
+                return -1;
+
+        if (info.st_size < DIGS_HEADER_SIZE ||
+                        pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+                        memcmp(h.magic, DIGS_MAGIC, sizeof(h.magic)) ||
+                        h.version != DIGS_VERSION ||
+                        h.header_size != DIGS_HEADER_SIZE ||
+                        (h.flags & DIGS_DIR) || 
+                        h.digest_size == 0 ||
+                        h.digest_size > MAX_DIGEST_SIZE)
+                return 0;
+
+        d->size = h.digest_size;
+        d->file_size = h.size;
+        memcpy(d->root, h.root, d->size);
+        d->count = (info.st_size - DIGS_HEADER_SIZE) / (d->size + 
+                (h.flags & DIGS_CDC ? sizeof(uint32_t) : 0));
+        if ((uint64_t)d->count > h.count)
+                d->count = h.count;
+        if (d->count == 0)
+                return 0;
+        /* Lengths are only found after all count digests. */
+        if ((h.flags & DIGS_CDC) && (uint64_t)d->count != h.count) {
+                d->count = 0;
+                return 0;
+        }
+
+        d->map_size = info.st_size;
+        map = mmap(NULL, d->map_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+                d->map_size = 0;
+                return -1;
+        }
+        madvise(map, d->map_size, MADV_SEQUENTIAL);
+        d->digests = (unsigned char *)map + DIGS_HEADER_SIZE;
+        off = d->count * d->size;
+        if (h.flags & DIGS_CDC) {
+                d->lens = (uint32_t *)(d->digests + off);
+                off += d->count * sizeof(uint32_t);
+        }
+
+        /* Tree levels, if the file holds all of them. */
+        d->level[0] = d->digests;
+        d->nodes[0] = d->count;
+        if ((uint64_t)d->count != h.count || 
+                        tree_levels(d->count) >= DIGS_MAX_LEVELS)
+                return 0;
+        for (l = 1; l <= tree_levels(d->count); l++) {
+                d->level[l] = d->digests + off;
+                d->nodes[l] = (d->nodes[l - 1] + DIGS_FANOUT - 1) / 
+                        DIGS_FANOUT;
+                off += d->nodes[l] * d->size;
+        }
+        if (DIGS_HEADER_SIZE + off <= d->map_size)
+                d->levels = l - 1;
+
+        return 0;
+}
+
+/* Unmaps a digest file mapped with digs_map. */
+void digs_unmap(struct digs *d) {
+        if (d->map_size)
+                munmap(d->digests - DIGS_HEADER_SIZE, d->map_size);
+        memset(d, 0, sizeof(*d));
+}
+
+/* Returns non-zero if digest is the zero digest of a chunk of zeros. */
+int digs_is_zero(const unsigned char *digest) {
+        int i;
+
+        for (i = 0; i < digest_size; i++)
+                if (digest[i])
+                        return 0;
+
+        return 1;
+}
+
+/* Compares size byte digests [i, n) one by one. Returns changed ones. */
+static long digs_diff_scalar(const unsigned char *a, const unsigned char *b,
+                int size, long i, long n, uint64_t *bitmap) {
+        long changed = 0;
+
+        for (; i < n; i++) {
+                if (memcmp(a + i * size, b + i * size, size)) {
+                        BITMAP_SET(bitmap, i);
+                        changed++;
+                }
+        }
+
+        return changed;
+}
+
+/* One 16 byte digest per compare, 32 byte digests in two compares. */
+__attribute__((target("sse2")))
+static long digs_diff_sse2(const unsigned char *a, const unsigned char *b,
+                int size, long n, uint64_t *bitmap) {
+        long changed = 0;
+        long i;
+        int k;
+        int m;
+
+        for (i = 0; i < n; i++) {
+                m = 0xffff;
+                for (k = 0; k < size; k += 16)
+                        m &= _mm_movemask_epi8(_mm_cmpeq_epi8(
+                                _mm_loadu_si128((const __m128i *)
+                                        (a + i * size + k)),
+                                _mm_loadu_si128((const __m128i *)
+                                        (b + i * size + k))));
+                if (m != 0xffff) {
+                        BITMAP_SET(bitmap, i);
+                        changed++;
+                }
+        }
+
+        return changed;
+}
+
+/* Two 32 byte digests per iteration, one per compare. */
+__attribute__((target("avx2")))
+static long digs_diff_avx2_32(const unsigned char *a, const unsigned char *b,
+                long n, uint64_t *bitmap) {
+        long changed = 0;
+        long i;
+        uint32_t m0, m1;
+
+        for (i = 0; i + 2 <= n; i += 2) {
+                m0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                        _mm256_loadu_si256((const __m256i *)(a + i * 32)),
+                        _mm256_loadu_si256((const __m256i *)(b + i * 32))));
+                m1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                        _mm256_loadu_si256((const __m256i *)(a + i * 32 + 32)),
+                        _mm256_loadu_si256((const __m256i *)(b + i * 32 + 32))));
+                if ((m0 & m1) == 0xffffffff)
+                        continue;
+                if (m0 != 0xffffffff) {
+                        BITMAP_SET(bitmap, i);
+                        changed++;
+                }
+                if (m1 != 0xffffffff) {
+                        BITMAP_SET(bitmap, i + 1);
+                        changed++;
+                }
+        }
+
+        return changed + digs_diff_scalar(a, b, 32, i, n, bitmap);
+}
+
+/* Four 16 byte digests per iteration, two per compare. */
+__attribute__((target("avx2")))
+static long digs_diff_avx2_16(const unsigned char *a, const unsigned char *b,
+                long n, uint64_t *bitmap) {
+        long changed = 0;
+        long i;
+        uint32_t m0, m1;
+        __m256i x0, y0, x1, y1;
+
+        for (i = 0; i + 4 <= n; i += 4) {
+                x0 = _mm256_loadu_si256((const __m256i *)(a + i * 16));
+                y0 = _mm256_loadu_si256((const __m256i *)(b + i * 16));
+                x1 = _mm256_loadu_si256((const __m256i *)(a + i * 16 + 32));
+                y1 = _mm256_loadu_si256((const __m256i *)(b + i * 16 + 32));
+                m0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0));
+                m1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1));
+                /* Equal digests fill their 16 mask bits. */
+                if ((m0 & m1) == 0xffffffff)
+                        continue;
+                if ((m0 & 0xffff) != 0xffff) {
+                        BITMAP_SET(bitmap, i);
+                        changed++;
+                }
+                if ((m0 >> 16) != 0xffff) {
+                        BITMAP_SET(bitmap, i + 1);
+                        changed++;
+                }
+                if ((m1 & 0xffff) != 0xffff) {
+                        BITMAP_SET(bitmap, i + 2);
+                        changed++;
+                }
+                if ((m1 >> 16) != 0xffff) {
+                        BITMAP_SET(bitmap, i + 3);
+                        changed++;
+                }
+        }
+
+        return changed + digs_diff_scalar(a, b, 16, i, n, bitmap);
+}
+
+/*
+ * Compares src and dest digests [first, last) and sets their bits in
+ * bitmap for changed chunks. first is a multiple of 64.
+ * Returns number of changed chunks.
+ */
+static long digs_diff_span(const struct digs *src, const struct digs *dest,
+                long first, long last, uint64_t *bitmap) {
+        const unsigned char *a = src->digests + first * src->size;
+        const unsigned char *b = dest->digests + first * src->size;
+        uint64_t *map = bitmap + first / 64;
+        long n = last < dest->count ? last : dest->count;
+        long changed;
+        long i;
+
+        n = n > first ? n - first : 0;
+        if (src->size != dest->size) {
+                /* Digests of different algorithms never match. */
+                n = 0;
+                changed = 0;
+        } else if (__builtin_cpu_supports("avx2") && src->size == 16) {
+                changed = digs_diff_avx2_16(a, b, n, map);
+        } else if (__builtin_cpu_supports("avx2") && src->size == 32) {
+                changed = digs_diff_avx2_32(a, b, n, map);
+        } else if (__builtin_cpu_supports("sse2") && src->size % 16 == 0) {
+                changed = digs_diff_sse2(a, b, src->size, n, map);
+        } else {
+                changed = digs_diff_scalar(a, b, src->size, 0, n, map);
+        }
+
+        for (i = first + n; i < last; i++) {
+                BITMAP_SET(bitmap, i);
+                changed++;
+        }
+
+        return changed;
+}
+
+/* Returns non-zero if node k of tree level l is the same in a and b. */
+static int digs_node_same(const struct digs *a, const struct digs *b,
+                int l, long k) {
+        return l <= b->levels && k < b->nodes[l] &&
+                !memcmp(a->level[l] + k * a->size, b->level[l] + k * a->size,
+                        a->size);
+}
+
+/* Compares the chunks below node k of tree level l, see digs_diff. */
+static long digs_diff_node(const struct digs *src, const struct digs *dest,
+                int l, long k, uint64_t *bitmap) {
+        long first = k * DIGS_FANOUT;
+        long last = first + DIGS_FANOUT;
+        long changed = 0;
+        long c;
+
+        if (last > src->nodes[l - 1])
+                last = src->nodes[l - 1];
+
+        if (l == 1)
+                return digs_diff_span(src, dest, first, last, bitmap);
+
+        for (c = first; c < last; c++) {
+                if (!digs_node_same(src, dest, l - 1, c))
+                        changed += digs_diff_node(src, dest, l - 1, c, 
+                                        bitmap);
+        }
+
+        return changed;
+}
+
+/*
+ * Compares src and dest digests and sets bit i of bitmap for every
+ * changed chunk i. Chunks without a destination digest are changed.
+ * With trees on both sides only branches whose nodes differ are
+ * descended, equal files cost one root comparison.
+ * bitmap must hold BITMAP_WORDS(src->count) zeroed words.
+ * Returns number of changed chunks.
+ */
+long digs_diff(const struct digs *src, const struct digs *dest,
+                uint64_t *bitmap) {
+        if (src->levels == 0 || dest->levels == 0 || 
+                        src->size != dest->size)
+                return digs_diff_span(src, dest, 0, src->count, bitmap);
+
+        if (digs_node_same(src, dest, src->levels, 0))
+                return 0;
+
+        return digs_diff_node(src, dest, src->levels, 0, bitmap);
+}
+
+/* Returns non-zero if a and b are digests of files of equal content. */
+int digs_same(const struct digs *a, const struct digs *b) {
+        return a->size == b->size && a->count == b->count &&
+                a->file_size == b->file_size &&
+                !memcmp(a->root, b->root, a->size);
+}
+
+/*
+ * Reads the entry records of the directory digest file open on fd into
+ * a malloc'ed *ents and its root digest into root.
+ * Returns 0 on success, -1 unless it is a directory digest file of the
+ * current hash algorithm, chunk size and chunking.
+ */
+int digs_read_dir(int fd, struct digs_dirent **ents, long *count,
+                unsigned char *root) {
+        struct digs_header h;
+        size_t len;
+
+        *ents = NULL;
+        *count = 0;
+
+        if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+                        memcmp(h.magic, DIGS_MAGIC, sizeof(h.magic)) ||
+                        h.version != DIGS_VERSION ||
+                        h.header_size != DIGS_HEADER_SIZE ||
+                        h.flags != (uint32_t)(DIGS_DIR | 
+                                (cdc ? DIGS_CDC : 0)) ||
+                        h.algo != (uint32_t)hash_algo ||
+                        h.chunk_size != (uint64_t)chunk_size)
+                return -1;
+
+        len = h.count * sizeof(struct digs_dirent);
+        *ents = malloc(len + 1);
+        if (*ents == NULL)
+                handle_error("malloc");
+        if (pread(fd, *ents, len, DIGS_HEADER_SIZE) != (ssize_t)len) {
+                free(*ents);
+                *ents = NULL;
+                return -1;
+        }
+        *count = h.count;
+        memcpy(root, h.root, digest_size);
+
+        return 0;
+}
+
+/*
+ * Sets root to the digest of count directory entries, over their names,
+ * types, sizes and roots, and writes them to the directory digest file
+ * open on fd.
+ */
+void digs_write_dir(int fd, const struct digs_dirent *ents, long count,
+                unsigned char *root) {
+        struct hash_ctx *ctx = pool_local_worker()->hash;
+        struct digs_header h;
+        unsigned char *buf;
+        unsigned char *p;
+        uint32_t type;
+        long i;
+
+        buf = malloc(count * sizeof(struct digs_dirent) + 1);
+        if (buf == NULL)
+                handle_error("malloc");
+        for (p = buf, i = 0; i < count; i++) {
+                strcpy((char *)p, ents[i].name);
+                p += strlen(ents[i].name) + 1;
+                type = ents[i].mode & S_IFMT;
+                memcpy(p, &type, sizeof(type));
+                p += sizeof(type);
+                memcpy(p, &ents[i].size, sizeof(ents[i].size));
+                p += sizeof(ents[i].size);
+                memcpy(p, ents[i].root, digest_size);
+                p += digest_size;
+        }
+        if (hash_digest(ctx, buf, p - buf, root) != digest_size)
+                handle_error("hash_digest");
+        free(buf);
+
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, DIGS_MAGIC, sizeof(h.magic));
+        h.version = DIGS_VERSION;
+        h.header_size = DIGS_HEADER_SIZE;
+        h.algo = hash_algo;
+        h.digest_size = digest_size;
+        h.chunk_size = chunk_size;
+        h.count = count;
+        h.flags = DIGS_DIR | (cdc ? DIGS_CDC : 0);
+        memcpy(h.root, root, digest_size);
+
+        digs_pwrite(fd, ents, count * sizeof(struct digs_dirent), 
+                DIGS_HEADER_SIZE);
+        if (ftruncate(fd, DIGS_HEADER_SIZE + 
+                                count * sizeof(struct digs_dirent)) != 0)
+                handle_error("ftruncate");
+        if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+                handle_error("pwrite");
+}
+
+/* Slot of a digest, its first bytes are already uniformly distributed. */
+static size_t digs_slot(const struct digs_index *x, 
+                const unsigned char *digest) {
+        uint64_t h;
+
+        memcpy(&h, digest, sizeof(h));
+
+        return h & x->mask;
+}
+
+/*
+ * Indexes the chunks of d by digest, d must stay mapped. Chunks set in
+ * skip, if not NULL, are left out. Chunks of fixed size digest files
+ * are chunk_size long.
+ */
+void digs_index_build(struct digs_index *x, const struct digs *d,
+                const uint64_t *skip) {
+        size_t nslots = 16;
+        size_t s;
+        long i;
+
+        while (nslots < (size_t)d->count * 2)
+                nslots *= 2;
+
+        x->digs = d;
+        x->mask = nslots - 1;
+        x->slots = calloc(nslots, sizeof(long));
+        x->offs = malloc((d->count + 1) * sizeof(off_t));
+        if (x->slots == NULL || x->offs == NULL)
+                handle_error("malloc");
+
+        x->offs[0] = 0;
+        for (i = 0; i < d->count; i++) {
+                x->offs[i + 1] = x->offs[i] + 
+                        (d->lens ? d->lens[i] : chunk_size);
+                if (skip != NULL && BITMAP_TEST(skip, i))
+                        continue;
+
+                /* The first of equal chunks is kept. */
+                if (digs_index_find(x, d->digests + i * d->size, 
+                                d->lens ? d->lens[i] : 0) >= 0)
+                        continue;
+                for (s = digs_slot(x, d->digests + i * d->size); 
+                                x->slots[s]; s = (s + 1) & x->mask)
+                        ;
+                x->slots[s] = i + 1;
+        }
+}
+
+/*
+ * Finds a chunk of len bytes with digest, len is ignored for fixed size
+ * chunks. Returns its index, -1 if there is none.
+ */
+long digs_index_find(const struct digs_index *x, const unsigned char *digest,
+                uint32_t len) {
+        const struct digs *d = x->digs;
+        size_t s;
+        long i;
+
+        for (s = digs_slot(x, digest); x->slots[s]; s = (s + 1) & x->mask) {
+                i = x->slots[s] - 1;
+                if ((d->lens == NULL || d->lens[i] == len) && 
+                                !memcmp(d->digests + i * d->size, digest, 
+                                        d->size))
+                        return i;
+        }
+
+        return -1;
+}
+
+void digs_index_free(struct digs_index *x) {
+        free(x->slots);
+        free(x->offs);
+}
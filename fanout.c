@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "lcopy.h"
+
+/*
+ * Fan-out copies, --fanout. One source file is read and digested once
+ * and every range of its chunks is diffed against each destination.
+ * The chunks all destinations lack are written as one I/O batch, so
+ * writes to destinations on several disks are in flight together.
+ * Each destination keeps its own digest file; they are opened and
+ * refreshed on a thread per destination before the source is read.
+ */
+
+/* Destination of a fan-out copy. */
+struct fan_dest {
+        char *path;
+        int threads;            /* Threads refreshing its digests. */
+        FILE *f;
+        FILE *digs_f;
+        struct digs digs;
+};
+
+struct fan_job {
+        int fd;                 /* Source file descriptor. */
+        off_t size;             /* Source size. */
+        int fresh;              /* Source digests are read, not computed. */
+        unsigned char *digests; /* Digest of chunk i at i*digest_size. */
+        struct fan_dest *dests;
+        int ndests;
+};
+
+/* Returns non-zero if chunk i of d differs from the source. */
+static int fan_dirty(const struct fan_job *fj, const struct fan_dest *d,
+                long i) {
+        return i >= d->digs.count || memcmp(fj->digests + i * digest_size,
+                d->digs.digests + i * digest_size, digest_size);
+}
+
+/*
+ * Opens a destination, created if missing, and maps its digests. Runs
+ * on a thread of its own, which frees its worker on exit.
+ */
+static void *fan_open(void *arg) {
+        struct fan_dest *d = arg;
+        int fd;
+
+        set_chunk_threads(d->threads);
+        fd = open(d->path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0 || (d->f = fdopen(fd, "r+")) == NULL)
+                handle_error(d->path);
+        d->digs_f = open_digest_file(d->path, d->f);
+        if (digs_map(fileno(d->digs_f), &d->digs) != 0)
+                handle_error("mmap");
+
+        return NULL;
+}
+
+/*
+ * Reads and, unless known, digests a range of source chunks, then
+ * writes the chunks each destination lacks in one I/O batch.
+ */
+static void fan_range(void *arg, struct worker *w, long start, long end) {
+        struct fan_job *fj = arg;
+        ssize_t lens[MAX_CHUNKS_PER_RANGE];
+        char holes[MAX_CHUNKS_PER_RANGE];
+        struct io_req *reqs;
+        struct io_req *last;
+        struct fan_dest *d;
+        uint64_t t;
+        int nreqs = 0;
+        long i;
+        int k;
+
+        /* Ranges of known digests are read only if a chunk changed. */
+        if (fj->fresh) {
+                for (k = 0; k < fj->ndests; k++)
+                        for (i = start; i < end; i++)
+                                if (fan_dirty(fj, &fj->dests[k], i))
+                                        goto dirty;
+                return;
+        }
+dirty:
+        read_chunks(w, fj->fd, fj->size, start, end, lens, holes);
+        if (!fj->fresh)
+                digest_chunks(w, start, end, lens, holes,
+                        fj->digests + start * digest_size);
+
+        reqs = malloc(sizeof(*reqs) * (end - start) * fj->ndests);
+        if (reqs == NULL)
+                handle_error("malloc");
+
+        for (k = 0; k < fj->ndests; k++) {
+                d = &fj->dests[k];
+                for (i = start; i < end; i++) {
+                        if (lens[i - start] == 0 || !fan_dirty(fj, d, i))
+                                continue;
+                        if (digs_is_zero(fj->digests + i * digest_size)) {
+                                zero_range(fileno(d->f), CHUNK_OFF(i),
+                                        lens[i - start]);
+                                continue;
+                        }
+
+                        /* Extend the previous write if this chunk follows. */
+                        last = nreqs ? &reqs[nreqs - 1] : NULL;
+                        if (last != NULL && last->fd == fileno(d->f) &&
+                                        last->off + (off_t)last->len ==
+                                        CHUNK_OFF(i)) {
+                                last->len += lens[i - start];
+                                continue;
+                        }
+                        reqs[nreqs].fd = fileno(d->f);
+                        reqs[nreqs].write = 1;
+                        reqs[nreqs].buf = w->buf + CHUNK_OFF(i - start);
+                        reqs[nreqs].len = lens[i - start];
+                        reqs[nreqs].off = CHUNK_OFF(i);
+                        nreqs++;
+                }
+        }
+
+        t = stats_clock();
+        io_batch(w->io, reqs, nreqs);
+        stats_since(STAT_COPY, t);
+        for (k = 0; k < nreqs; k++)
+                stats_add(STAT_WRITTEN, reqs[k].len);
+        free(reqs);
+}
+
+/*
+ * Copies regular file src to each of ndests destinations, reading and
+ * digesting src once. Destination digests are refreshed on a thread
+ * each, which share the nthreads digest threads, then written from the
+ * source digests.
+ * Returns 0 on success.
+ */
+int fanout_copy(const char *src, char **dests, int ndests) {
+        struct fan_job fj;
+        struct fan_dest *d;
+        struct digs src_digs;
+        struct stat st;
+        pthread_t *tids;
+        FILE *src_f;
+        FILE *src_digs_f;
+        long nchunks;
+        int rc;
+        int k;
+
+        src_f = fopen(src, "r");
+        if (src_f == NULL)
+                handle_error(src);
+        fj.fd = fileno(src_f);
+        if (fstat(fj.fd, &st) != 0)
+                handle_error("fstat");
+        fj.size = st.st_size;
+        fj.ndests = ndests;
+        nchunks = CHUNK_COUNT(st.st_size);
+
+        fj.dests = calloc(ndests, sizeof(*fj.dests));
+        tids = calloc(ndests, sizeof(*tids));
+        if (fj.dests == NULL || tids == NULL)
+                handle_error("calloc");
+        for (k = 0; k < ndests; k++) {
+                fj.dests[k].path = dests[k];
+                fj.dests[k].threads = nthreads / ndests > 1 ? 
+                        nthreads / ndests : 1;
+                rc = pthread_create(&tids[k], NULL, fan_open, &fj.dests[k]);
+                if (rc)
+                        handle_error_en(rc, "pthread_create");
+        }
+
+        /* Stale source digests are computed in the pass over source. */
+        src_digs_f = store_open(src, "r");
+        fj.fresh = src_digs_f != NULL && digs_fresh(fileno(src_digs_f),
+                fj.fd);
+        if (fj.fresh) {
+                if (digs_map(fileno(src_digs_f), &src_digs) != 0)
+                        handle_error("mmap");
+                fj.digests = src_digs.digests;
+        } else {
+                if (src_digs_f != NULL)
+                        store_close(src_digs_f, src);
+                src_digs_f = store_open(src, "w+");
+                if (src_digs_f == NULL)
+                        handle_error("fopen");
+                fj.digests = malloc((size_t)nchunks * digest_size + 1);
+                if (fj.digests == NULL)
+                        handle_error("malloc");
+        }
+
+        for (k = 0; k < ndests; k++)
+                pthread_join(tids[k], NULL);
+
+        pool_run(nchunks, nthreads, fan_range, &fj);
+
+        for (k = 0; k < ndests; k++) {
+                d = &fj.dests[k];
+                digs_unmap(&d->digs);
+                resize_to(fileno(d->f), st.st_size);
+                fflush(d->digs_f);
+                digs_write(fileno(d->digs_f), fileno(d->f), fj.digests,
+                        NULL, nchunks);
+                store_close(d->digs_f, d->path);
+                if (fclose(d->f) != 0)
+                        handle_error(d->path);
+        }
+
+        if (fj.fresh) {
+                digs_unmap(&src_digs);
+        } else {
+                digs_write(fileno(src_digs_f), fj.fd, fj.digests, NULL,
+                        nchunks);
+                free(fj.digests);
+        }
+        store_close(src_digs_f, src);
+        fclose(src_f);
+        free(fj.dests);
+        free(tids);
+
+        return 0;
+}
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "lcopy.h"
+
+/*
+ * Chunk I/O engines. A batch of reads or writes is handed to io_batch()
+ * which returns once all of them are complete. The io_uring engine keeps
+ * up to depth requests in flight, the psync engine issues them one after
+ * another with pread/pwrite.
+ */
+
+/* String representation of engines, indexed by IoEngine. */
+const char* io_engine_str[] = {
+        "psync",
+        "uring"
+};
+
+struct ioeng {
+        int kind;
+        unsigned depth;
+
+        /* io_uring state, valid if kind is IO_URING. */
+        int ring_fd;
+        void *sq_ptr;
+        size_t sq_size;
+        void *cq_ptr;
+        size_t cq_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+};
+
+/* Does the remaining part of req with pread/pwrite from done bytes on. */
+static ssize_t io_sync(struct io_req *req, ssize_t done) {
+        ssize_t r;
+
+        while (done < (ssize_t)req->len) {
+                if (req->write)
+                        r = pwrite(req->fd, (char *)req->buf + done,
+                                req->len - done, req->off + done);
+                else
+                        r = pread(req->fd, (char *)req->buf + done,
+                                req->len - done, req->off + done);
+                if (r < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        handle_error(req->write ? "pwrite" : "pread");
+                }
+                /* End of file. */
+                if (r == 0)
+                        break;
+                done += r;
+        }
+
+        return done;
+}
+
+static void io_uring_unmap(struct ioeng *e) {
+        if (e->sqes != NULL && e->sqes != MAP_FAILED)
+                munmap(e->sqes, e->sqes_size);
+        if (e->cq_ptr != NULL && e->cq_ptr != MAP_FAILED &&
+                        e->cq_ptr != e->sq_ptr)
+                munmap(e->cq_ptr, e->cq_size);
+        if (e->sq_ptr != NULL && e->sq_ptr != MAP_FAILED)
+                munmap(e->sq_ptr, e->sq_size);
+        if (e->ring_fd >= 0)
+                close(e->ring_fd);
+        e->ring_fd = -1;
+}
+
+/* Sets up an io_uring of e->depth entries. Returns 0 on success. */
+static int io_uring_init(struct ioeng *e) {
+        struct io_uring_params p;
+        char *sq;
+        char *cq;
+
+        memset(&p, 0, sizeof(p));
+        e->ring_fd = syscall(__NR_io_uring_setup, e->depth, &p);
+        if (e->ring_fd < 0)
+                return -1;
+
+        e->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        e->cq_size = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (e->cq_size > e->sq_size)
+                        e->sq_size = e->cq_size;
+                e->cq_size = e->sq_size;
+        }
+
+        e->sq_ptr = mmap(NULL, e->sq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQ_RING);
+        if (e->sq_ptr == MAP_FAILED)
+                goto fail;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                e->cq_ptr = e->sq_ptr;
+        } else {
+                e->cq_ptr = mmap(NULL, e->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, e->ring_fd,
+                        IORING_OFF_CQ_RING);
+                if (e->cq_ptr == MAP_FAILED)
+                        goto fail;
+        }
+
+        e->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        e->sqes = mmap(NULL, e->sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQES);
+        if (e->sqes == MAP_FAILED)
+                goto fail;
+
+        sq = e->sq_ptr;
+        cq = e->cq_ptr;
+        e->sq_head = (unsigned *)(sq + p.sq_off.head);
+        e->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        e->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        e->sq_array = (unsigned *)(sq + p.sq_off.array);
+        e->cq_head = (unsigned *)(cq + p.cq_off.head);
+        e->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        e->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        e->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+        /* Submission queue may be smaller than asked for. */
+        if (p.sq_entries < e->depth)
+                e->depth = p.sq_entries;
+
+        return 0;
+fail:
+        io_uring_unmap(e);
+        return -1;
+}
+
+/*
+ * Opens an engine of kind with up to depth requests in flight.
+ * Falls back to psync if io_uring cannot be set up.
+ */
+struct ioeng *io_open(int kind, unsigned depth) {
+        struct ioeng *e;
+
+        e = calloc(1, sizeof(*e));
+        if (e == NULL)
+                handle_error("calloc");
+
+        e->kind = IO_PSYNC;
+        e->depth = depth ? depth : 1;
+        e->ring_fd = -1;
+
+        if (kind == IO_URING && io_uring_init(e) == 0)
+                e->kind = IO_URING;
+
+        return e;
+}
+
+/* Closes an engine opened with io_open. */
+void io_close(struct ioeng *e) {
+        if (e == NULL)
+                return;
+        if (e->kind == IO_URING)
+                io_uring_unmap(e);
+        free(e);
+}
+
+/* Returns the engine kind in use, IO_PSYNC after a fallback. */
+int io_kind(struct ioeng *e) {
+        return e->kind;
+}
+
+/* Queues req as the sqe of index i without submitting it. */
+static void io_uring_queue(struct ioeng *e, struct io_req *req, int i) {
+        unsigned tail = *e->sq_tail;
+        unsigned idx = tail & *e->sq_mask;
+        struct io_uring_sqe *sqe = &e->sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = req->fd;
+        sqe->addr = (unsigned long)req->buf;
+        sqe->len = req->len;
+        sqe->off = req->off;
+        sqe->user_data = i;
+        e->sq_array[idx] = idx;
+
+        __atomic_store_n(e->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int io_uring_batch(struct ioeng *e, struct io_req *reqs, int n) {
+        unsigned head;
+        unsigned inflight = 0;
+        unsigned to_submit = 0;
+        int next = 0;
+        int done = 0;
+        int ret;
+        struct io_uring_cqe *cqe;
+        struct io_req *req;
+
+        while (done < n) {
+                while (inflight < e->depth && next < n) {
+                        io_uring_queue(e, &reqs[next], next);
+                        next++;
+                        inflight++;
+                        to_submit++;
+                }
+
+                ret = syscall(__NR_io_uring_enter, e->ring_fd, to_submit,
+                        1, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        handle_error("io_uring_enter");
+                }
+                to_submit -= ret;
+
+                head = *e->cq_head;
+                while (head != __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE)) {
+                        cqe = &e->cqes[head & *e->cq_mask];
+                        req = &reqs[cqe->user_data];
+                        if (cqe->res < 0 && cqe->res != -EINTR &&
+                                        cqe->res != -EAGAIN &&
+                                        cqe->res != -EINVAL &&
+                                        cqe->res != -EOPNOTSUPP)
+                                handle_error_en(-cqe->res, req->write ?
+                                        "io_uring write" : "io_uring read");
+                        /*
+                         * Short transfers, retries and opcodes the kernel
+                         * does not know are finished synchronously.
+                         */
+                        req->res = io_sync(req, cqe->res < 0 ? 0 : cqe->res);
+                        head++;
+                        inflight--;
+                        done++;
+                }
+                __atomic_store_n(e->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        return 0;
+}
+
+/*
+ * Runs all n requests, sets res of each to the number of bytes
+ * transferred, which is less than len only for reads at end of file.
+ * Returns 0 on success.
+ */
+int io_batch(struct ioeng *e, struct io_req *reqs, int n) {
+        int i;
+
+        if (e->kind == IO_URING)
+                return io_uring_batch(e, reqs, n);
+
+        for (i = 0; i < n; i++)
+                reqs[i].res = io_sync(&reqs[i], 0);
+
+        return 0;
+}
+
+/*
+ * Returns a descriptor of the file open as fd for chunk I/O. With
+ * --direct it is opened anew with O_DIRECT, so that chunks bypass the
+ * page cache; its requests must be DIRECT_ALIGN aligned in offset and
+ * buffer, lengths are padded with DIRECT_LEN. Without --direct, or if
+ * the filesystem does not support O_DIRECT, it is fd itself: callers
+ * tell by comparing, and must not pad writes to a buffered fd.
+ */
+int io_direct_open(int fd) {
+        char path[32];
+        int dfd;
+
+        if (!direct_io)
+                return fd;
+
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        dfd = open(path, (fcntl(fd, F_GETFL) & O_ACCMODE) | O_DIRECT | 
+                        O_CLOEXEC);
+
+        return dfd < 0 ? fd : dfd;
+}
+
+/* Closes dfd, returned by io_direct_open for fd. */
+void io_direct_close(int dfd, int fd) {
+        if (dfd != fd)
+                close(dfd);
+}
+
+/* Hints that fd is read from start to end. */
+void io_sequential(int fd) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/*
+ * With --drop-cache, or --direct, writes back the cached pages of fd
+ * and drops them, pages left by I/O that did not bypass the cache.
+ */
+void io_drop_cache(int fd) {
+        if (!drop_cache)
+                return;
+
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | 
+                        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
@@ -1,22 +1,21 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #include <errno.h>
 #include <string.h>
 #include <dirent.h>
 #include <time.h>
-
-/* Each chunk is SIZE_OF_CHUNK bytes. */
-#define SIZE_OF_CHUNK 131072 /* 128*1024 */
-
-/* Each digest of a chunk is SIZE_OF_DIGEST bytes. */
-#define SIZE_OF_DIGEST 16   /* 128bit */
-
-#define handle_error_en(en, msg) \
-        do { errno = en; perror(msg); exit(EXIT_FAILURE); } while (0);
-        
-#define handle_error(msg) \
-        do { perror(msg); exit(EXIT_FAILURE); } while (0);
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "lcopy.h"
 
 /* Defined exceptions. */
 typedef enum {
@@ -39,168 +38,2298 @@ const char* exception_str[] = {
         "Omitting source file with extension .digs"
 }; 
 
-/* Global program exception. */
-Exception exception;
+/* Strategies used by copy_file_raw. */
+typedef enum {
+        COPY_REFLINK, /* Destination shares source extents (FICLONE). */
+        COPY_RANGE, /* In kernel copy with copy_file_range. */
+        COPY_BUFFER, /* Userspace read/write with a large buffer. */
+} CopyStrategy;
+
+/* String representation of copy strategies. */
+const char* copy_strategy_str[] = {
+        "reflink",
+        "copy_file_range",
+        "read/write"
+};
+
+/* Program exception of the calling thread. */
+__thread Exception exception;
+
+/* Chunk size, its log2 and chunks per pool range. */
+long chunk_size = SIZE_OF_CHUNK;
+int chunk_shift = 17;
+long range_chunks = CHUNKS_PER_RANGE;
+
+/* Number of worker threads, 0 means one per online cpu. */
+int nthreads = 0;
+
+/* Hash algorithm of chunk digests and its digest size. */
+int hash_algo = HASH_MD5;
+int digest_size = 16;
+
+/* I/O engine for chunk and digest I/O. */
+int io_engine = IO_URING;
+
+/* Content defined chunking instead of fixed size chunks. */
+int cdc = 0;
+
+/* Files below this size are copied whole, 0 turns it off. */
+long small_size = 0;
+
+/* Grown sources are taken as appended to, set by --append. */
+int append_mode = 0;
+
+/* Chunk I/O bypasses the page cache, set by --direct. */
+int direct_io = 0;
+
+/* Cached pages of destinations are dropped, set by --drop-cache. */
+int drop_cache = 0;
 
-/* File existence check, returns non-zero if path exists. */
-int is_file_exist(const char *path) {
+/* Deterministic output order. */
+int ordered = 0;
+
+/* Directory check, returns non-zero if the path is a directory. */
+int is_directory(const char *path) {
         struct stat info;
-        if (stat(path, &info) != 0) {
-                if (errno == ENOENT) {
-                        return 0;
-                }
-                /* Ignore other errors that returned from stat call. */
-                
+        if (stat(path, &info) != 0)
                 return 0;
+
+        return S_ISDIR(info.st_mode);
+}
+
+/* Returns non-zero if size and times of a file are equal in a and b. */
+int is_unchanged(const struct stat *a, const struct stat *b) {
+        return a->st_size == b->st_size &&
+                a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+                a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+                a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+                a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/*
+ * Takes the metadata of path, relative to directory dirfd unless it is
+ * absolute, with one statx. Sets st_mode to 0 if path does not exist.
+ * Returns 0 on success.
+ */
+int stat_entry(int dirfd, const char *path, struct stat *st) {
+        struct statx sx;
+        uint64_t t = stats_clock();
+        int rc;
+
+        memset(st, 0, sizeof(*st));
+        rc = statx(dirfd, path, 0, STATX_BASIC_STATS, &sx);
+        stats_since(STAT_STAT, t);
+        if (rc != 0) {
+                if (errno == ENOSYS && fstatat(dirfd, path, st, 0) == 0)
+                        return 0;
+                st->st_mode = 0;
+                return -1;
+        }
+
+        st->st_mode = sx.stx_mode;
+        st->st_ino = sx.stx_ino;
+        st->st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+        st->st_nlink = sx.stx_nlink;
+        st->st_uid = sx.stx_uid;
+        st->st_gid = sx.stx_gid;
+        st->st_size = sx.stx_size;
+        st->st_blksize = sx.stx_blksize;
+        st->st_blocks = sx.stx_blocks;
+        st->st_mtim.tv_sec = sx.stx_mtime.tv_sec;
+        st->st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+        st->st_ctim.tv_sec = sx.stx_ctime.tv_sec;
+        st->st_ctim.tv_nsec = sx.stx_ctime.tv_nsec;
+        st->st_atim.tv_sec = sx.stx_atime.tv_sec;
+        st->st_atim.tv_nsec = sx.stx_atime.tv_nsec;
+
+        return 0;
+}
+
+int lcopy (char *src, char *dest, int rflag);
+int lcopy_entry (char *src, const struct stat *src_st, char *dest, 
+                const struct stat *dest_st, int rflag);
+
+/* Returns extension of a file. */
+const char *get_extension(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (!dot || dot == path)
+        return "";
+    
+    return dot + 1;
+}
+
+/* Returns basename from file path. */
+char* get_basename (const char *path) {
+        char *basename;
+        char *copy;
+        int l = 0;
+        char *ssc;
+        
+        basename = malloc(500);
+        strcpy(basename, path);
+        
+        while (ssc = strstr(basename, "/")) {
+                l = strlen(ssc) + 1;
+                copy = basename;
+                basename = &basename[strlen(basename)-l+2];
+        }
+        
+        /* Like ".../dir/" */
+        if (!strcmp(basename, "")) {
+                char *temp = malloc(500);
+                size_t length = (strlen(copy)-1);
+                /* Drop last '/' and take "dir". */
+                strncpy(temp, copy, length);
+                temp[length] = '\0';
+                return temp;
         }
         
+        return basename;
+}
+
+/* 
+ * Returns digs file path.
+ * path + extension = digs_path
+ */
+char *get_digs_filepath(const char *path) {
+        const char* extension = ".digs";
+        char *digs_path = NULL;
+        
+        if (path == NULL)
+                return;
+
+        digs_path = malloc(strlen(path)+1+5);
+        
+        strcpy(digs_path, path);
+        strcat(digs_path, extension);
+        
+        return digs_path;
+}
+
+/* Share of nthreads of the calling thread, 0 for all of them. */
+static __thread int chunk_share;
+
+/*
+ * Bounds the threads the calling thread digests chunks on, for threads
+ * that digest files side by side. 0 lifts the bound.
+ */
+void set_chunk_threads(int threads) {
+        chunk_share = threads;
+}
+
+/*
+ * Number of threads digesting chunks of one file. Files copied by tree
+ * walk workers are digested on the walking thread.
+ */
+static int chunk_threads(void) {
+        if (walk_active())
+                return 1;
+        return chunk_share ? chunk_share : nthreads;
+}
+
+/* Shared state of a write_digest_file run. */
+struct digest_job {
+        int fd;                 /* Source file descriptor. */
+        off_t size;             /* Source size. */
+        unsigned char *digests; /* Digest of chunk i at i*digest_size. */
+        long first;             /* Chunk of pool range 0. */
+};
+
+/* Returns non-zero if all len bytes of buf are zero. */
+static int is_zero(const unsigned char *buf, size_t len) {
+        return len == 0 || (buf[0] == 0 && !memcmp(buf, buf + 1, len - 1));
+}
+
+/*
+ * Finds the first data segment [*data, *hole) of fd at or after off,
+ * below size. Filesystems without SEEK_DATA report all of it as data.
+ * Returns 0 if only holes are left.
+ */
+static int next_data(int fd, off_t off, off_t size, off_t *data, 
+                off_t *hole) {
+        *data = lseek(fd, off, SEEK_DATA);
+        if (*data < 0) {
+                if (errno == ENXIO)
+                        return 0;
+                *data = off;
+                *hole = size;
+                return off < size;
+        }
+        if (*data >= size)
+                return 0;
+
+        *hole = lseek(fd, *data, SEEK_HOLE);
+        if (*hole < 0 || *hole > size)
+                *hole = size;
+
         return 1;
 }
 
-/* Is it a regular file. */
-int is_regularfile(const char *path) {
+/*
+ * Sets holes[i - start] for chunks [start, end) of fd, a file of size
+ * bytes, that lie entirely in a hole.
+ */
+static void find_holes(int fd, off_t size, long start, long end, 
+                char *holes) {
+        off_t lim = CHUNK_OFF(end) < size ? CHUNK_OFF(end) : size;
+        off_t off = CHUNK_OFF(start);
+        off_t data, hole;
+        long i;
+
+        memset(holes, 0, end - start);
+
+        while (off < lim) {
+                if (!next_data(fd, off, lim, &data, &hole))
+                        data = hole = lim;
+
+                /* Chunks within [off, data) are holes. */
+                for (i = (off + chunk_size - 1) >> chunk_shift; 
+                                i < end && CHUNK_OFF(i) < data; i++) {
+                        if ((CHUNK_OFF(i + 1) < size ? 
+                                        CHUNK_OFF(i + 1) : size) <= data)
+                                holes[i - start] = 1;
+                }
+                off = hole;
+        }
+}
+
+/*
+ * Reads chunks [start, end) of fd, a file of size bytes, into w->buf as
+ * one I/O batch, chunk i at CHUNK_OFF(i - start). Chunks in holes are
+ * not read, holes[i - start] is set for them. Runs of chunks smaller
+ * than SIZE_OF_CHUNK are read SIZE_OF_CHUNK bytes per request.
+ * Sets lens[i - start] to the chunk length, less than chunk_size only at
+ * end of file. With --direct the last chunk is padded with zeros to
+ * DIRECT_LEN, so that it can be written with O_DIRECT as it is; reads
+ * of fd are padded as well, which is harmless if fd is buffered.
+ */
+void read_chunks(struct worker *w, int fd, off_t size, long start, 
+                long end, ssize_t *lens, char *holes) {
+        struct io_req reqs[MAX_CHUNKS_PER_RANGE];
+        size_t seg = chunk_size > SIZE_OF_CHUNK ? chunk_size : SIZE_OF_CHUNK;
+        uint64_t t = stats_clock();
+        off_t n;
+        int nreqs = 0;
+        int r;
+        long i;
+
+        for (i = start; i < end; i++) {
+                n = size - CHUNK_OFF(i);
+                lens[i - start] = n < 0 ? 0 : n > chunk_size ? chunk_size : n;
+        }
+
+        find_holes(fd, size, start, end, holes);
+
+        for (i = start; i < end; i++) {
+                if (holes[i - start] || lens[i - start] == 0)
+                        continue;
+
+                /* Extend the previous read if this chunk follows it. */
+                if (nreqs && reqs[nreqs - 1].off + 
+                                (off_t)reqs[nreqs - 1].len == CHUNK_OFF(i) &&
+                                reqs[nreqs - 1].len + lens[i - start] <= seg) {
+                        reqs[nreqs - 1].len += lens[i - start];
+                        continue;
+                }
+                reqs[nreqs].fd = fd;
+                reqs[nreqs].write = 0;
+                reqs[nreqs].buf = w->buf + CHUNK_OFF(i - start);
+                reqs[nreqs].len = lens[i - start];
+                reqs[nreqs].off = CHUNK_OFF(i);
+                nreqs++;
+        }
+
+        /* Reads past end of file are short, O_DIRECT ones aligned. */
+        for (r = 0; r < nreqs; r++)
+                reqs[r].len = DIRECT_LEN(direct_io, reqs[r].len);
+
+        io_batch(w->io, reqs, nreqs);
+        stats_since(STAT_READ, t);
+
+        /* Reads are short only if the file shrank, cut its chunks there. */
+        for (r = 0; r < nreqs; r++) {
+                if (reqs[r].res == (ssize_t)reqs[r].len)
+                        continue;
+                for (i = reqs[r].off >> chunk_shift; i < end && 
+                                CHUNK_OFF(i) < reqs[r].off + 
+                                (off_t)reqs[r].len; i++) {
+                        n = reqs[r].off + reqs[r].res - CHUNK_OFF(i);
+                        if (n < lens[i - start])
+                                lens[i - start] = n < 0 ? 0 : n;
+                }
+        }
+
+        if (direct_io)
+                for (i = start; i < end; i++)
+                        memset(w->buf + CHUNK_OFF(i - start) + lens[i - start],
+                                0, DIRECT_LEN(1, lens[i - start]) - 
+                                lens[i - start]);
+}
+
+/*
+ * Digests chunk i of a range read by read_chunks into digest. Chunks in
+ * holes and chunks of zeros get the zero digest without hashing.
+ * Returns non-zero for those.
+ */
+int digest_chunk(struct worker *w, long start, long i, 
+                ssize_t *lens, char *holes, unsigned char *digest) {
+        unsigned char *buf = w->buf + CHUNK_OFF(i - start);
+        uint64_t t;
+
+        if (holes[i - start] || is_zero(buf, lens[i - start])) {
+                memset(digest, 0, digest_size);
+                return 1;
+        }
+
+        t = stats_clock();
+        if (hash_digest(w->hash, buf, lens[i - start], digest) 
+                        != digest_size)
+                handle_error("hash_digest");
+        stats_since(STAT_DIGEST, t);
+        stats_add(STAT_HASHED, lens[i - start]);
+
+        return 0;
+}
+
+/*
+ * Digests chunks [start, end) of a range read by read_chunks, chunk i
+ * into digests + (i - start) * digest_size, like digest_chunk. The
+ * chunks that are hashed are hashed together, several at once on one
+ * core for MD5.
+ */
+void digest_chunks(struct worker *w, long start, long end, 
+                ssize_t *lens, char *holes, unsigned char *digests) {
+        const void *bufs[MAX_CHUNKS_PER_RANGE];
+        size_t blens[MAX_CHUNKS_PER_RANGE];
+        unsigned char *out[MAX_CHUNKS_PER_RANGE];
+        unsigned char *buf;
+        uint64_t t;
+        int n = 0;
+        long i;
+
+        for (i = start; i < end; i++) {
+                buf = w->buf + CHUNK_OFF(i - start);
+                if (holes[i - start] || is_zero(buf, lens[i - start])) {
+                        memset(digests + (i - start) * digest_size, 0,
+                                digest_size);
+                        continue;
+                }
+                bufs[n] = buf;
+                blens[n] = lens[i - start];
+                out[n] = digests + (i - start) * digest_size;
+                stats_add(STAT_HASHED, blens[n]);
+                n++;
+        }
+
+        t = stats_clock();
+        if (n && hash_digest_many(w->hash, bufs, blens, n, out) 
+                        != digest_size)
+                handle_error("hash_digest");
+        stats_since(STAT_DIGEST, t);
+}
+
+/* Reads and digests a range of chunks of the source. */
+static void digest_range(void *arg, struct worker *w, long start, long end) {
+        struct digest_job *dj = arg;
+        ssize_t lens[MAX_CHUNKS_PER_RANGE];
+        char holes[MAX_CHUNKS_PER_RANGE];
+
+        start += dj->first;
+        end += dj->first;
+        read_chunks(w, dj->fd, dj->size, start, end, lens, holes);
+        digest_chunks(w, start, end, lens, holes, 
+                dj->digests + start * digest_size);
+}
+
+/*
+ * Zeroes len bytes at off of fd by punching a hole, by writing zeros if
+ * the filesystem cannot punch holes. Does not extend fd.
+ */
+void zero_range(int fd, off_t off, off_t len) {
+        unsigned char *zeros;
+        uint64_t t = stats_clock();
+        ssize_t r;
+
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+                                off, len) == 0) {
+                stats_since(STAT_COPY, t);
+                return;
+        }
+
+        zeros = calloc(1, len);
+        if (zeros == NULL)
+                handle_error("calloc");
+        for (; len > 0; off += r, len -= r) {
+                r = pwrite(fd, zeros, len, off);
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                r = 0;
+                                continue;
+                        }
+                        handle_error("pwrite");
+                }
+        }
+        free(zeros);
+        stats_since(STAT_COPY, t);
+}
+
+/* 
+ * Sets size of fd to size: extends it with a hole if it is shorter,
+ * drops its tail if it is longer.
+ */
+void resize_to(int fd, off_t size) {
         struct stat info;
-        if (stat(path, &info) != 0)
-                return 0;
-                
-        return S_ISREG(info.st_mode);
+
+        if (fstat(fd, &info) != 0)
+                handle_error("fstat");
+        if (info.st_size != size && ftruncate(fd, size) != 0)
+                handle_error("ftruncate");
 }
 
-/* Directory check, returns non-zero if the path is a directory. */
-int is_directory(const char *path) {
+/*
+ * Writes src's digest values to digsfile, after a header describing src.
+ * Chunks are digested on nthreads workers, digests are
+ * written in chunk order.
+ * Returns 0 on success.
+ */
+int write_digest_file (FILE *src, FILE *digsfile) {
+
         struct stat info;
-        if (stat(path, &info) != 0)
+        struct digest_job dj;
+        long nchunks;
+        int fd;
+        
+        if (src == NULL || digsfile == NULL)
+                return -1;
+
+        rewind(src);
+        rewind(digsfile);
+
+        fd = fileno(src);
+        if (fstat(fd, &info) != 0)
+                handle_error("fstat");
+        dj.size = info.st_size;
+        dj.first = 0;
+
+        fflush(digsfile);
+
+        /* Content defined chunks are cut in one pass over the file. */
+        if (cdc) {
+                uint32_t *lens;
+                uint64_t t = stats_clock();
+
+                nchunks = cdc_digest(fd, pool_local_worker()->hash, 
+                                &dj.digests, &lens);
+                stats_since(STAT_DIGEST, t);
+                stats_add(STAT_HASHED, info.st_size);
+                digs_write(fileno(digsfile), fd, dj.digests, lens, 
+                        nchunks);
+                free(dj.digests);
+                free(lens);
                 return 0;
+        }
 
-        return S_ISDIR(info.st_mode);
+        nchunks = CHUNK_COUNT(info.st_size);
+
+        dj.digests = malloc((size_t)nchunks * digest_size + 1);
+        if (dj.digests == NULL)
+                handle_error("malloc");
+
+        io_sequential(fd);
+        dj.fd = io_direct_open(fd);
+        pool_run(nchunks, chunk_threads(), digest_range, &dj);
+        io_direct_close(dj.fd, fd);
+
+        digs_write(fileno(digsfile), fd, dj.digests, NULL, nchunks);
+
+        free(dj.digests);
+
+        return 0;
+}
+
+/*
+ * Returns non-zero if digs_f, NULL if there is none, holds fresh digests
+ * of f. Counts a digest file hit or miss.
+ */
+static int digs_hit(FILE *digs_f, FILE *f) {
+        uint64_t t = stats_clock();
+        int fresh = digs_f != NULL && digs_fresh(fileno(digs_f), fileno(f));
+
+        stats_since(STAT_STAT, t);
+        stats_add(fresh ? STAT_DIGS_HITS : STAT_DIGS_MISSES, 1);
+
+        return fresh;
+}
+
+/*
+ * Returns the digest file of path, open on f, for reading and writing.
+ * It is generated first unless fresh. Close it with store_close.
+ */
+FILE *open_digest_file(const char *path, FILE *f) {
+        FILE *digs_f = store_open(path, "r+");
+
+        if (digs_hit(digs_f, f))
+                return digs_f;
+        if (digs_f != NULL)
+                store_close(digs_f, path);
+        digs_f = store_open(path, "w+");
+        if (digs_f == NULL)
+                handle_error("fopen");
+        write_digest_file(f, digs_f);
+        fflush(digs_f);
+
+        return digs_f;
+}
+
+/*
+ * Copies len bytes at in_off of in to out_off of out in kernel with
+ * copy_file_range. Returns bytes copied, less than len at end of file
+ * or when the kernel cannot copy between these files.
+ */
+static off_t copy_range_at(int in, off_t in_off, int out, off_t out_off,
+                off_t len) {
+        loff_t off_in = in_off;
+        loff_t off_out = out_off;
+        ssize_t r;
+
+        while (off_in < in_off + len) {
+                r = copy_file_range(in, &off_in, out, &off_out,
+                                in_off + len - off_in, 0);
+                if (r < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        /* Not supported between these files. */
+                        if (errno == ENOSYS || errno == EXDEV ||
+                                errno == EINVAL || errno == EOPNOTSUPP)
+                                break;
+                        handle_error("copy_file_range");
+                }
+                /* End of file. */
+                if (r == 0)
+                        break;
+        }
+
+        return off_in - in_off;
+}
+
+/* Copies len bytes at off from in to the same offset of out. */
+static off_t copy_range(int in, int out, off_t off, off_t len) {
+        return copy_range_at(in, off, out, off, len);
+}
+
+/*
+ * Copies len bytes at in_off of in to out_off of out. Shares the extent
+ * (FICLONERANGE) if the filesystem can, copies in kernel if possible,
+ * otherwise through w->buf.
+ */
+void copy_extent(struct worker *w, int in, off_t in_off, int out, 
+                off_t out_off, off_t len) {
+        struct io_req req;
+        off_t copied;
+        size_t bufsize = CHUNK_OFF(range_chunks);
+        uint64_t t = stats_clock();
+
+        stats_add(STAT_WRITTEN, len);
+
+#ifdef FICLONERANGE
+        struct file_clone_range clone;
+
+        clone.src_fd = in;
+        clone.src_offset = in_off;
+        clone.src_length = len;
+        clone.dest_offset = out_off;
+        if (ioctl(out, FICLONERANGE, &clone) == 0) {
+                stats_since(STAT_COPY, t);
+                return;
+        }
+#endif /* FICLONERANGE */
+
+        copied = copy_range_at(in, in_off, out, out_off, len);
+
+        while (copied < len) {
+                req.fd = in;
+                req.write = 0;
+                req.buf = w->buf;
+                req.len = len - copied < (off_t)bufsize ? 
+                        (size_t)(len - copied) : bufsize;
+                req.off = in_off + copied;
+                io_batch(w->io, &req, 1);
+                if (req.res == 0)
+                        break;
+
+                req.fd = out;
+                req.write = 1;
+                req.len = req.res;
+                req.off = out_off + copied;
+                io_batch(w->io, &req, 1);
+                copied += req.len;
+        }
+        stats_since(STAT_COPY, t);
 }
 
-/* Compare modification time of given paths. */
-double compare_mtime(const char *path1, const char *path2) {
-        struct stat info1;
-        struct stat info2;
-        double seconds;
-        
-        if (stat(path1, &info1) != 0)
-                handle_error("stat");
-        
-        if (stat(path2, &info2) != 0)
-                handle_error("stat");
-        
-        seconds = difftime(info1.st_mtime, info2.st_mtime);
-        
-        return seconds;
+/*
+ * Copies source file to destination target.
+ * Should be called if destination target does not exists.
+ * Tries a reflink first. Otherwise only data segments are copied, so
+ * holes of source stay holes, with copy_file_range, falling back to
+ * read/write through a COPY_BUFFER_SIZE buffer. With --direct data is
+ * read and written through the buffer with O_DIRECT instead.
+ * Returns the CopyStrategy used, -1 on invalid arguments.
+ */
+int copy_file_raw (FILE *src, FILE *dest) {
+        struct stat info;
+        char *buffer = NULL;
+        int in, out;
+        int din, dout;
+        int direct;
+        int strategy = COPY_RANGE;
+        off_t off_in;
+        off_t off = 0;
+        off_t data, hole;
+        ssize_t fread_src_length;
+        ssize_t fwrite_dest_length;
+        ssize_t write_length;
+        ssize_t w;
+        uint64_t t = stats_clock();
+        
+        if (src == NULL || dest == NULL)
+                return -1;
+        
+        fflush(dest);
+        in = fileno(src);
+        out = fileno(dest);
+        
+        if (fstat(in, &info) != 0)
+                handle_error("fstat");
+
+#ifdef FICLONE
+        if (ioctl(out, FICLONE, in) == 0) {
+                stats_add(STAT_WRITTEN, info.st_size);
+                stats_since(STAT_COPY, t);
+                return COPY_REFLINK;
+        }
+#endif /* FICLONE */
+
+        if (ftruncate(out, info.st_size) != 0)
+                handle_error("ftruncate");
+
+        io_sequential(in);
+        din = io_direct_open(in);
+        dout = io_direct_open(out);
+        direct = din != in || dout != out;
+
+        for (; next_data(in, off, info.st_size, &data, &hole); off = hole) {
+                /* Segments of O_DIRECT copies are aligned. */
+                if (direct) {
+                        data &= ~(off_t)(DIRECT_ALIGN - 1);
+                        if (DIRECT_LEN(1, hole) < info.st_size)
+                                hole = DIRECT_LEN(1, hole);
+                }
+                stats_add(STAT_WRITTEN, hole - data);
+                off_in = data;
+                if (!direct)
+                        off_in += copy_range(in, out, data, hole - data);
+                if (off_in >= hole)
+                        continue;
+                
+                strategy = COPY_BUFFER;
+                if (buffer == NULL && posix_memalign((void **)&buffer, 
+                                        DIRECT_ALIGN, COPY_BUFFER_SIZE) != 0)
+                        handle_error("malloc");
+                
+                while (off_in < hole && (fread_src_length = pread(din, 
+                                        buffer, DIRECT_LEN(din != in, 
+                                        hole - off_in < 
+                                        COPY_BUFFER_SIZE ? hole - off_in :
+                                        COPY_BUFFER_SIZE), off_in)) != 0) {
+                        if (fread_src_length < 0) {
+                                if (errno == EINTR)
+                                        continue;
+                                handle_error("pread");
+                        }
+                        
+                        /* The tail is padded, dest is cut to size below. */
+                        write_length = DIRECT_LEN(dout != out, 
+                                        fread_src_length);
+                        memset(buffer + fread_src_length, 0, 
+                                write_length - fread_src_length);
+                        for (w = 0; w < write_length; 
+                                        w += fwrite_dest_length) {
+                                fwrite_dest_length = pwrite(dout, buffer + w,
+                                                write_length - w, 
+                                                off_in + w);
+                                if (fwrite_dest_length < 0) {
+                                        if (errno == EINTR) {
+                                                fwrite_dest_length = 0;
+                                                continue;
+                                        }
+                                        handle_error("pwrite");
+                                }
+                        }
+                        off_in += fread_src_length;
+                }
+        }
+        
+        io_direct_close(din, in);
+        io_direct_close(dout, out);
+        resize_to(out, info.st_size);
+        free(buffer);
+        stats_since(STAT_COPY, t);
+
+        return strategy;
+}
+
+/* Changed extents of diff_copy, read into consecutive parts of w->buf. */
+struct extents {
+        struct io_req reqs[MAX_CHUNKS_PER_RANGE];
+        int n;
+        long used;      /* Chunks of w->buf taken. */
+        int direct;     /* Descriptors are O_DIRECT, tails padded. */
+};
+
+/*
+ * Copies pending extents from src_fd to dest_fd. The psync engine copies
+ * in kernel with copy_file_range, extents it cannot copy and all extents
+ * of other engines, or with --direct, are read as one I/O batch and
+ * written as another. Padded tails of O_DIRECT writes are cut by the
+ * caller.
+ */
+static void extents_flush(struct worker *w, int src_fd, int dest_fd,
+                struct extents *x) {
+        off_t copied;
+        uint64_t t = stats_clock();
+        int i, n = 0;
+
+        for (i = 0; i < x->n; i++) {
+                if (io_kind(w->io) == IO_PSYNC && !x->direct) {
+                        copied = copy_range(src_fd, dest_fd, x->reqs[i].off,
+                                        x->reqs[i].len);
+                        stats_add(STAT_WRITTEN, copied);
+                        if (copied == (off_t)x->reqs[i].len)
+                                continue;
+                        x->reqs[i].buf = (char *)x->reqs[i].buf + copied;
+                        x->reqs[i].off += copied;
+                        x->reqs[i].len -= copied;
+                }
+                x->reqs[n++] = x->reqs[i];
+        }
+
+        if (n) {
+                io_batch(w->io, x->reqs, n);
+
+                for (i = 0; i < n; i++) {
+                        x->reqs[i].fd = dest_fd;
+                        x->reqs[i].write = 1;
+                        x->reqs[i].len = DIRECT_LEN(x->direct, 
+                                        x->reqs[i].res);
+                        memset((char *)x->reqs[i].buf + x->reqs[i].res, 0,
+                                x->reqs[i].len - x->reqs[i].res);
+                        stats_add(STAT_WRITTEN, x->reqs[i].res);
+                }
+
+                io_batch(w->io, x->reqs, n);
+        }
+        stats_since(STAT_COPY, t);
+
+        x->n = 0;
+        x->used = 0;
+}
+
+/*
+ * Adds a changed chunk, extending the last extent if the chunk follows
+ * it. Extents are capped at range_chunks chunks, the size of w->buf.
+ */
+static void extents_add(struct worker *w, int src_fd, int dest_fd,
+                struct extents *x, long chunk) {
+        struct io_req *last = x->n ? &x->reqs[x->n - 1] : NULL;
+
+        if (last != NULL && x->used < range_chunks &&
+                        last->off + (off_t)last->len == CHUNK_OFF(chunk)) {
+                last->len += chunk_size;
+                x->used++;
+                return;
+        }
+
+        if (x->used == range_chunks)
+                extents_flush(w, src_fd, dest_fd, x);
+
+        x->reqs[x->n].fd = src_fd;
+        x->reqs[x->n].write = 0;
+        x->reqs[x->n].buf = w->buf + CHUNK_OFF(x->used);
+        x->reqs[x->n].len = chunk_size;
+        x->reqs[x->n].off = CHUNK_OFF(chunk);
+        x->n++;
+        x->used++;
+}
+
+/*
+ * Copies chunks whose digests differ between src_digs and dest_digs
+ * from src to dest. Both digest files are mapped and compared in bulk
+ * into a bitmap of changed chunks before anything is written. A changed
+ * chunk whose content is found in an unchanged destination chunk is
+ * copied within dest, in kernel. Changed chunks of zeros are punched.
+ * Runs of the other changed chunks are coalesced into extents and
+ * copied from src with one read and one write each, with O_DIRECT if
+ * --direct. Destination digests are then updated from source digests,
+ * dest_digs_f must be open for update.
+ * Returns number of changed chunks.
+ */
+long diff_copy (FILE *src_f, FILE *src_digs_f, FILE *dest_f, FILE *dest_digs_f) {
+
+        struct worker *w = pool_local_worker();
+        struct extents x;
+        struct digs src_digs;
+        struct digs dest_digs;
+        struct digs_index index;
+        struct stat info;
+        unsigned char *digest;
+        uint64_t *bitmap;
+        uint64_t word;
+        off_t transfer;
+        off_t reuse_in = 0;
+        off_t reuse_out = 0;
+        off_t reuse_len = 0;
+        off_t len;
+        uint64_t t;
+        int src_fd = fileno(src_f);
+        int dest_fd = fileno(dest_f);
+        int src_dfd, dest_dfd;
+        long diff_chunk_count;
+        long chunk_index;
+        long reused = 0;
+        long i, j;
+        
+        fflush(src_digs_f);
+        fflush(dest_f);
+        fflush(dest_digs_f);
+        
+        if (digs_map(fileno(src_digs_f), &src_digs) != 0 ||
+                        digs_map(fileno(dest_digs_f), &dest_digs) != 0)
+                handle_error("mmap");
+
+        stats_add(STAT_BYTES, src_digs.file_size);
+        stats_add(STAT_CHUNKS, src_digs.count);
+
+        /* Equal roots, destination is up to date. */
+        t = stats_clock();
+        if (digs_same(&src_digs, &dest_digs)) {
+                stats_since(STAT_COMPARE, t);
+                digs_unmap(&src_digs);
+                digs_unmap(&dest_digs);
+                return 0;
+        }
+        
+        bitmap = calloc(BITMAP_WORDS(src_digs.count > dest_digs.count ?
+                        src_digs.count : dest_digs.count) + 1, 
+                sizeof(uint64_t));
+        if (bitmap == NULL)
+                handle_error("calloc");
+        
+        diff_chunk_count = digs_diff(&src_digs, &dest_digs, bitmap);
+        stats_add(STAT_CHANGED, diff_chunk_count);
+
+        /* 
+         * Changed chunks are overwritten, only unchanged destination
+         * chunks are sources of copies within dest.
+         */
+        digs_index_build(&index, &dest_digs, bitmap);
+        stats_since(STAT_COMPARE, t);
+        
+        /* Bytes to transfer, the last chunk may be partial. */
+        if (fstat(src_fd, &info) != 0)
+                handle_error("fstat");
+        transfer = CHUNK_OFF(diff_chunk_count);
+        if (diff_chunk_count && BITMAP_TEST(bitmap, src_digs.count - 1) &&
+                        (info.st_size & (chunk_size - 1)))
+                transfer -= chunk_size - (info.st_size & (chunk_size - 1));
+
+#ifdef DEBUG
+        if (src_digs.count)
+                printf("%.2f%% of chunks are have changed.\n", 
+                        ((double)diff_chunk_count)/((double) src_digs.count)*100);
+        printf("Total %ld chunks, %ld changed, %lld bytes to transfer.\n", 
+                src_digs.count, diff_chunk_count, (long long)transfer);
+        fflush(stdout);
+#endif /* DEBUG */
+
+        x.n = 0;
+        x.used = 0;
+        src_dfd = io_direct_open(src_fd);
+        dest_dfd = io_direct_open(dest_fd);
+        x.direct = src_dfd != src_fd || dest_dfd != dest_fd;
+        for (i = 0; i < BITMAP_WORDS(src_digs.count); i++) {
+                for (word = bitmap[i]; word; word &= word - 1) {
+                        chunk_index = i * 64 + __builtin_ctzll(word);
+#ifdef DEBUG
+                        printf("chunk %ld: CHANGED!\n", chunk_index);
+                        fflush(stdout);
+#endif /* DEBUG */
+                        digest = src_digs.digests + 
+                                chunk_index * src_digs.size;
+                        len = info.st_size - CHUNK_OFF(chunk_index);
+                        if (len > chunk_size)
+                                len = chunk_size;
+
+                        if (digs_is_zero(digest)) {
+                                zero_range(dest_fd, CHUNK_OFF(chunk_index),
+                                        len);
+                                continue;
+                        }
+
+                        j = digs_index_find(&index, digest, 0);
+                        if (j < 0) {
+                                extents_add(w, src_dfd, dest_dfd, &x, 
+                                        chunk_index);
+                                continue;
+                        }
+                        reused++;
+                        
+                        /* Extend the run if both chunks follow it. */
+                        if (reuse_len && 
+                                        CHUNK_OFF(j) == reuse_in + reuse_len &&
+                                        CHUNK_OFF(chunk_index) == 
+                                        reuse_out + reuse_len) {
+                                reuse_len += len;
+                                continue;
+                        }
+                        if (reuse_len)
+                                copy_extent(w, dest_fd, reuse_in, dest_fd,
+                                        reuse_out, reuse_len);
+                        reuse_in = CHUNK_OFF(j);
+                        reuse_out = CHUNK_OFF(chunk_index);
+                        reuse_len = len;
+                }
+        }
+        if (reuse_len)
+                copy_extent(w, dest_fd, reuse_in, dest_fd, reuse_out, 
+                        reuse_len);
+        extents_flush(w, src_dfd, dest_dfd, &x);
+        io_direct_close(src_dfd, src_fd);
+        io_direct_close(dest_dfd, dest_fd);
+        resize_to(dest_fd, info.st_size);
+
+#ifdef DEBUG
+        printf("%ld changed chunks copied within destination.\n", reused);
+        fflush(stdout);
+#endif /* DEBUG */
+
+        digs_write(fileno(dest_digs_f), dest_fd, src_digs.digests, NULL,
+                src_digs.count);
+
+        digs_index_free(&index);
+        digs_unmap(&src_digs);
+        digs_unmap(&dest_digs);
+        free(bitmap);
+
+        return diff_chunk_count;
+}
+
+/* Shared state of a stream_diff run. */
+struct stream_job {
+        int src_fd;
+        int dest_fd;
+        int src_dfd;                    /* Chunk I/O, O_DIRECT with */
+        int dest_dfd;                   /* --direct. */
+        int direct;                     /* dest_dfd is, tails padded. */
+        off_t src_size;
+        unsigned char *src_digests;     /* Filled by workers. */
+        const unsigned char *dest_digests;
+        long dest_nchunks;
+        long changed;                   /* Updated atomically. */
+};
+
+/*
+ * Reads and digests a range of source chunks, writes the ones whose
+ * digest differs to destination as one I/O batch, consecutive changed
+ * chunks as one write. Changed chunks of zeros are punched as holes.
+ */
+static void stream_range(void *arg, struct worker *w, long start, long end) {
+        struct stream_job *sj = arg;
+        struct io_req reqs[MAX_CHUNKS_PER_RANGE];
+        ssize_t lens[MAX_CHUNKS_PER_RANGE];
+        char holes[MAX_CHUNKS_PER_RANGE];
+        unsigned char *digest;
+        uint64_t t;
+        int nreqs = 0;
+        int zero;
+        long changed = 0;
+        long i;
+
+        read_chunks(w, sj->src_dfd, sj->src_size, start, end, lens, holes);
+        digest_chunks(w, start, end, lens, holes, 
+                sj->src_digests + start * digest_size);
+
+        for (i = start; i < end; i++) {
+                digest = sj->src_digests + i * digest_size;
+                zero = digs_is_zero(digest);
+
+                if (i < sj->dest_nchunks && !memcmp(digest,
+                                sj->dest_digests + i * digest_size,
+                                digest_size))
+                        continue;
+
+#ifdef DEBUG
+                printf("chunk %ld: CHANGED!\n", i);
+                fflush(stdout);
+#endif /* DEBUG */
+                changed++;
+
+                if (zero) {
+                        zero_range(sj->dest_fd, CHUNK_OFF(i), lens[i - start]);
+                        continue;
+                }
+                
+                /* Extend the previous write if this chunk follows it. */
+                if (nreqs && reqs[nreqs - 1].off + 
+                                (off_t)reqs[nreqs - 1].len == CHUNK_OFF(i)) {
+                        reqs[nreqs - 1].len += DIRECT_LEN(sj->direct,
+                                        lens[i - start]);
+                        continue;
+                }
+                reqs[nreqs].fd = sj->dest_dfd;
+                reqs[nreqs].write = 1;
+                reqs[nreqs].buf = w->buf + CHUNK_OFF(i - start);
+                reqs[nreqs].len = DIRECT_LEN(sj->direct, lens[i - start]);
+                reqs[nreqs].off = CHUNK_OFF(i);
+                nreqs++;
+        }
+
+        if (nreqs) {
+                t = stats_clock();
+                io_batch(w->io, reqs, nreqs);
+                stats_since(STAT_COPY, t);
+                for (i = 0; i < nreqs; i++)
+                        stats_add(STAT_WRITTEN, reqs[i].len);
+        }
+        if (changed)
+                __atomic_fetch_add(&sj->changed, changed, __ATOMIC_RELAXED);
+}
+
+/*
+ * Lazy copy in a single pass over source, used when source digests are
+ * stale. Each source chunk is read once, digested, compared with the
+ * destination digest and written immediately if it differs. New source
+ * and destination digests are written to src_digs_f and dest_digs_f
+ * without reading either file again.
+ * dest_digs_f must hold valid destination digests and be open for update.
+ * Returns number of changed chunks.
+ */
+long stream_diff (FILE *src_f, FILE *src_digs_f, FILE *dest_f, 
+                FILE *dest_digs_f) {
+        struct stat src_info;
+        struct stream_job sj;
+        struct digs dest_digs;
+        long nchunks;
+
+        fflush(dest_f);
+        fflush(dest_digs_f);
+        sj.src_fd = fileno(src_f);
+        sj.dest_fd = fileno(dest_f);
+
+        if (fstat(sj.src_fd, &src_info) != 0)
+                handle_error("fstat");
+
+        nchunks = CHUNK_COUNT(src_info.st_size);
+        sj.src_size = src_info.st_size;
+        stats_add(STAT_BYTES, src_info.st_size);
+        stats_add(STAT_CHUNKS, nchunks);
+
+        /* Destination digests are only read until the pass ends. */
+        if (digs_map(fileno(dest_digs_f), &dest_digs) != 0)
+                handle_error("mmap");
+
+        sj.src_digests = malloc((size_t)nchunks * digest_size + 1);
+        if (sj.src_digests == NULL)
+                handle_error("malloc");
+        sj.dest_digests = dest_digs.digests;
+        sj.dest_nchunks = dest_digs.count;
+        sj.changed = 0;
+
+        io_sequential(sj.src_fd);
+        sj.src_dfd = io_direct_open(sj.src_fd);
+        sj.dest_dfd = io_direct_open(sj.dest_fd);
+        sj.direct = sj.dest_dfd != sj.dest_fd;
+        pool_run(nchunks, chunk_threads(), stream_range, &sj);
+        io_direct_close(sj.src_dfd, sj.src_fd);
+        io_direct_close(sj.dest_dfd, sj.dest_fd);
+        stats_add(STAT_CHANGED, sj.changed);
+
+        /* 
+         * Trailing holes do not extend dest, a shorter source cuts it,
+         * as well as the padding of an O_DIRECT write of the last chunk.
+         */
+        resize_to(sj.dest_fd, src_info.st_size);
+
+        fflush(src_digs_f);
+        digs_write(fileno(src_digs_f), sj.src_fd, sj.src_digests, NULL,
+                nchunks);
+
+        /* Destination now matches source. */
+        digs_write(fileno(dest_digs_f), sj.dest_fd, sj.src_digests, NULL,
+                nchunks);
+        digs_unmap(&dest_digs);
+
+#ifdef DEBUG
+        if (nchunks)
+                printf("%.2f%% of chunks are have changed.\n", 
+                        ((double)sj.changed)/((double) nchunks)*100);
+        printf("Total %ld chunks, %ld changed (streamed).\n", 
+                nchunks, sj.changed);
+        fflush(stdout);
+#endif /* DEBUG */
+
+        free(sj.src_digests);
+
+        return sj.changed;
+}
+
+/*
+ * Append-only lazy copy of --append, for a source with stale digests
+ * that grew from destination. Only the last chunk destination has is
+ * checked against its destination digest, the rest of destination is
+ * taken to be unchanged in source. Then only the tail of source is
+ * copied and digested, digests of the chunks before are taken from
+ * destination digests. dest_digs_f must hold valid destination digests.
+ * Returns number of chunks copied or digested, -1 without writing if
+ * source is shorter or its last shared chunk differs.
+ */
+long append_copy (FILE *src_f, FILE *src_digs_f, FILE *dest_f, 
+                FILE *dest_digs_f) {
+        struct worker *w = pool_local_worker();
+        struct stat src_info;
+        struct stat dest_info;
+        struct digest_job dj;
+        struct digs dest_digs;
+        unsigned char digest[MAX_DIGEST_SIZE];
+        ssize_t lens[1];
+        char holes[1];
+        long nchunks;
+        long last;
+
+        fflush(dest_f);
+        fflush(dest_digs_f);
+        dj.fd = fileno(src_f);
+        if (fstat(dj.fd, &src_info) != 0 || 
+                        fstat(fileno(dest_f), &dest_info) != 0)
+                handle_error("fstat");
+        if (src_info.st_size < dest_info.st_size)
+                return -1;
+
+        if (digs_map(fileno(dest_digs_f), &dest_digs) != 0)
+                handle_error("mmap");
+        if (dest_digs.lens != NULL || dest_digs.size != digest_size ||
+                        dest_digs.count != CHUNK_COUNT(dest_info.st_size)) {
+                digs_unmap(&dest_digs);
+                return -1;
+        }
+
+        /* Last chunk of destination, partial or not. */
+        last = dest_digs.count - 1;
+        if (last >= 0) {
+                read_chunks(w, dj.fd, dest_info.st_size, last, last + 1, 
+                        lens, holes);
+                digest_chunk(w, last, last, lens, holes, digest);
+                if (lens[0] != dest_info.st_size - CHUNK_OFF(last) ||
+                                memcmp(digest, dest_digs.digests + 
+                                        last * digest_size, digest_size)) {
+                        digs_unmap(&dest_digs);
+                        return -1;
+                }
+        } else {
+                last = 0;
+        }
+
+        copy_extent(w, dj.fd, dest_info.st_size, fileno(dest_f), 
+                dest_info.st_size, src_info.st_size - dest_info.st_size);
+
+        /* Chunks from the last shared one on are digested. */
+        nchunks = CHUNK_COUNT(src_info.st_size);
+        dj.size = src_info.st_size;
+        dj.first = last;
+        dj.digests = malloc((size_t)nchunks * digest_size + 1);
+        if (dj.digests == NULL)
+                handle_error("malloc");
+        memcpy(dj.digests, dest_digs.digests, (size_t)last * digest_size);
+        digs_unmap(&dest_digs);
+        pool_run(nchunks - last, chunk_threads(), digest_range, &dj);
+
+        fflush(src_digs_f);
+        digs_write(fileno(src_digs_f), dj.fd, dj.digests, NULL, nchunks);
+        digs_write(fileno(dest_digs_f), fileno(dest_f), dj.digests, NULL,
+                nchunks);
+        free(dj.digests);
+        stats_add(STAT_BYTES, src_info.st_size);
+        stats_add(STAT_CHUNKS, nchunks);
+        stats_add(STAT_CHANGED, nchunks - last);
+
+#ifdef DEBUG
+        printf("Appended %lld bytes, %ld chunks digested.\n", 
+                (long long)(src_info.st_size - dest_info.st_size), 
+                nchunks - last);
+        fflush(stdout);
+#endif /* DEBUG */
+
+        return nchunks - last;
+}
+
+/*
+ * Opens an unlinked scratch file in the directory of path, with
+ * O_TMPFILE, or with mkstemp and unlink where the filesystem lacks it.
+ * Returns its file descriptor.
+ */
+static int scratch_open(const char *path) {
+        const char *slash = strrchr(path, '/');
+        char *tmp_path;
+        size_t len = slash ? (size_t)(slash - path) + 1 : 0;
+        int fd;
+
+        tmp_path = malloc(len + sizeof(".lcopy.XXXXXX") + 1);
+        if (tmp_path == NULL)
+                handle_error("malloc");
+        memcpy(tmp_path, path, len);
+        strcpy(tmp_path + len, len ? "." : "./");
+
+        fd = open(tmp_path, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || 
+                                errno == EINVAL)) {
+                strcpy(tmp_path + len, ".lcopy.XXXXXX");
+                fd = mkstemp(tmp_path);
+                if (fd >= 0 && unlink(tmp_path) != 0)
+                        handle_error("unlink");
+        }
+        if (fd < 0)
+                handle_error("open");
+        free(tmp_path);
+
+        return fd;
+}
+
+/*
+ * Content defined counterpart of diff_copy. Each source chunk is looked
+ * up by digest and length among destination chunks. When every chunk
+ * found is at its source offset, the others are written in place.
+ * Otherwise chunks moved, they are first staged in a scratch file of
+ * scratch_open and then copied back to their new offsets, so dest
+ * keeps its inode, links, owner and attributes. Chunks of zeros are
+ * holes in either case.
+ * Destination digests are then updated from source digests.
+ * Returns number of chunks copied from source.
+ */
+long cdc_diff_copy (FILE *src_f, FILE *src_digs_f, FILE *dest_f, 
+                FILE *dest_digs_f, const char *dest) {
+
+        struct worker *w = pool_local_worker();
+        struct digs src_digs;
+        struct digs dest_digs;
+        struct digs_index x;
+        struct stat src_info;
+        off_t *staged = NULL;
+        off_t tmp_len = 0;
+        long *found;
+        long changed = 0;
+        int in_place = 1;
+        int src_fd = fileno(src_f);
+        int dest_fd = fileno(dest_f);
+        int tmp_fd = -1;
+        int run_fd = -1;
+        int fd;
+        off_t run_in = 0;
+        off_t run_off = 0;
+        off_t run_len = 0;
+        off_t in;
+        off_t off;
+        uint64_t t;
+        long i, j;
+
+        fflush(src_digs_f);
+        fflush(dest_f);
+        fflush(dest_digs_f);
+
+        if (digs_map(fileno(src_digs_f), &src_digs) != 0 ||
+                        digs_map(fileno(dest_digs_f), &dest_digs) != 0)
+                handle_error("mmap");
+        stats_add(STAT_BYTES, src_digs.file_size);
+        stats_add(STAT_CHUNKS, src_digs.count);
+
+        /* Equal roots, destination is up to date. */
+        t = stats_clock();
+        if (digs_same(&src_digs, &dest_digs)) {
+                stats_since(STAT_COMPARE, t);
+                digs_unmap(&src_digs);
+                digs_unmap(&dest_digs);
+                return 0;
+        }
+
+        if (fstat(src_fd, &src_info) != 0)
+                handle_error("fstat");
+
+        digs_index_build(&x, &dest_digs, NULL);
+
+        found = malloc((src_digs.count + 1) * sizeof(long));
+        if (found == NULL)
+                handle_error("malloc");
+
+        for (off = 0, i = 0; i < src_digs.count; off += src_digs.lens[i++]) {
+                found[i] = digs_index_find(&x, 
+                        src_digs.digests + i * src_digs.size, 
+                        src_digs.lens[i]);
+                if (found[i] < 0)
+                        changed++;
+                else if (x.offs[found[i]] != off && !digs_is_zero(
+                                        src_digs.digests + i * src_digs.size))
+                        in_place = 0;
+        }
+        stats_since(STAT_COMPARE, t);
+        stats_add(STAT_CHANGED, changed);
+
+#ifdef DEBUG
+        printf("Total %ld chunks, %ld changed, %s.\n", src_digs.count, 
+                changed, in_place ? "in place" : "reassembled");
+        fflush(stdout);
+#endif /* DEBUG */
+
+        /*
+         * Moved chunks are staged in a scratch file before any of them
+         * is overwritten, each once.
+         */
+        if (!in_place) {
+                staged = malloc((dest_digs.count + 1) * sizeof(off_t));
+                if (staged == NULL)
+                        handle_error("malloc");
+                tmp_fd = scratch_open(dest);
+
+                for (i = 0; i < dest_digs.count; i++)
+                        staged[i] = -1;
+                for (off = 0, i = 0; i < src_digs.count; 
+                                off += src_digs.lens[i++]) {
+                        j = found[i];
+                        if (j < 0 || x.offs[j] == off || staged[j] >= 0 ||
+                                        digs_is_zero(src_digs.digests + 
+                                                i * src_digs.size))
+                                continue;
+                        staged[j] = tmp_len;
+                        tmp_len += src_digs.lens[i];
+
+                        /* Extend the run if this chunk follows it. */
+                        if (run_len && x.offs[j] == run_in + run_len) {
+                                run_len += src_digs.lens[i];
+                                continue;
+                        }
+                        if (run_len)
+                                copy_extent(w, dest_fd, run_in, tmp_fd, 
+                                        run_off, run_len);
+                        run_in = x.offs[j];
+                        run_off = staged[j];
+                        run_len = src_digs.lens[i];
+                }
+                if (run_len)
+                        copy_extent(w, dest_fd, run_in, tmp_fd, run_off, 
+                                run_len);
+                run_len = 0;
+        }
+
+        /*
+         * Chunks found at their source offset are left alone, every
+         * other range of dest is rewritten from source or scratch.
+         */
+        for (off = 0, i = 0; i < src_digs.count; off += src_digs.lens[i++]) {
+                j = found[i];
+                if (j >= 0 && x.offs[j] == off) {
+                        continue;
+                } else if (digs_is_zero(src_digs.digests + 
+                                        i * src_digs.size)) {
+                        zero_range(dest_fd, off, src_digs.lens[i]);
+                        continue;
+                } else if (j < 0) {
+                        fd = src_fd;
+                        in = off;
+                } else {
+                        fd = tmp_fd;
+                        in = staged[j];
+                }
+
+                /* Extend the run if this chunk follows it in both files. */
+                if (run_len && fd == run_fd && in == run_in + run_len &&
+                                off == run_off + run_len) {
+                        run_len += src_digs.lens[i];
+                        continue;
+                }
+                if (run_len)
+                        copy_extent(w, run_fd, run_in, dest_fd, run_off, 
+                                run_len);
+                run_fd = fd;
+                run_in = in;
+                run_off = off;
+                run_len = src_digs.lens[i];
+        }
+        if (run_len)
+                copy_extent(w, run_fd, run_in, dest_fd, run_off, run_len);
+        resize_to(dest_fd, src_info.st_size);
+
+        digs_write(fileno(dest_digs_f), dest_fd, src_digs.digests,
+                src_digs.lens, src_digs.count);
+
+        if (!in_place) {
+                close(tmp_fd);
+                free(staged);
+        }
+        digs_index_free(&x);
+        free(found);
+        digs_unmap(&src_digs);
+        digs_unmap(&dest_digs);
+
+        return changed;
+}
+
+/* Small file of a batch, src_name and dest_name relative to dirfds. */
+struct small_file {
+        const char *src_name;
+        const char *dest_name;
+        struct stat src_st;
+        struct stat dest_st;    /* st_mode 0 if dest does not exist. */
+        int index;              /* Entry index in its directory. */
+        int src_fd;
+        int dest_fd;
+        int src_req;
+        int dest_req;           /* -1 unless dest is read to compare. */
+};
+
+/* Returns non-zero if mtimes of a and b are equal. */
+static int is_same_mtime(const struct stat *a, const struct stat *b) {
+        return a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+                a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Copies n small files whole, without digest files. A destination of
+ * the same size and mtime is taken as unchanged. Other sources, and
+ * destinations of the same size, are read as one I/O batch, the ones
+ * whose content differs are written as a second batch. Destinations
+ * get the source mtime, which the next size and mtime check relies on.
+ * A source whose read length, or size, mtime or ctime after the read,
+ * differ from its stat changed since it was statted, it is copied again
+ * with the new stat, up to tries times.
+ */
+static void small_copy_tries (int src_dirfd, int dest_dirfd, 
+                struct small_file *b, int n, int tries) {
+        struct worker *w = pool_local_worker();
+        struct timespec times[2];
+        struct io_req *reqs;
+        struct small_file *f;
+        struct stat st;
+        unsigned char *buf;
+        size_t total = 0;
+        ssize_t len;
+        uint64_t t;
+        int nreqs = 0;
+        int nretry = 0;
+        int i;
+
+        for (i = 0; i < n; i++) {
+                total += 2 * b[i].src_st.st_size;
+                stats_add(STAT_BYTES, b[i].src_st.st_size);
+        }
+        reqs = malloc(2 * n * sizeof(struct io_req));
+        buf = malloc(total + 1);
+        if (reqs == NULL || buf == NULL)
+                handle_error("malloc");
+
+        for (total = 0, i = 0; i < n; i++) {
+                f = &b[i];
+                f->src_fd = -1;
+                f->dest_fd = -1;
+                f->dest_req = -1;
+                if (S_ISREG(f->dest_st.st_mode) && 
+                                f->dest_st.st_size == f->src_st.st_size &&
+                                is_same_mtime(&f->dest_st, &f->src_st))
+                        continue;
+
+                f->src_fd = openat(src_dirfd, f->src_name, 
+                        O_RDONLY | O_CLOEXEC);
+                if (f->src_fd < 0)
+                        handle_error("open");
+                f->src_req = nreqs;
+                reqs[nreqs].fd = f->src_fd;
+                reqs[nreqs].write = 0;
+                reqs[nreqs].buf = buf + total;
+                reqs[nreqs].len = f->src_st.st_size;
+                reqs[nreqs].off = 0;
+                nreqs++;
+                total += f->src_st.st_size;
+
+                /* Same size, new mtime: content may be unchanged. */
+                if (S_ISREG(f->dest_st.st_mode) && 
+                                f->dest_st.st_size == f->src_st.st_size) {
+                        f->dest_fd = openat(dest_dirfd, f->dest_name, 
+                                O_RDWR | O_CLOEXEC);
+                        if (f->dest_fd < 0)
+                                handle_error("open");
+                        f->dest_req = nreqs;
+                        reqs[nreqs].fd = f->dest_fd;
+                        reqs[nreqs].write = 0;
+                        reqs[nreqs].buf = buf + total;
+                        reqs[nreqs].len = f->src_st.st_size;
+                        reqs[nreqs].off = 0;
+                        nreqs++;
+                        total += f->src_st.st_size;
+                }
+        }
+        t = stats_clock();
+        io_batch(w->io, reqs, nreqs);
+        stats_since(STAT_READ, t);
+
+        for (i = 0; i < n; i++) {
+                f = &b[i];
+                if (f->src_fd < 0)
+                        continue;
+                len = reqs[f->src_req].res;
+                if (fstat(f->src_fd, &st) != 0)
+                        handle_error("fstat");
+                if (len != f->src_st.st_size || 
+                                st.st_size != f->src_st.st_size ||
+                                !is_same_mtime(&st, &f->src_st) ||
+                                st.st_ctim.tv_sec != f->src_st.st_ctim.tv_sec ||
+                                st.st_ctim.tv_nsec != 
+                                f->src_st.st_ctim.tv_nsec) {
+                        if (tries <= 1) {
+                                errno = EAGAIN;
+                                handle_error(f->src_name);
+                        }
+                        f->src_st = st;
+                        f->src_req = -1;
+                        nretry++;
+                        continue;
+                }
+                if (f->dest_req >= 0 && reqs[f->dest_req].res == len &&
+                                !memcmp(reqs[f->src_req].buf, 
+                                        reqs[f->dest_req].buf, len)) {
+                        /* Only mtime changed. */
+                        continue;
+                }
+                if (f->dest_fd < 0) {
+                        f->dest_fd = openat(dest_dirfd, f->dest_name, 
+                                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                0666);
+                        if (f->dest_fd < 0)
+                                handle_error("open");
+                } else if (ftruncate(f->dest_fd, len) != 0) {
+                        handle_error("ftruncate");
+                }
+                reqs[f->src_req].fd = f->dest_fd;
+                reqs[f->src_req].write = 1;
+                reqs[f->src_req].len = len;
+        }
+
+        /* Writes take the place of their source reads. */
+        for (nreqs = 0, i = 0; i < n; i++) {
+                f = &b[i];
+                if (f->src_fd >= 0 && f->src_req >= 0 &&
+                                reqs[f->src_req].write && 
+                                reqs[f->src_req].len) {
+                        reqs[nreqs++] = reqs[f->src_req];
+                        stats_add(STAT_WRITTEN, reqs[f->src_req].len);
+                }
+        }
+        t = stats_clock();
+        io_batch(w->io, reqs, nreqs);
+        stats_since(STAT_COPY, t);
+
+        times[0].tv_nsec = UTIME_OMIT;
+        for (i = 0; i < n; i++) {
+                f = &b[i];
+                if (f->src_fd < 0)
+                        continue;
+                times[1] = f->src_st.st_mtim;
+                if (f->src_req >= 0 && futimens(f->dest_fd, times) != 0)
+                        handle_error("futimens");
+                close(f->src_fd);
+                if (f->dest_fd >= 0)
+                        close(f->dest_fd);
+        }
+
+        free(reqs);
+        free(buf);
+
+        /* Sources that changed meanwhile are copied again. */
+        if (nretry) {
+                f = malloc(nretry * sizeof(struct small_file));
+                if (f == NULL)
+                        handle_error("malloc");
+                for (nretry = 0, i = 0; i < n; i++) {
+                        if (b[i].src_fd >= 0 && b[i].src_req < 0)
+                                f[nretry++] = b[i];
+                }
+                small_copy_tries(src_dirfd, dest_dirfd, f, nretry, tries - 1);
+                free(f);
+        }
+}
+
+/* Copies n small files whole, see small_copy_tries. */
+void small_copy (int src_dirfd, int dest_dirfd, struct small_file *b, int n) {
+        small_copy_tries(src_dirfd, dest_dirfd, b, n, SMALL_TRIES);
+}
+
+/* Copies and prints the batch of small files of a directory. */
+static void small_flush (int src_dirfd, int dest_dirfd, const char *src, 
+                const char *dest_dir, struct small_file *b, int n) {
+        struct stats fs;
+        int i;
+
+        if (n == 0)
+                return;
+        stats_file_begin(&fs);
+        small_copy(src_dirfd, dest_dirfd, b, n);
+        stats_file_end(&fs, src, dest_dir, "small", n);
+        for (i = 0; i < n; i++) {
+                walk_printf_entry(b[i].index, "Copied from %s/%s to %s/%s.\n",
+                        src, b[i].src_name, dest_dir, b[i].dest_name);
+                free((char *)b[i].src_name);
+        }
+}
+
+/* Batch of small files handed to a tree walk worker. */
+struct small_task {
+        int src_dirfd;
+        int dest_dirfd;
+        char *src;
+        char *dest_dir;
+        struct small_file *b;
+        int n;
+};
+
+/* Tree walk task of small_hand. */
+static void small_task_run (void *arg) {
+        struct small_task *st = arg;
+
+        small_flush(st->src_dirfd, st->dest_dirfd, st->src, st->dest_dir,
+                st->b, st->n);
+        close(st->src_dirfd);
+        close(st->dest_dirfd);
+        free(st->src);
+        free(st->dest_dir);
+        free(st->b);
+        free(st);
+}
+
+/*
+ * Copies a full batch of small files. Inside a tree walk the batch is
+ * spawned as a task, so that batches of one directory are copied by
+ * several workers, otherwise it is copied now.
+ */
+static void small_hand (int src_dirfd, int dest_dirfd, const char *src,
+                const char *dest_dir, struct small_file *b, int n) {
+        struct small_task *st;
+
+        if (!walk_active()) {
+                small_flush(src_dirfd, dest_dirfd, src, dest_dir, b, n);
+                return;
+        }
+
+        st = malloc(sizeof(*st));
+        if (st == NULL)
+                handle_error("malloc");
+        st->src_dirfd = dup(src_dirfd);
+        st->dest_dirfd = dup(dest_dirfd);
+        if (st->src_dirfd < 0 || st->dest_dirfd < 0)
+                handle_error("dup");
+        st->src = strdup(src);
+        st->dest_dir = strdup(dest_dir);
+        st->b = malloc(n * sizeof(struct small_file));
+        if (st->src == NULL || st->dest_dir == NULL || st->b == NULL)
+                handle_error("malloc");
+        memcpy(st->b, b, n * sizeof(struct small_file));
+        st->n = n;
+        walk_spawn_fn(small_task_run, st);
+}
+
+/*
+ * For each file/directory in source directory, call again lcopy with
+ * file/directory source and destination target in dest_dir.
+ * Inside a tree walk, entries are spawned as tasks instead.
+ * Entries are visited in name order if output is ordered.
+ */
+void copy_directory (const char *src, const char *dest_dir, int rflag) {
+        struct dirent **entries = NULL;
+        struct dirent *entry;
+        DIR * d = NULL;
+        struct stat src_st;
+        struct stat dest_st;
+        struct small_file *batch = NULL;
+        int nbatch = 0;
+        int nentries = 0;
+        int index = 0;
+        int src_fd;
+        int dest_fd;
+        
+        /* Entries are looked up relative to both directories. */
+        src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (src_fd < 0)
+                handle_error("open");
+        dest_fd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dest_fd < 0)
+                handle_error("open");
+        
+        if (ordered) {
+                nentries = scandirat(src_fd, ".", &entries, NULL, alphasort);
+                if (nentries < 0)
+                        handle_error("scandir");
+        } else {
+                d = fdopendir(dup(src_fd));
+                if (!d)
+                        handle_error("opendir");
+        }
+        
+        if (small_size) {
+                batch = malloc(SMALL_BATCH * sizeof(struct small_file));
+                if (batch == NULL)
+                        handle_error("malloc");
+        }
+        
+        while ((entry = ordered ? 
+                        (index < nentries ? entries[index] : NULL) : 
+                        readdir(d)) != NULL) {
+                
+                index++;
+                if (!strcmp (entry->d_name, "."))
+                        continue;
+                if (!strcmp (entry->d_name, ".."))    
+                        continue;
+                if (!strcmp (entry->d_name, INDEX_NAME))
+                        continue;
+                
+                char *src_path = malloc(strlen(src) + 
+                        strlen(entry->d_name) + 2);
+                char *dest_path = malloc(strlen(dest_dir) + 
+                        strlen(entry->d_name) + 2);
+                
+                strcpy(src_path, src);
+                strcat(src_path, "/");
+                strcat(src_path, entry->d_name);
+                
+                strcpy(dest_path, dest_dir);
+                strcat(dest_path, "/");
+                strcat(dest_path, entry->d_name);
+                
+                /* 
+                 * File type from readdir saves a lookup of the source,
+                 * small files need the size of regular ones.
+                 */
+                memset(&src_st, 0, sizeof(src_st));
+                if (small_size && (entry->d_type == DT_REG || 
+                                        entry->d_type == DT_UNKNOWN))
+                        stat_entry(src_fd, entry->d_name, &src_st);
+                else if (entry->d_type == DT_REG || entry->d_type == DT_DIR)
+                        src_st.st_mode = DTTOIF(entry->d_type);
+                
+                /* Small files are batched, unless dest is a directory. */
+                if (small_size && S_ISREG(src_st.st_mode) && 
+                                src_st.st_size < small_size &&
+                                strcmp(get_extension(entry->d_name), "digs")) {
+                        stat_entry(dest_fd, entry->d_name, &dest_st);
+                        if (dest_st.st_mode == 0 || 
+                                        S_ISREG(dest_st.st_mode)) {
+                                batch[nbatch].src_name = 
+                                        strdup(entry->d_name);
+                                batch[nbatch].dest_name = 
+                                        batch[nbatch].src_name;
+                                batch[nbatch].src_st = src_st;
+                                batch[nbatch].dest_st = dest_st;
+                                batch[nbatch].index = index;
+                                if (++nbatch == SMALL_BATCH) {
+                                        small_hand(src_fd, dest_fd, src,
+                                                dest_dir, batch, nbatch);
+                                        nbatch = 0;
+                                }
+                                free(src_path);
+                                free(dest_path);
+                                continue;
+                        }
+                }
+                
+                /* Regular files are statted again for their size. */
+                if (walk_active()) {
+                        walk_spawn(src_path, dest_path, index, 
+                                small_size && S_ISREG(src_st.st_mode) ?
+                                0 : src_st.st_mode & S_IFMT);
+                        continue;
+                }
+                
+                /* Keeps output in entry order. */
+                small_flush(src_fd, dest_fd, src, dest_dir, batch, nbatch);
+                nbatch = 0;
+                
+                if (src_st.st_mode == 0)
+                        stat_entry(src_fd, entry->d_name, &src_st);
+                stat_entry(dest_fd, entry->d_name, &dest_st);
+                
+                int retcon = lcopy_entry(src_path, &src_st, 
+                        dest_path, &dest_st, rflag);
+                if (!retcon)
+                        printf("Copied from %s to %s.\n",
+                                src_path, dest_path);
+                else
+                        printf("%s: src:%s dest:%s.\n", 
+                                exception_str[exception], 
+                                src_path, dest_path);
+                
+                free(src_path);
+                free(dest_path);
+        }
+        
+        if (ordered) {
+                for (index = 0; index < nentries; index++)
+                        free(entries[index]);
+                free(entries);
+        } else {
+                closedir(d);
+        }
+        small_flush(src_fd, dest_fd, src, dest_dir, batch, nbatch);
+        free(batch);
+        close(src_fd);
+        close(dest_fd);
+}
+
+/* Tree walk task, copies one entry and prints its result. */
+void visit_entry (struct walk_task *t) {
+        struct stat src_st;
+        struct stat dest_st;
+        int retcon;
+        
+        memset(&src_st, 0, sizeof(src_st));
+        src_st.st_mode = t->type;
+        if (src_st.st_mode == 0)
+                stat_entry(AT_FDCWD, t->src, &src_st);
+        stat_entry(AT_FDCWD, t->dest, &dest_st);
+        retcon = lcopy_entry(t->src, &src_st, t->dest, &dest_st, 1);
+        
+        if (!retcon)
+                walk_printf("Copied from %s to %s.\n", t->src, t->dest);
+        else
+                walk_printf("%s: src:%s dest:%s.\n", 
+                        exception_str[exception], t->src, t->dest);
+}
+
+/*
+ * Returns the directory a directory src is copied to when dest is an
+ * existent directory, dest itself if their basenames are equal.
+ */
+char *dest_dir_path (const char *src, const char *dest) {
+        char *src_basename = get_basename(src);
+        char *dest_basename = get_basename(dest);
+        char *path = malloc(strlen(dest) + strlen(src_basename) + 2);
+
+        if (path == NULL)
+                handle_error("malloc");
+        strcpy(path, dest);
+        if (strcmp(src_basename, dest_basename)) {
+                strcat(path, "/");
+                strcat(path, src_basename);
+        }
+
+        return path;
+}
+
+/*
+ * Sets root to the Merkle root of regular file path, from its digest
+ * file, which is generated first unless fresh.
+ */
+static void file_root (const char *path, unsigned char *root) {
+        FILE *f = fopen(path, "r");
+        FILE *digs_f;
+
+        if (f == NULL)
+                handle_error("fopen");
+        digs_f = store_open(path, "r");
+        if (digs_f == NULL || !digs_root(fileno(digs_f), fileno(f), root)) {
+                if (digs_f != NULL)
+                        store_close(digs_f, path);
+                digs_f = store_open(path, "w+");
+                if (digs_f == NULL)
+                        handle_error("fopen");
+                write_digest_file(f, digs_f);
+                if (!digs_root(fileno(digs_f), fileno(f), root))
+                        handle_error(path);
+        }
+        store_close(digs_f, path);
+        fclose(f);
+}
+
+/*
+ * Sets root to the digest of the whole small file name of directory
+ * dirfd, which has no digest file.
+ */
+static void small_root (int dirfd, const char *name, off_t size, 
+                unsigned char *root) {
+        unsigned char *buf = malloc(size + 1);
+        ssize_t len;
+        int fd;
+
+        if (buf == NULL)
+                handle_error("malloc");
+        fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                handle_error("open");
+        len = read(fd, buf, size);
+        if (len < 0)
+                handle_error("read");
+        if (hash_digest(pool_local_worker()->hash, buf, len, root) != 
+                        digest_size)
+                handle_error("hash_digest");
+        close(fd);
+        free(buf);
+}
+
+/* Returns non-zero for entries that directory digests leave out. */
+static int dir_entry_skip (const char *name) {
+        return !strcmp(name, ".") || !strcmp(name, "..") ||
+                !strcmp(get_extension(name), "digs") ||
+                !strcmp(name, INDEX_NAME) ||
+                strlen(name) >= sizeof(((struct digs_dirent *)0)->name);
+}
+
+/*
+ * Sets root to the Merkle root of directory path, the digest of the
+ * names, types, sizes and roots of its regular files and directories.
+ * Entry records are kept in the directory digest file path.digs next
+ * to the directory. Files whose size, times and inode are as recorded
+ * keep their recorded root, others are digested, the digest file is
+ * rewritten only if a record changed.
+ */
+void dir_root (const char *path, unsigned char *root) {
+        struct dirent **entries = NULL;
+        struct digs_dirent *old;
+        struct digs_dirent *ents;
+        struct digs_dirent *e;
+        struct stat info;
+        unsigned char old_root[MAX_DIGEST_SIZE];
+        FILE *digs_f;
+        char *child;
+        const char *name;
+        long nold;
+        long n = 0;
+        long k = 0;
+        int nentries;
+        int changed = 0;
+        int fd;
+        int i;
+
+        old = NULL;
+        nold = 0;
+        digs_f = store_open(path, "r");
+        if (digs_f == NULL || 
+                        digs_read_dir(fileno(digs_f), &old, &nold, old_root))
+                changed = 1;
+        if (digs_f != NULL)
+                store_close(digs_f, path);
+
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+                handle_error("open");
+        nentries = scandirat(fd, ".", &entries, NULL, alphasort);
+        if (nentries < 0)
+                handle_error("scandir");
+        ents = calloc(nentries + 1, sizeof(struct digs_dirent));
+        if (ents == NULL)
+                handle_error("calloc");
+
+        for (i = 0; i < nentries; i++) {
+                name = entries[i]->d_name;
+                if (dir_entry_skip(name))
+                        continue;
+
+                child = malloc(strlen(path) + strlen(name) + 2);
+                if (child == NULL)
+                        handle_error("malloc");
+                strcpy(child, path);
+                strcat(child, "/");
+                strcat(child, name);
+                if (stat_entry(fd, name, &info) != 0 || 
+                                !(S_ISREG(info.st_mode) || 
+                                        S_ISDIR(info.st_mode))) {
+                        free(child);
+                        continue;
+                }
+
+                e = &ents[n++];
+                strcpy(e->name, name);
+                e->mode = info.st_mode;
+                while (k < nold && strcmp(old[k].name, name) < 0)
+                        k++;
+
+                if (S_ISDIR(info.st_mode)) {
+                        /* Changes below a directory do not show in its stat. */
+                        dir_root(child, e->root);
+                } else {
+                        e->size = info.st_size;
+                        e->mtime_ns = (int64_t)info.st_mtim.tv_sec * 
+                                1000000000 + info.st_mtim.tv_nsec;
+                        e->ctime_ns = (int64_t)info.st_ctim.tv_sec * 
+                                1000000000 + info.st_ctim.tv_nsec;
+                        e->ino = info.st_ino;
+                        if (k < nold && !strcmp(old[k].name, name) &&
+                                        old[k].mode == e->mode &&
+                                        old[k].size == e->size &&
+                                        old[k].mtime_ns == e->mtime_ns &&
+                                        old[k].ctime_ns == e->ctime_ns &&
+                                        old[k].ino == e->ino)
+                                memcpy(e->root, old[k].root, digest_size);
+                        else if (info.st_size < small_size)
+                                small_root(fd, name, info.st_size, e->root);
+                        else
+                                file_root(child, e->root);
+                }
+
+                if (k >= nold || memcmp(&old[k], e, sizeof(*e)))
+                        changed = 1;
+                free(child);
+        }
+
+        if (changed || n != nold) {
+                digs_f = store_open(path, "w");
+                if (digs_f == NULL)
+                        handle_error("fopen");
+                digs_write_dir(fileno(digs_f), ents, n, root);
+                store_close(digs_f, path);
+        } else
+                memcpy(root, old_root, digest_size);
+
+        for (i = 0; i < nentries; i++)
+                free(entries[i]);
+        free(entries);
+        free(ents);
+        free(old);
+        close(fd);
+}
+
+/* Freshness of a directory, as found by dir_fresh. */
+struct fresh_slot {
+        char *path;             /* NULL if empty. */
+        int fresh;
+        unsigned char root[MAX_DIGEST_SIZE];
+};
+
+/*
+ * Directories checked by dir_fresh in this run, so that each one is
+ * checked once, not again for every ancestor. Shared by walk workers.
+ */
+static struct fresh_slot *fresh_slots;
+static size_t fresh_mask;
+static size_t fresh_used;
+static pthread_mutex_t fresh_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t fresh_hash (const char *path) {
+        uint64_t h = 14695981039346656037ULL;
+
+        while (*path)
+                h = (h ^ (unsigned char)*path++) * 1099511628211ULL;
+
+        return h;
+}
+
+/* Returns the slot of path, an empty one if path was not checked. */
+static struct fresh_slot *fresh_slot (const char *path) {
+        size_t i = fresh_hash(path) & fresh_mask;
+
+        while (fresh_slots[i].path != NULL && 
+                        strcmp(fresh_slots[i].path, path))
+                i = (i + 1) & fresh_mask;
+
+        return &fresh_slots[i];
+}
+
+/*
+ * Returns 1 and sets fresh and root if path was checked, 0 otherwise.
+ */
+static int fresh_get (const char *path, int *fresh, unsigned char *root) {
+        struct fresh_slot *s;
+        int found = 0;
+
+        pthread_mutex_lock(&fresh_lock);
+        if (fresh_slots != NULL) {
+                s = fresh_slot(path);
+                if (s->path != NULL) {
+                        *fresh = s->fresh;
+                        memcpy(root, s->root, digest_size);
+                        found = 1;
+                }
+        }
+        pthread_mutex_unlock(&fresh_lock);
+
+        return found;
 }
 
-/* Returns extension of a file. */
-const char *get_extension(const char *path) {
-    const char *dot = strrchr(path, '.');
-    if (!dot || dot == path)
-        return "";
-    
-    return dot + 1;
-}
+/* Records the freshness of path, and its root if fresh. */
+static void fresh_set (const char *path, int fresh, 
+                const unsigned char *root) {
+        struct fresh_slot *old;
+        struct fresh_slot *s;
+        size_t size;
+        size_t i;
 
-/* Returns basename from file path. */
-char* get_basename (const char *path) {
-        char *basename;
-        char *copy;
-        int l = 0;
-        char *ssc;
-        
-        basename = malloc(500);
-        strcpy(basename, path);
-        
-        while (ssc = strstr(basename, "/")) {
-                l = strlen(ssc) + 1;
-                copy = basename;
-                basename = &basename[strlen(basename)-l+2];
+        pthread_mutex_lock(&fresh_lock);
+        if (2 * (fresh_used + 1) > fresh_mask + 1) {
+                old = fresh_slots;
+                size = old ? fresh_mask + 1 : 0;
+                fresh_mask = size ? 2 * size - 1 : 255;
+                fresh_slots = calloc(fresh_mask + 1, 
+                        sizeof(struct fresh_slot));
+                if (fresh_slots == NULL)
+                        handle_error("calloc");
+                for (i = 0; i < size; i++) {
+                        if (old[i].path != NULL)
+                                *fresh_slot(old[i].path) = old[i];
+                }
+                free(old);
         }
-        
-        /* Like ".../dir/" */
-        if (!strcmp(basename, "")) {
-                char *temp = malloc(500);
-                size_t length = (strlen(copy)-1);
-                /* Drop last '/' and take "dir". */
-                strncpy(temp, copy, length);
-                temp[length] = '\0';
-                return temp;
+
+        s = fresh_slot(path);
+        if (s->path == NULL) {
+                s->path = strdup(path);
+                if (s->path == NULL)
+                        handle_error("strdup");
+                fresh_used++;
         }
-        
-        return basename;
+        s->fresh = fresh;
+        if (fresh)
+                memcpy(s->root, root, digest_size);
+        pthread_mutex_unlock(&fresh_lock);
 }
 
-/* 
- * Returns digs file path.
- * path + extension = digs_path
+/*
+ * Returns non-zero if the directory digest file of path is fresh and
+ * sets root to its root then. It is fresh if its records are the
+ * regular files and directories of path, by name and type, each file
+ * has the recorded size, times and inode, and each directory has a
+ * fresh digest file of the recorded root. Only directories are read
+ * and entries stat'ed, the first stale entry ends the check. Results
+ * of path and the subdirectories checked are kept for the run, so the
+ * copy of a stale tree looks its subtrees up instead of checking them
+ * again at every level.
  */
-char *get_digs_filepath(const char *path) {
-        const char* extension = ".digs";
-        char *digs_path = NULL;
-        
-        if (path == NULL)
-                return;
+static int dir_fresh (const char *path, unsigned char *root) {
+        struct dirent **entries = NULL;
+        struct digs_dirent *old = NULL;
+        struct stat info;
+        unsigned char child_root[MAX_DIGEST_SIZE];
+        FILE *digs_f;
+        char *child;
+        const char *name;
+        long nold = 0;
+        long k = 0;
+        int nentries;
+        int fresh = 1;
+        int fd;
+        int i;
 
-        digs_path = malloc(strlen(path)+1+5);
-        
-        strcpy(digs_path, path);
-        strcat(digs_path, extension);
-        
-        return digs_path;
-}
+        if (fresh_get(path, &fresh, root))
+                return fresh;
 
-/*
- * Writes src's digest values to digsfile.
- * Returns 0 on success.
- */
-int write_digest_file (FILE *src, FILE *digsfile) {
+        digs_f = store_open(path, "r");
+        if (digs_f == NULL) {
+                fresh_set(path, 0, NULL);
+                return 0;
+        }
+        if (digs_read_dir(fileno(digs_f), &old, &nold, root) != 0) {
+                store_close(digs_f, path);
+                fresh_set(path, 0, NULL);
+                return 0;
+        }
+        store_close(digs_f, path);
 
-        size_t fread_src_length;
-        size_t fwrite_dest_length;
-        size_t md5_length;
-        char buffer[SIZE_OF_CHUNK];
-        unsigned char digest[SIZE_OF_DIGEST];
-        
-        if (src == NULL || digsfile == NULL)
-                return -1;
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        nentries = fd < 0 ? -1 : scandirat(fd, ".", &entries, NULL, 
+                        alphasort);
+        if (nentries < 0)
+                fresh = 0;
 
-        rewind(src);
-        rewind(digsfile);
-        
-        while((fread_src_length = fread(buffer, 1, SIZE_OF_CHUNK, src)) > 0) {
-                md5_length = digmd5(buffer, digest, fread_src_length);
-                fwrite_dest_length = fwrite(digest, 1, md5_length, digsfile);
-                if (fwrite_dest_length < md5_length) {
-                    handle_error("fwrite");
+        for (i = 0; i < nentries; i++) {
+                name = entries[i]->d_name;
+                if (!fresh || dir_entry_skip(name) || 
+                                stat_entry(fd, name, &info) != 0 ||
+                                !(S_ISREG(info.st_mode) || 
+                                        S_ISDIR(info.st_mode)))
+                        continue;
+
+                if (k >= nold || strcmp(old[k].name, name) || 
+                                old[k].mode != info.st_mode) {
+                        fresh = 0;
+                } else if (S_ISDIR(info.st_mode)) {
+                        if (asprintf(&child, "%s/%s", path, name) < 0)
+                                handle_error("asprintf");
+                        fresh = dir_fresh(child, child_root) && 
+                                !memcmp(child_root, old[k].root, 
+                                        digest_size);
+                        free(child);
+                } else {
+                        fresh = old[k].size == (uint64_t)info.st_size &&
+                                old[k].mtime_ns == 
+                                (int64_t)info.st_mtim.tv_sec * 1000000000 +
+                                info.st_mtim.tv_nsec &&
+                                old[k].ctime_ns == 
+                                (int64_t)info.st_ctim.tv_sec * 1000000000 +
+                                info.st_ctim.tv_nsec &&
+                                old[k].ino == info.st_ino;
                 }
+                k++;
         }
+        if (k != nold)
+                fresh = 0;
 
-        return 0;
+        for (i = 0; i < nentries; i++)
+                free(entries[i]);
+        free(entries);
+        free(old);
+        if (fd >= 0)
+                close(fd);
+
+        fresh_set(path, fresh, root);
+        return fresh;
 }
 
 /*
- * Copies source file to destination target.
- * Should be called if destination target does not exists.
+ * Returns non-zero if directories src and dest have fresh directory
+ * digest files, as written by dir_root, of equal roots.
  */
-int copy_file_raw (FILE *src, FILE *dest) {
-        unsigned char buffer;
-        size_t fread_src_length;
-        size_t fwrite_dest_length;
-        
-        if (src == NULL || dest == NULL)
-                return -1;
-        
-        rewind(src);
-        rewind(dest);
-        
-        while((fread_src_length = fread(&buffer, 1, 1, src)) > 0) {
-                fwrite_dest_length = fwrite(&buffer, 1, fread_src_length, dest);
-                if (fwrite_dest_length < fread_src_length) {
-                        handle_error("fwrite");
+int dir_same (const char *src, const char *dest) {
+        unsigned char src_root[MAX_DIGEST_SIZE];
+        unsigned char dest_root[MAX_DIGEST_SIZE];
+
+        return dir_fresh(src, src_root) && dir_fresh(dest, dest_root) &&
+                !memcmp(src_root, dest_root, digest_size);
+}
+
+/*
+ * Trees were copied by lcopy_entry, not all skipped as equal. Set by
+ * walk workers.
+ */
+static int trees_copied = 0;
+
+/*
+ * Refreshes the directory digests of source directories and of the
+ * directories they were copied to, so that equal trees and subtrees
+ * are skipped by comparing their roots on the next run. Done after the
+ * copy, file roots come from the digest files it left fresh, and only
+ * if a tree was copied, the roots of skipped trees are fresh.
+ */
+void dir_roots (char **sources, int nsources, const char *dest) {
+        unsigned char root[MAX_DIGEST_SIZE];
+        char *target;
+        int i;
+
+        if (!__atomic_load_n(&trees_copied, __ATOMIC_RELAXED) ||
+                        !is_directory(dest))
+                return;
+
+        for (i = 0; i < nsources; i++) {
+                if (!is_directory(sources[i]))
+                        continue;
+                target = dest_dir_path(sources[i], dest);
+                if (is_directory(target)) {
+                        dir_root(sources[i], root);
+                        dir_root(target, root);
                 }
+                free(target);
         }
-
-        return 0;
 }
 
 /*
@@ -208,6 +2337,23 @@ int copy_file_raw (FILE *src, FILE *dest) {
  * Returns 0 on success, 
  */
 int lcopy (char *src, char *dest, int rflag) {
+        struct stat src_st;
+        struct stat dest_st;
+
+        stat_entry(AT_FDCWD, src, &src_st);
+        stat_entry(AT_FDCWD, dest, &dest_st);
+
+        return lcopy_entry(src, &src_st, dest, &dest_st, rflag);
+}
+
+/*
+ * Like lcopy, with metadata of src and dest taken by the caller, a
+ * st_mode of 0 for a path that does not exist. Only the file type of
+ * src is used, and its size with --small-files.
+ */
+int lcopy_entry (char *src, const struct stat *src_st, char *dest, 
+                const struct stat *dest_st, int rflag) {
+        struct stat new_st;
 
 #ifdef DEBUG
         printf("lcopy (%s, %s, %s) \n", src, dest, rflag ? "R:yes" : "R:no" );
@@ -215,13 +2361,13 @@ int lcopy (char *src, char *dest, int rflag) {
 #endif /* DEBUG */
 
         /* Source does not exist. */
-        if (!is_file_exist(src)) {
+        if (src_st->st_mode == 0) {
                 exception = SRCNOTEXIST;
                 return -1;
         }
 
         /* Source is a directory. */
-        if (is_directory(src)) {
+        if (S_ISDIR(src_st->st_mode)) {
         
 #ifdef DEBUG
         printf("Source %s: Directory.\n", src);
@@ -237,85 +2383,43 @@ int lcopy (char *src, char *dest, int rflag) {
                 /* Recursively copy the directory. */
                 else {
                         /* Check that destination is not a regular file. */
-                        if (is_regularfile(dest)) {
+                        if (S_ISREG(dest_st->st_mode)) {
                                 exception = NONDIRDEST;
                                 return -1;
                         }
                         
                         /* Destination is an existent directory. */
-                        if (is_directory(dest)) {
+                        if (S_ISDIR(dest_st->st_mode)) {
                                 
 #ifdef DEBUG
                                 printf("Destination %s: Exist.\n", dest);
                                 fflush(stdout);
 #endif /* DEBUG */
-                                char *src_basename = get_basename(src);
-                                char *dest_basename = get_basename(dest);
-                                char *new_dest_dir = malloc(500);
+                                char *new_dest_dir = dest_dir_path(src, dest);
                                 
-                                if (strcmp(src_basename, dest_basename)) {
-                                        strcpy(new_dest_dir, dest);
-                                        strcat(new_dest_dir, "/");
-                                        strcat(new_dest_dir, src_basename);
-                                } else {
-                                        strcpy(new_dest_dir, dest);
-                                }
+                                if (strcmp(new_dest_dir, dest))
+                                        stat_entry(AT_FDCWD, new_dest_dir, 
+                                                &new_st);
+                                else
+                                        new_st = *dest_st;
                                 
                                 /* If not exist mkdir new destination directory. */
-                                if (!is_directory(new_dest_dir)) {
+                                if (!S_ISDIR(new_st.st_mode)) {
                                         if (mkdir(new_dest_dir,0777) == -1) {
                                                 handle_error("mkdir");
                                         }
+                                } else if (dir_same(src, new_dest_dir)) {
+                                        /* Equal trees, nothing to copy. */
+                                        free(new_dest_dir);
+                                        return 0;
                                 }
                                 
-                                /* 
-                                 * For each file/directory in source directory,
-                                 * call again lcopy with file/directory source
-                                 * and destination target.
-                                 */
-                                DIR * d;
-                                struct dirent *entry;
-
-                                /*ret = chdir(MANIFEST_DIR);
-                                if (ret!=0) {
-                                perror("Error:");
-                                }*/
-
-                                d = opendir(src);
-
-                                if (!d) {
-                                        handle_error("opendir");
-                                }
-                                
-
-                                while ((entry = readdir(d)) != NULL) {
-
-                                        if (!strcmp (entry->d_name, "."))
-                                                continue;
-                                        if (!strcmp (entry->d_name, ".."))    
-                                                continue;
-                                        
-                                        char *src_path = malloc(500);
-                                        char *dest_path = malloc(500);
-                                        
-                                        strcpy(src_path, src);
-                                        strcat(src_path, "/");
-                                        strcat(src_path, entry->d_name);
-                                        
-                                        strcpy(dest_path, new_dest_dir);
-                                        strcat(dest_path, "/");
-                                        strcat(dest_path, entry->d_name);
-                                        
-                                        int retcon = lcopy(src_path, 
-                                                        dest_path, rflag);
-                                        if (!retcon)
-                                                printf("Copied from %s to %s.\n",
-                                                        src_path, dest_path);
-                                        else
-                                                printf("%s: src:%s dest:%s.\n", 
-                                                        exception_str[exception], 
-                                                        src_path, dest_path);
-                                }
+                                /* Copied into, stale for a later source. */
+                                fresh_set(new_dest_dir, 0, NULL);
+                                __atomic_store_n(&trees_copied, 1, 
+                                        __ATOMIC_RELAXED);
+                                copy_directory(src, new_dest_dir, rflag);
+                                free(new_dest_dir);
                         } 
                         /* Destination is assumed not exist. */
                         else {
@@ -329,56 +2433,9 @@ int lcopy (char *src, char *dest, int rflag) {
                                         handle_error("mkdir");
                                 }
                                 
-                                /* 
-                                 * For each file/directory in source directory,
-                                 * call again lcopy with file/directory source
-                                 * and destination target.
-                                 */
-                                DIR * d;
-                                struct dirent *entry;
-
-                                /*ret = chdir(MANIFEST_DIR);
-                                if (ret!=0) {
-                                perror("Error:");
-                                }*/
-
-                                d = opendir(src);
-
-                                if (!d) {
-                                        handle_error("opendir");
-                                }
-
-                                while ((entry = readdir(d)) != NULL) {
-
-                                        if (!strcmp (entry->d_name, "."))
-                                                continue;
-                                        if (!strcmp (entry->d_name, ".."))    
-                                                continue;
-                                        
-                                        char *src_path = malloc(500);
-                                        char *dest_path = malloc(500);
-                                        
-                                        strcpy(src_path, src);
-                                        strcat(src_path, "/");
-                                        strcat(src_path, entry->d_name);
-                                        
-                                        strcpy(dest_path, dest);
-                                        strcat(dest_path, "/");
-                                        strcat(dest_path, entry->d_name);
-                                        
-                                        int retcon = lcopy(src_path, 
-                                                        dest_path, rflag);
-                                        if (!retcon)
-                                                printf("Copied from %s to %s.\n",
-                                                        src_path, dest_path);
-                                        else
-                                                printf("%s: src:%s dest:%s.\n", 
-                                                        exception_str[exception], 
-                                                        src_path, dest_path);
-                                                        
-                                }
-                                
-                                
+                                __atomic_store_n(&trees_copied, 1, 
+                                        __ATOMIC_RELAXED);
+                                copy_directory(src, dest, rflag);
                         }
 
                 }
@@ -397,19 +2454,44 @@ int lcopy (char *src, char *dest, int rflag) {
                         return -1;
                 }
                 
+                /* Small file, copied whole without digest files. */
+                if (small_size && src_st->st_size < small_size &&
+                                (dest_st->st_mode == 0 || 
+                                 S_ISREG(dest_st->st_mode))) {
+                        struct small_file f;
+                        struct stats fs;
+                        
+                        f.src_name = src;
+                        f.dest_name = dest;
+                        f.src_st = *src_st;
+                        f.dest_st = *dest_st;
+                        stats_file_begin(&fs);
+                        small_copy(AT_FDCWD, AT_FDCWD, &f, 1);
+                        stats_file_end(&fs, src, dest, "small", 1);
+                        return 0;
+                }
+                
                 /* Destination is not exist. */
-                if (!is_file_exist(dest)) {
+                if (dest_st->st_mode == 0) {
                 
 #ifdef DEBUG
                         printf("Destination %s: Not exist.\n", dest);
                         fflush(stdout);
 #endif /* DEBUG */
 
-                        FILE *src_file = fopen(src, "r");
-                        FILE *dest_file = fopen(dest, "w");
+                        FILE *src_file;
+                        FILE *dest_file;
                         FILE *src_digs_file;
                         FILE *dest_digs_file;
+                        struct stat before;
+                        struct stat after;
+                        struct digs digs;
+                        struct stats fs;
+                        int strategy;
                         
+                        stats_file_begin(&fs);
+                        src_file = fopen(src, "r");
+                        dest_file = fopen(dest, "w");
                         if (src_file == NULL)
                                 handle_error("fopen");
                         if (dest_file == NULL) {
@@ -417,38 +2499,63 @@ int lcopy (char *src, char *dest, int rflag) {
                                 handle_error("fopen");
                         }
                         
-                        copy_file_raw(src_file, dest_file);
+                        if (fstat(fileno(src_file), &before) != 0)
+                                handle_error("fstat");
+                        stats_add(STAT_BYTES, before.st_size);
+                        stats_add(STAT_CHUNKS, CHUNK_COUNT(before.st_size));
+                        stats_add(STAT_CHANGED, CHUNK_COUNT(before.st_size));
+                        strategy = copy_file_raw(src_file, dest_file);
+                        walk_printf("Copy strategy for %s: %s.\n", dest,
+                                copy_strategy_str[strategy]);
                         
                         /* Create source digs file. */
-                        char *src_digs_path = get_digs_filepath(src);
-                        if (!is_file_exist(src_digs_path) || 
-                                compare_mtime(src, src_digs_path) > 0) {
-                                src_digs_file = fopen(src_digs_path, "w+"); 
+                        src_digs_file = store_open(src, "r");
+                        if (!digs_hit(src_digs_file, src_file)) {
+                                if (src_digs_file != NULL)
+                                        store_close(src_digs_file, src);
+                                src_digs_file = store_open(src, "w+"); 
                                 if (src_digs_file == NULL)
                                         handle_error("fopen");
                                 
                                 write_digest_file(src_file, src_digs_file);
-                                fclose(src_digs_file);
                         }
-                        fclose(src_file);
                         
                         /* Create destination digs file. */
-                        char *dest_digs_path = get_digs_filepath(dest);
-                        dest_digs_file = fopen(dest_digs_path, "w");
+                        dest_digs_file = store_open(dest, "w");
                         if (dest_digs_file == NULL)
                                 handle_error("fopen");
                         
-                        fclose(dest_file);
-                        dest_file = fopen(dest, "r");
-                        if (dest_file == NULL)
-                                handle_error("fopen");
+                        /* 
+                         * Destination is a copy of source, unless source
+                         * changed while it was copied. Reuse source
+                         * digests then instead of reading it back.
+                         */
+                        if (fstat(fileno(src_file), &after) != 0)
+                                handle_error("fstat");
+                        if (is_unchanged(&before, &after) &&
+                                        digs_map(fileno(src_digs_file), &digs) == 0 &&
+                                        digs.size == digest_size) {
+                                digs_write(fileno(dest_digs_file), 
+                                        fileno(dest_file), digs.digests, 
+                                        digs.lens, digs.count);
+                                digs_unmap(&digs);
+                        } else {
+                                fclose(dest_file);
+                                dest_file = fopen(dest, "r");
+                                if (dest_file == NULL)
+                                        handle_error("fopen");
                                 
-                        write_digest_file(dest_file, dest_digs_file);
+                                write_digest_file(dest_file, dest_digs_file);
+                        }
+                        store_close(src_digs_file, src);
+                        io_drop_cache(fileno(dest_file));
+                        fclose(src_file);
                         fclose(dest_file);
-                        fclose(dest_digs_file);
+                        store_close(dest_digs_file, dest);
+                        stats_file_end(&fs, src, dest, "new", 1);
                 }
                 /* Destination exist and it is a directory. */
-                else if (is_directory(dest)) {
+                else if (S_ISDIR(dest_st->st_mode)) {
                 
 #ifdef DEBUG
                         printf("Destination %s: Existent directory.\n", dest);
@@ -462,7 +2569,9 @@ int lcopy (char *src, char *dest, int rflag) {
                         strcat(new_dest, "/");
                         strcat(new_dest, src_basename);
                         
-                        int retcon = lcopy(src, new_dest, rflag);
+                        stat_entry(AT_FDCWD, new_dest, &new_st);
+                        int retcon = lcopy_entry(src, src_st, new_dest, 
+                                &new_st, rflag);
                         
                         if (!retcon)
                                 printf("Copied from %s to %s.\n",
@@ -473,22 +2582,21 @@ int lcopy (char *src, char *dest, int rflag) {
                                         src, new_dest);
                 }
                 /* Destination exist and it is a regular file. */
-                else if (is_regularfile(dest)) {
+                else if (S_ISREG(dest_st->st_mode)) {
                 
 #ifdef DEBUG
                         printf("Destination %s: Existent regular file.\n", dest);
                         fflush(stdout);
 #endif /* DEBUG */
                 
-                        /* Check that source digest file exist. */
-                        char *src_digs_path = get_digs_filepath(src);
-                        char *dest_digs_path = get_digs_filepath(dest);
-                        
                         FILE *src_f = NULL;
                         FILE *src_digs_f = NULL;
                         FILE *dest_f = NULL;
                         FILE *dest_digs_f = NULL;
+                        const char *method = "diff";
+                        struct stats fs;
                         
+                        stats_file_begin(&fs);
                         src_f = fopen(src, "r");
                         if (src_f == NULL)
                                 handle_error("fopen1");
@@ -498,155 +2606,67 @@ int lcopy (char *src, char *dest, int rflag) {
                                 handle_error("fopen2");
                                 
                         /* 
-                        * If <>.digs file do not exist or its modification
-                        * time is before the modification time of file, 
-                        * update <>.digs.
+                        * If <>.digs file do not exist or its header does
+                        * not describe the file as it is now, update
+                        * <>.digs. Stale source digests are not
+                        * generated up front, they are produced while
+                        * streaming the source in stream_diff().
                         */
-                        if (!is_file_exist(src_digs_path) || 
-                                compare_mtime(src, src_digs_path) > 0) {
-                                src_digs_f = fopen(src_digs_path, "w+"); 
+                        src_digs_f = store_open(src, "r");
+                        int src_stale = !digs_hit(src_digs_f, src_f);
+                        
+                        if (src_stale) {
+                                if (src_digs_f != NULL)
+                                        store_close(src_digs_f, src);
+                                src_digs_f = store_open(src, "w+"); 
                                 if (src_digs_f == NULL)
                                         handle_error("fopen3");
 #ifdef DEBUG
-                                printf("Source digs %s: Generated.\n", src_digs_path);
+                                printf("Source digs %s: Streamed.\n", src);
                                 fflush(stdout);
 #endif /* DEBUG */
-
-                                write_digest_file(src_f, src_digs_f);
                         }
                         
-                        if (!is_file_exist(dest_digs_path) || 
-                                compare_mtime(dest, dest_digs_path) > 0) {
-                                dest_digs_f = fopen(dest_digs_path, "w+"); 
+                        dest_digs_f = store_open(dest, "r+");
+                        if (!digs_hit(dest_digs_f, dest_f)) {
+                                if (dest_digs_f != NULL)
+                                        store_close(dest_digs_f, dest);
+                                dest_digs_f = store_open(dest, "w+"); 
                                 if (dest_digs_f == NULL)
                                         handle_error("fopen4");
 
 #ifdef DEBUG
-                                printf("Dest digs %s: Generated.\n", dest_digs_path);
+                                printf("Dest digs %s: Generated.\n", dest);
                                 fflush(stdout);
 #endif /* DEBUG */
 
                                 write_digest_file(dest_f, dest_digs_f);
                         }
                         
-                        if (src_digs_f == NULL) {
-                                src_digs_f = fopen(src_digs_path, "r"); 
-                                if (src_digs_f == NULL)
-                                        handle_error("fopen5");
-                        }
-                        
-                        if (dest_digs_f == NULL) {
-                                dest_digs_f = fopen(dest_digs_path, "r"); 
-                                if (dest_digs_f == NULL)
-                                        handle_error("fopen6");
-                        }
-                        
-                        rewind(src_f);
-                        rewind(src_digs_f);
-                        rewind(dest_f);
-                        rewind(dest_digs_f);
-
-                        unsigned char *src_buf = malloc(SIZE_OF_DIGEST);
-                        unsigned char *dest_buf = malloc(SIZE_OF_DIGEST);
-                        
-                        int chunk_index = 0;
-                        int diff_chunk_count = 0;
-                        int diff_flag;
-                        int rchunk_size = 0;
-                        int wchunk_size = 0;
-                        int srcDigsReadByte = 0;
-                        int destDigsReadByte = 0;
-                        
-                        while(srcDigsReadByte = fread(src_buf, 1, SIZE_OF_DIGEST, src_digs_f)) {
-
-                                destDigsReadByte = fread(dest_buf, 1, SIZE_OF_DIGEST, dest_digs_f);
-                                
-#ifdef DEBUG
-                                if (srcDigsReadByte != SIZE_OF_DIGEST) {
-                                    printf("Note that: %d bytes read from src digs.\n", srcDigsReadByte);
-                                    fflush(stdout);
-                                } 
-                                if (destDigsReadByte != SIZE_OF_DIGEST) {
-                                    printf("Note that: %d bytes read from dest digs.\n", destDigsReadByte);
-                                    fflush(stdout);
-                                }
-#endif /* DEBUG */
-                                /* 
-                                 * Since digmd5 guarantees 128bit digest value for 
-                                 * each buffer size <= 128KB,
-                                 * do not handle fread/fwrite returns 
-                                 * of digest files.
-                                 * 
-                                 * Note that:
-                                 * SIZE_OF_DIGEST = 128bit
-                                 * SIZE_OF_CHUNK = 128Kb
-                                 */
-                                
-                                diff_flag = memcmp(src_buf, dest_buf, SIZE_OF_DIGEST);
-                                
-                                /* Copy chunk from source to destination. */
-                                if (diff_flag) {
-                                
-                                        diff_chunk_count++;
-#ifdef DEBUG
-                                        printf("chunk %d: CHANGED!\n", chunk_index);
-                                        //printf("source: %s dest: %s", src_buf, dest_buf);
-                                        fflush(stdout);
-#endif /* DEBUG */
-                                        int retval;
-                                        unsigned char *chunk = malloc(SIZE_OF_CHUNK);
-                                        memset(chunk, 0, sizeof(chunk));
-                                        /* Copy chunk from source to buffer.*/
-                                        retval = fseek(src_f, (chunk_index*SIZE_OF_CHUNK), SEEK_SET);
-                                        rchunk_size = fread(chunk, 1, SIZE_OF_CHUNK, src_f);
-                                        
-#ifdef DEBUG
-                                        if (rchunk_size != SIZE_OF_CHUNK) {
-                                            printf("Note that: %d byte read as chunk.\n", rchunk_size);
-                                            fflush(stdout);
-                                        }
-#endif /* DEBUG */  
-                                        /* Write chunk from buffer to dest. */
-                                        retval = fseek(dest_f, (chunk_index*SIZE_OF_CHUNK), SEEK_SET);
-                                        wchunk_size = fwrite(chunk, 1, rchunk_size, dest_f);
-
-#ifdef DEBUG
-                                        if (wchunk_size != SIZE_OF_CHUNK) {
-                                            printf("Note that: %d byte written as chunk.\n", wchunk_size);
-                                            fflush(stdout);
-                                        }
-#endif /* DEBUG */ 
-                                        if (wchunk_size < rchunk_size) {
-                                                /* if (ferror(fd2)) */
-                                                handle_error("fwrite");
-                                        }
-                                        
-                                        free(chunk);
-                                }
-#ifdef DEBUG
-                                else {
-                                        printf("chunk %d: OK.\n", chunk_index);
-                                        fflush(stdout);
-                                }
-#endif /* DEBUG */  
-                                
-                                chunk_index++;
+                        if (cdc) {
+                                if (src_stale)
+                                        write_digest_file(src_f, src_digs_f);
+                                cdc_diff_copy(src_f, src_digs_f, 
+                                        dest_f, dest_digs_f, dest);
+                                method = "cdc";
+                        } else if (!src_stale)
+                                diff_copy(src_f, src_digs_f, 
+                                        dest_f, dest_digs_f);
+                        else if (append_mode && append_copy(src_f, 
+                                        src_digs_f, dest_f, dest_digs_f) >= 0)
+                                method = "append";
+                        else {
+                                stream_diff(src_f, src_digs_f, 
+                                        dest_f, dest_digs_f);
+                                method = "stream";
                         }
-
-#ifdef DEBUG
-                        printf("%.2f%% of chunks are have changed.\n", 
-                                ((double)diff_chunk_count)/((double) chunk_index)*100);
-                        printf("Total %d chunks, %d changed.\n", chunk_index, diff_chunk_count);
-                        fflush(stdout);
-#endif /* DEBUG */                   
-                        
                         
+                        io_drop_cache(fileno(dest_f));
                         fclose(src_f);
-                        fclose(src_digs_f);
+                        store_close(src_digs_f, src);
                         fclose(dest_f);
-                        fclose(dest_digs_f);
-                        free(src_buf);
-                        free(dest_buf);
+                        store_close(dest_digs_f, dest);
+                        stats_file_end(&fs, src, dest, method, 1);
                 }
                 /* Erronous condition. */
                 else {
@@ -657,6 +2677,48 @@ int lcopy (char *src, char *dest, int rflag) {
         return 0;
 }
 
+/* 
+ * Parses a size of N[K|M|G] bytes.
+ * Returns -1 if s is not a size.
+ */
+long parse_size (const char *s) {
+        char *end;
+        long size;
+
+        size = strtol(s, &end, 10);
+        if (end == s)
+                return -1;
+        switch (*end) {
+        case 'g': case 'G':
+                size <<= 10;
+                /* fall through */
+        case 'm': case 'M':
+                size <<= 10;
+                /* fall through */
+        case 'k': case 'K':
+                size <<= 10;
+                end++;
+        }
+
+        return *end == '\0' ? size : -1;
+}
+
+/*
+ * Sets the chunk size, a power of two from MIN_CHUNK_SIZE to
+ * MAX_CHUNK_SIZE. Returns -1 if size is not one.
+ */
+int set_chunk_size(long size) {
+        if (size < MIN_CHUNK_SIZE || size > MAX_CHUNK_SIZE || 
+                        (size & (size - 1)))
+                return -1;
+
+        chunk_size = size;
+        chunk_shift = __builtin_ctzl(size);
+        range_chunks = size < RANGE_SIZE ? RANGE_SIZE / size : 1;
+
+        return 0;
+}
+
 /*
  * Prints usage information.
  */
@@ -665,11 +2727,67 @@ void usage () {
                "\t[OPTIONS] SOURCE... DEST\n"
                "\tCopy SOURCE(s) to DEST.\n"
                "\nOptions:\n"
-               "\t-R,-r   Recursively copy\n");
+               "\t-R,-r   Recursively copy\n"
+               "\t-j,--threads N\n"
+               "\t        Digest chunks on N threads (default: one per cpu),\n"
+               "\t        with -r walk directories on N threads\n"
+               "\t--ordered\n"
+               "\t        Print results in name order of a sequential walk\n"
+               "\t--io-engine uring|psync\n"
+               "\t        Chunk I/O with io_uring (default, falls back to\n"
+               "\t        psync if unavailable) or pread/pwrite\n"
+               "\t--hash md5|sha256|blake2s|xxh128|blake3\n"
+               "\t        Chunk digest algorithm (default: md5), xxh128\n"
+               "\t        and blake3 need libxxhash and libblake3\n"
+               "\t--chunk-size N[K|M]\n"
+               "\t        Chunk size, a power of two from 4K to 64M\n"
+               "\t        (default: 128K)\n"
+               "\t--cdc   Content defined chunks averaging the chunk size,\n"
+               "\t        unchanged content is found after insertions\n"
+               "\t--index With -r keep digests of each tree in one index\n"
+               "\t        file " INDEX_NAME " instead of .digs files\n"
+               "\t--small-files N[K|M]\n"
+               "\t        Copy files below N bytes whole and in batches,\n"
+               "\t        by size and mtime, without digest files\n"
+               "\t--append\n"
+               "\t        Take grown sources as appended to: check only the\n"
+               "\t        last chunk destination has, copy the new tail\n"
+               "\t--direct\n"
+               "\t        Read and write chunks with O_DIRECT, bypassing\n"
+               "\t        the page cache, implies --drop-cache\n"
+               "\t--drop-cache\n"
+               "\t        Write back and drop cached pages of each copy\n"
+               "\t        once it is done\n"
+               "\t--stats[=FILE]\n"
+               "\t        Write timings and counters of each file and of\n"
+               "\t        the run as JSON to FILE (default: stderr)\n"
+               "\nRemote copy:\n"
+               "\t--rsh CMD\n"
+               "\t        Copy to DEST of a server started by the shell\n"
+               "\t        command CMD, e.g. \"ssh host lcopy --serve\"\n"
+               "\t--connect [HOST]:PORT|PATH\n"
+               "\t        Copy to DEST of a server listening on a TCP port\n"
+               "\t        or, for a PATH with a '/', a Unix socket\n"
+               "\t-z,--compress\n"
+               "\t        Deflate chunk data sent to the server\n"
+               "\t--serve Serve a client on stdin and stdout\n"
+               "\t--listen [HOST]:PORT|PATH\n"
+               "\t        With --serve, serve clients connecting there,\n"
+               "\t        on loopback without HOST, to destinations\n"
+               "\t        under the working directory only\n"
+               "\nPatches:\n"
+               "\t--make-patch PATCH SOURCE BASE\n"
+               "\t        Write the changes turning BASE into SOURCE to PATCH\n"
+               "\t--apply-patch PATCH DEST\n"
+               "\t        Apply PATCH to DEST, which must be equal to BASE\n"
+               "\nFan-out:\n"
+               "\t--fanout SOURCE DEST...\n"
+               "\t        Copy SOURCE to every DEST, reading it once\n");
 }
 
+#ifndef LCOPY_BENCH
 /*
- * Program main.
+ * Program main, left out of the benchmark which has its own.
  */
 int main (int argc, char *argv[]) {
         int ch;
@@ -679,54 +2797,268 @@ int main (int argc, char *argv[]) {
         int rc;
         char **sources;
         char *dest = NULL;
+        int serve = 0; /* Serve remote clients. */
+        char *listen_addr = NULL; /* Address served, stdin/stdout if NULL. */
+        char *connect_addr = NULL; /* Address of the server to copy to. */
+        char *rsh = NULL; /* Command starting the server to copy to. */
+        int zflag = 0; /* Deflate chunk data sent to the server. */
+        char *make_patch_path = NULL; /* Patch to write instead of dest. */
+        char *apply_patch_path = NULL; /* Patch to apply to dest. */
+        long changed;
+        int fanout = 0; /* Copy one source to every destination. */
         
+        static struct option long_options[] = {
+                {"threads", required_argument, NULL, 'j'},
+                {"ordered", no_argument, NULL, 'O'},
+                {"io-engine", required_argument, NULL, 'E'},
+                {"hash", required_argument, NULL, 'H'},
+                {"chunk-size", required_argument, NULL, 'C'},
+                {"cdc", no_argument, NULL, 'D'},
+                {"index", no_argument, NULL, 'I'},
+                {"small-files", required_argument, NULL, 'S'},
+                {"append", no_argument, NULL, 'A'},
+                {"serve", no_argument, NULL, 'V'},
+                {"listen", required_argument, NULL, 'L'},
+                {"connect", required_argument, NULL, 'N'},
+                {"rsh", required_argument, NULL, 'P'},
+                {"compress", no_argument, NULL, 'z'},
+                {"make-patch", required_argument, NULL, 'M'},
+                {"apply-patch", required_argument, NULL, 'T'},
+                {"fanout", no_argument, NULL, 'F'},
+                {"stats", optional_argument, NULL, 'W'},
+                {"direct", no_argument, NULL, 'B'},
+                {"drop-cache", no_argument, NULL, 'K'},
+                {NULL, 0, NULL, 0}
+        };
+
         /* Missing arguments, early control. */
-        if (argc < 3) {
+        if (argc < 2) {
                 usage();
                 exit(EXIT_SUCCESS);
         }
         
-        /* Decrease 1 for name-for-executable, 1 for destination target. */
-        number_of_sources = argc - 2; 
-        
         /* Parse command line options. */
-        while ((ch = getopt(argc, argv, "Rr")) != -1) {
+        while ((ch = getopt_long(argc, argv, "Rrj:z", 
+                                long_options, NULL)) != -1) {
                 switch (ch) {
                 case 'R':
                 case 'r':
                         rflag = 1;
-                        number_of_sources--;
+                        break;
+                case 'O':
+                        ordered = 1;
+                        break;
+                case 'D':
+                        cdc = 1;
+                        break;
+                case 'I':
+                        use_index = 1;
+                        break;
+                case 'A':
+                        append_mode = 1;
+                        break;
+                case 'B':
+                        direct_io = 1;
+                        drop_cache = 1;
+                        break;
+                case 'K':
+                        drop_cache = 1;
+                        break;
+                case 'V':
+                        serve = 1;
+                        break;
+                case 'L':
+                        listen_addr = optarg;
+                        break;
+                case 'N':
+                        connect_addr = optarg;
+                        break;
+                case 'P':
+                        rsh = optarg;
+                        break;
+                case 'M':
+                        make_patch_path = optarg;
+                        break;
+                case 'F':
+                        fanout = 1;
+                        break;
+                case 'T':
+                        apply_patch_path = optarg;
+                        break;
+                case 'W':
+                        stats_open(optarg);
+                        break;
+                case 'z':
+                        if (!remote_can_deflate()) {
+                                fprintf(stderr, 
+                                        "Compression is not available.\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        zflag = 1;
+                        break;
+                case 'H':
+                        for (hash_algo = 0; hash_algo < HASH_COUNT; hash_algo++)
+                                if (!strcmp(optarg, hash_str[hash_algo]))
+                                        break;
+                        if (hash_algo == HASH_COUNT || 
+                                        !hash_available(hash_algo)) {
+                                fprintf(stderr, "Hash %s is not available.\n",
+                                        optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        digest_size = hash_size(hash_algo);
+                        break;
+                case 'E':
+                        for (io_engine = IO_URING; io_engine >= 0; io_engine--)
+                                if (!strcmp(optarg, io_engine_str[io_engine]))
+                                        break;
+                        if (io_engine < 0) {
+                                usage();
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'C':
+                        if (set_chunk_size(parse_size(optarg)) != 0) {
+                                fprintf(stderr, "Invalid chunk size %s.\n",
+                                        optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'S':
+                        small_size = parse_size(optarg);
+                        if (small_size < 0 || small_size > MAX_SMALL_SIZE) {
+                                fprintf(stderr, "Invalid small file size %s.\n",
+                                        optarg);
+                                exit(EXIT_FAILURE);
+                        }
+                        break;
+                case 'j':
+                        nthreads = atoi(optarg);
+                        if (nthreads < 1) {
+                                usage();
+                                exit(EXIT_FAILURE);
+                        }
                         break;
                 default:
                         usage();
-                        break;
+                        exit(EXIT_FAILURE);
+                }
+        }
+        
+        if (nthreads == 0) {
+                nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+                if (nthreads < 1)
+                        nthreads = 1;
+        }
+        
+        /* Server of remote copies, the client sets all parameters. */
+        if (serve) {
+                remote_serve(listen_addr);
+                exit(EXIT_SUCCESS);
+        }
+        
+        /* Patches are of fixed size chunks of one file. */
+        if ((make_patch_path != NULL || apply_patch_path != NULL) && cdc) {
+                fprintf(stderr, "--cdc is not supported by patches.\n");
+                exit(EXIT_FAILURE);
+        }
+        if (apply_patch_path != NULL) {
+                if (argc - optind != 1) {
+                        usage();
+                        exit(EXIT_FAILURE);
                 }
+                changed = apply_patch(apply_patch_path, argv[optind]);
+                if (changed >= 0)
+                        printf("Patched %s: %ld chunks.\n", argv[optind], 
+                                changed);
+                store_finish();
+                exit(changed < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
         }
+        if (make_patch_path != NULL) {
+                if (argc - optind != 2) {
+                        usage();
+                        exit(EXIT_FAILURE);
+                }
+                changed = make_patch(make_patch_path, argv[optind], 
+                        argv[optind + 1]);
+                printf("Patch %s from %s to %s: %ld chunks.\n", 
+                        make_patch_path, argv[optind + 1], argv[optind], 
+                        changed);
+                store_finish();
+                exit(EXIT_SUCCESS);
+        }
+        
+        /* 
+         * One source file to many destinations, a directory 
+         * destination gets a file of the source name.
+         */
+        if (fanout) {
+                char **dests;
+                char *base;
+                
+                if (argc - optind < 2 || cdc || rflag) {
+                        fprintf(stderr, "--fanout takes one source file and"
+                                " destinations, without --cdc or -r.\n");
+                        exit(EXIT_FAILURE);
+                }
+                if (!strcmp(get_extension(argv[optind]), "digs")) {
+                        printf("%s: %s.\n", exception_str[OMITDIGS], 
+                                argv[optind]);
+                        exit(EXIT_FAILURE);
+                }
+                dests = malloc(sizeof(char*) * (argc - optind - 1));
+                if (dests == NULL)
+                        handle_error("malloc");
+                base = get_basename(argv[optind]);
+                for (j = 0, i = optind + 1; i < argc; i++) {
+                        if (is_directory(argv[i])) {
+                                dests[j] = malloc(strlen(argv[i]) + 
+                                        strlen(base) + 2);
+                                if (dests[j] == NULL)
+                                        handle_error("malloc");
+                                sprintf(dests[j], "%s/%s", argv[i], base);
+                        } else {
+                                dests[j] = strdup(argv[i]);
+                        }
+                        j++;
+                }
+                fanout_copy(argv[optind], dests, j);
+                for (i = 0; i < j; i++) {
+                        printf("Copied from %s to %s.\n", argv[optind], 
+                                dests[i]);
+                        free(dests[i]);
+                }
+                free(dests);
+                store_finish();
+                exit(EXIT_SUCCESS);
+        }
+        
+        /* Remaining arguments are sources followed by the destination. */
+        number_of_sources = argc - optind - 1;
         
         /* Missing arguments. */
-        if (number_of_sources == 0) {
+        if (number_of_sources <= 0) {
                 usage();
                 exit(EXIT_SUCCESS);
         }
         
         sources = malloc(sizeof(char*) * number_of_sources);   
         
-        for (j = 0, i = argc-1; i > 0; i--) {
-                /* Means that it is an option. */
-                if (argv[i][0] == '-') {
-                   continue;     
-                }
-                
-                if (dest == NULL) {
-                        dest = argv[i];
-                } else {
-                        sources[j++] = argv[i];
-                }
-        }  
+        for (j = 0, i = optind; i < argc - 1; i++)
+                sources[j++] = argv[i];
+        dest = argv[argc - 1];
         
 #ifdef DEBUG
         printf("Destination : %s.\n", dest);
         printf("Recursive copy: %s.\n", rflag ? "On" : "Off");
+        printf("Threads: %d.\n", nthreads);
+        printf("I/O engine: %s.\n", io_engine_str[io_engine]);
+        printf("Hash: %s, %d bytes.\n", hash_str[hash_algo], digest_size);
+        printf("Chunk size: %ld.\n", chunk_size);
+        printf("Small files: below %ld bytes.\n", small_size);
+        printf("Append: %s.\n", append_mode ? "On" : "Off");
+        printf("Direct I/O: %s.\n", direct_io ? "On" : "Off");
+        printf("Drop cache: %s.\n", drop_cache ? "On" : "Off");
         printf("Size of sources: %d.\n", number_of_sources);
         for (i = 0; i < number_of_sources; i++) {
                 printf("Source(%d): %s.\n", i, sources[i]);
@@ -734,6 +3066,19 @@ int main (int argc, char *argv[]) {
         fflush(stdout);
 #endif /* DEBUG */
         
+        /* Destination is on a server. */
+        if (rsh != NULL || connect_addr != NULL) {
+                if (cdc) {
+                        fprintf(stderr, "--cdc is not supported remotely.\n");
+                        exit(EXIT_FAILURE);
+                }
+                rc = remote_copy(sources, number_of_sources, dest, rflag, 
+                        rsh, connect_addr, zflag);
+                store_finish();
+                free(sources);
+                exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+        
         /* 
          * If multiple sources selected, 
          * then destination target has to be a directory.
@@ -744,6 +3089,35 @@ int main (int argc, char *argv[]) {
                 exit(EXIT_FAILURE);
         }
         
+        /* Index trees of sources and of the directories they go to. */
+        if (rflag && use_index) {
+                char *target;
+
+                for (i = 0; i < number_of_sources; i++) {
+                        if (!is_directory(sources[i]))
+                                continue;
+                        target = is_directory(dest) ? 
+                                dest_dir_path(sources[i], dest) : 
+                                strdup(dest);
+                        store_add_tree(sources[i]);
+                        store_add_tree(target);
+                        free(target);
+                }
+        }
+
+        /* 
+         * Recursive copies with several threads walk the trees in
+         * parallel, each entry is a task of the walk.
+         */
+        if (rflag && nthreads > 1) {
+                walk_run(nthreads, ordered, visit_entry, 
+                        sources, number_of_sources, dest);
+                dir_roots(sources, number_of_sources, dest);
+                store_finish();
+                free(sources);
+                exit(EXIT_SUCCESS);
+        }
+        
         /* Do lazy copy for each sources. */
         for (i = 0; i < number_of_sources; i++) {
                 rc = lcopy(sources[i], dest, rflag);
@@ -753,7 +3127,11 @@ int main (int argc, char *argv[]) {
                         printf("%s: src:%s dest:%s.\n", 
                                 exception_str[exception], sources[i], dest);
         }
+        if (rflag)
+                dir_roots(sources, number_of_sources, dest);
         
+        store_finish();
         free(sources);
         exit(EXIT_SUCCESS);
 }
+#endif /* LCOPY_BENCH */
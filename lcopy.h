@@ -0,0 +1,414 @@
+#ifndef LCOPY_H
+#define LCOPY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+
+/* Default chunk size, each chunk is chunk_size bytes. */
+#define SIZE_OF_CHUNK 131072 /* 128*1024 */
+
+/* Bounds of --chunk-size, which must be a power of two. */
+#define MIN_CHUNK_SIZE 4096
+#define MAX_CHUNK_SIZE (64*1024*1024)
+
+/* Largest digest of a chunk, in bytes. */
+#define MAX_DIGEST_SIZE 32   /* 256bit */
+
+/* Buffer size of the read/write fallback of copy_file_raw. */
+#define COPY_BUFFER_SIZE (8*1024*1024)
+
+/* Chunks of default size handed out to a pool worker at once. */
+#define CHUNKS_PER_RANGE 16
+
+/*
+ * Bytes of chunks handed out to a pool worker at once, read as one I/O
+ * batch. A range holds at least one chunk.
+ */
+#define RANGE_SIZE (CHUNKS_PER_RANGE * SIZE_OF_CHUNK)
+
+/* Chunks of a range at the smallest chunk size. */
+#define MAX_CHUNKS_PER_RANGE (RANGE_SIZE / MIN_CHUNK_SIZE)
+
+/* Requests kept in flight by the io_uring engine. */
+#define IO_QUEUE_DEPTH 32
+
+/* Tasks a tree walk worker queues before running new ones inline. */
+#define WALK_QUEUE_DEPTH 1024
+
+/* Small files of a directory copied as one I/O batch. */
+#define SMALL_BATCH 64
+
+/* Reads of a small file that changed since its stat before giving up. */
+#define SMALL_TRIES 3
+
+/* Bound of --small-files, a batch is read into memory whole. */
+#define MAX_SMALL_SIZE (1024*1024)
+
+/* Files a remote client requests ahead of the one it sends chunks of. */
+#define REMOTE_WINDOW 16
+
+/* Bitmap of n chunks, one bit per chunk. */
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+#define BITMAP_SET(map, i) ((map)[(i) / 64] |= (uint64_t)1 << ((i) % 64))
+#define BITMAP_TEST(map, i) (((map)[(i) / 64] >> ((i) % 64)) & 1)
+
+#define handle_error_en(en, msg) \
+        do { errno = en; perror(msg); exit(EXIT_FAILURE); } while (0);
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0);
+
+/* 
+ * Chunk size, set by --chunk-size, its log2 and chunks per pool range.
+ * Chunk offsets and counts are shifts since the size is a power of two.
+ */
+extern long chunk_size;
+extern int chunk_shift;
+extern long range_chunks;
+
+#define CHUNK_OFF(i) ((off_t)(i) << chunk_shift)
+#define CHUNK_COUNT(size) (((size) + chunk_size - 1) >> chunk_shift)
+
+/* Number of worker threads, set by -j/--threads. */
+extern int nthreads;
+
+/* Deterministic output order, set by --ordered. */
+extern int ordered;
+
+/* Content defined chunking, set by --cdc. */
+extern int cdc;
+
+/* Hash algorithm, set by --hash, and its digest size in bytes. */
+extern int hash_algo;
+extern int digest_size;
+
+/* I/O engine for chunk and digest I/O, set by --io-engine. */
+extern int io_engine;
+
+/* Digests of trees are kept in an index, set by --index. */
+extern int use_index;
+
+/* Files below this size are copied whole, set by --small-files. */
+extern long small_size;
+
+/* Chunk I/O bypasses the page cache, set by --direct. */
+extern int direct_io;
+
+/* Cached pages of destinations are dropped, set by --drop-cache. */
+extern int drop_cache;
+
+/* lcopy.c */
+
+struct stat;
+struct worker;
+
+int lcopy(char *src, char *dest, int rflag);
+void dir_root(const char *path, unsigned char *root);
+void dir_roots(char **sources, int nsources, const char *dest);
+char *get_digs_filepath(const char *path);
+char *get_basename(const char *path);
+const char *get_extension(const char *path);
+char *dest_dir_path(const char *src, const char *dest);
+int is_directory(const char *path);
+int stat_entry(int dirfd, const char *path, struct stat *st);
+long parse_size(const char *s);
+int set_chunk_size(long size);
+void set_chunk_threads(int threads);
+int write_digest_file(FILE *src, FILE *digsfile);
+FILE *open_digest_file(const char *path, FILE *f);
+void read_chunks(struct worker *w, int fd, off_t size, long start, 
+                long end, ssize_t *lens, char *holes);
+int digest_chunk(struct worker *w, long start, long i, 
+                ssize_t *lens, char *holes, unsigned char *digest);
+void digest_chunks(struct worker *w, long start, long end, 
+                ssize_t *lens, char *holes, unsigned char *digests);
+void zero_range(int fd, off_t off, off_t len);
+void resize_to(int fd, off_t size);
+void copy_extent(struct worker *w, int in, off_t in_off, int out, 
+                off_t out_off, off_t len);
+
+/* digmd5.c */
+
+typedef enum {
+        HASH_MD5,
+        HASH_SHA256,
+        HASH_BLAKE2S,
+        HASH_XXH128, /* Needs libxxhash. */
+        HASH_BLAKE3, /* Needs libblake3. */
+        HASH_COUNT
+} HashAlgo;
+
+extern const char* hash_str[];
+
+struct hash_ctx;
+
+int hash_available(int algo);
+int hash_size(int algo);
+struct hash_ctx *hash_ctx_new(int algo);
+void hash_ctx_free(struct hash_ctx *ctx);
+int hash_digest(struct hash_ctx *ctx, const void *buffer, size_t n,
+                unsigned char *dgst);
+int hash_digest_many(struct hash_ctx *ctx, const void **bufs,
+                const size_t *lens, int n, unsigned char **dgsts);
+int digmd5(const char *buffer, char *dgst, int n);
+
+/* md5mb.c */
+
+void md5_many(const unsigned char **msgs, const size_t *lens, int n,
+                unsigned char **digests);
+const char *md5_kernel_name(void);
+
+/* ioeng.c */
+
+typedef enum {
+        IO_PSYNC, /* pread/pwrite, one request at a time. */
+        IO_URING, /* io_uring, many requests in flight. */
+} IoEngine;
+
+extern const char* io_engine_str[];
+
+/* One read or write of an I/O batch. */
+struct io_req {
+        int fd;
+        int write;
+        void *buf;
+        size_t len;
+        off_t off;
+        ssize_t res;    /* Bytes transferred, set by io_batch. */
+};
+
+struct ioeng;
+
+struct ioeng *io_open(int kind, unsigned depth);
+void io_close(struct ioeng *e);
+int io_kind(struct ioeng *e);
+int io_batch(struct ioeng *e, struct io_req *reqs, int n);
+
+/* Alignment of offsets, lengths and buffers of O_DIRECT requests. */
+#define DIRECT_ALIGN 4096
+
+/* Length of a request ending at end of file, padded if direct is set. */
+#define DIRECT_LEN(direct, len) ((direct) ? ((len) + DIRECT_ALIGN - 1) & \
+                ~(off_t)(DIRECT_ALIGN - 1) : (len))
+
+int io_direct_open(int fd);
+void io_direct_close(int dfd, int fd);
+void io_sequential(int fd);
+void io_drop_cache(int fd);
+
+/* pool.c */
+
+/* Per worker state, owned by exactly one thread during pool_run(). */
+struct worker {
+        int id;
+        struct hash_ctx *hash;  /* Reusable hash context. */
+        unsigned char *buf;     /* range_chunks chunks of scratch. */
+        struct ioeng *io;       /* Engine of this worker. */
+};
+
+/* Job callback, called for each chunk range [start, end). */
+typedef void (*range_job)(void *arg, struct worker *w, long start, long end);
+
+int pool_run(long nchunks, int threads, range_job job, void *arg);
+struct worker *pool_local_worker(void);
+
+/* digs.c */
+
+/* Digest file header, digests follow at DIGS_HEADER_SIZE. */
+#define DIGS_MAGIC "LCDIGS\0\0"
+#define DIGS_VERSION 2
+#define DIGS_HEADER_SIZE 128
+
+/* 
+ * The zero digest marks a chunk of zeros, it is given to holes and zero
+ * chunks without hashing them.
+ */
+
+/* Header flags. */
+#define DIGS_CDC 1      /* Content defined chunks, lengths follow digests. */
+#define DIGS_DIR 2      /* Directory, entry records follow the header. */
+
+/*
+ * Digests of a file are the leaves of a Merkle tree, each node is the
+ * digest of up to DIGS_FANOUT nodes below it. Tree levels follow the
+ * digests (and lengths) bottom up, the root is also in the header.
+ * DIGS_FANOUT is a multiple of 64, a node covers whole bitmap words.
+ */
+#define DIGS_FANOUT 64
+#define DIGS_MAX_LEVELS 16
+
+/*
+ * On disk header of a digest file, in host byte order. It describes
+ * the digested file as of the digest run, so that freshness is decided
+ * with one fstat of the file.
+ */
+struct digs_header {
+        char magic[8];          /* DIGS_MAGIC */
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t algo;          /* HashAlgo of the digests. */
+        uint32_t digest_size;
+        uint64_t chunk_size;
+        uint64_t count;         /* Number of digests. */
+        uint64_t size;          /* Size of the digested file. */
+        int64_t mtime_ns;
+        int64_t ctime_ns;
+        uint64_t ino;
+        uint64_t dev;
+        uint32_t flags;         /* DIGS_CDC, DIGS_DIR */
+        unsigned char root[MAX_DIGEST_SIZE]; /* Merkle root. */
+        uint8_t reserved[12];
+};
+
+/* Entry record of a directory digest file, entries are in name order. */
+struct digs_dirent {
+        char name[256];
+        uint64_t size;
+        int64_t mtime_ns;
+        int64_t ctime_ns;
+        uint64_t ino;
+        uint32_t mode;
+        uint32_t reserved;
+        unsigned char root[MAX_DIGEST_SIZE]; /* Root of file or directory. */
+};
+
+/* Digests of a digest file, mapped read only. */
+struct digs {
+        unsigned char *digests; /* Digest of chunk i at i*size. */
+        uint32_t *lens;         /* Chunk lengths, NULL unless DIGS_CDC. */
+        long count;
+        int size;               /* Digest size in bytes. */
+        size_t map_size;
+        uint64_t file_size;     /* Size of the digested file. */
+        unsigned char root[MAX_DIGEST_SIZE];
+        int levels;             /* Tree levels above the digests, 0 if none. */
+        unsigned char *level[DIGS_MAX_LEVELS]; /* level[0] is digests. */
+        long nodes[DIGS_MAX_LEVELS];
+};
+
+/* Index of the chunks of a digest file by digest. */
+struct digs_index {
+        const struct digs *digs;
+        off_t *offs;            /* Offset of chunk i, offs[count] is size. */
+        long *slots;            /* Chunk index + 1, 0 if empty. */
+        size_t mask;
+};
+
+int digs_header_match(const struct digs_header *h, const struct stat *st);
+int digs_fresh(int digs_fd, int fd);
+int digs_root(int digs_fd, int fd, unsigned char *root);
+void digs_write(int digs_fd, int fd, const unsigned char *digests,
+                const uint32_t *lens, long count);
+int digs_map(int fd, struct digs *d);
+void digs_unmap(struct digs *d);
+long digs_diff(const struct digs *src, const struct digs *dest,
+                uint64_t *bitmap);
+int digs_is_zero(const unsigned char *digest);
+int digs_same(const struct digs *a, const struct digs *b);
+int digs_read_dir(int fd, struct digs_dirent **ents, long *count,
+                unsigned char *root);
+void digs_write_dir(int fd, const struct digs_dirent *ents, long count,
+                unsigned char *root);
+void digs_index_build(struct digs_index *x, const struct digs *d,
+                const uint64_t *skip);
+long digs_index_find(const struct digs_index *x, const unsigned char *digest,
+                uint32_t len);
+void digs_index_free(struct digs_index *x);
+
+/* cdc.c */
+
+long cdc_digest(int fd, struct hash_ctx *ctx, unsigned char **digests,
+                uint32_t **lens);
+
+/* store.c */
+
+/* Index file in the root of a tree, with --index. */
+#define INDEX_NAME ".lcindex"
+
+void store_add_tree(const char *root);
+FILE *store_open(const char *path, const char *mode);
+void store_close(FILE *f, const char *path);
+void store_finish(void);
+
+/* fanout.c */
+
+int fanout_copy(const char *src, char **dests, int ndests);
+
+/* patch.c */
+
+long make_patch(const char *patch, const char *src, const char *base);
+long apply_patch(const char *patch, const char *dest);
+
+/* stats.c */
+
+/* Counters of --stats, times are in nanoseconds. */
+typedef enum {
+        STAT_STAT,      /* stat of files and digest freshness checks. */
+        STAT_READ,      /* Chunk reads. */
+        STAT_DIGEST,    /* Hashing of chunks. */
+        STAT_COMPARE,   /* Comparison of digest files. */
+        STAT_COPY,      /* Writes, copies and holes punched in dest. */
+        STAT_BYTES,     /* Bytes of source files. */
+        STAT_HASHED,    /* Bytes hashed. */
+        STAT_WRITTEN,   /* Bytes written or copied to dest. */
+        STAT_CHUNKS,    /* Chunks of source files. */
+        STAT_CHANGED,   /* Chunks that differed in dest. */
+        STAT_DIGS_HITS, /* Digest files found fresh. */
+        STAT_DIGS_MISSES, /* Digest files missing or stale. */
+        STAT_COUNT
+} StatCounter;
+
+/* Counters of a file or of the run. */
+struct stats {
+        uint64_t v[STAT_COUNT];
+        uint64_t start;         /* stats_clock() at the start. */
+};
+
+/* Statistics are kept, set by --stats. */
+extern int stats_on;
+
+uint64_t stats_clock(void);
+void stats_add(int c, uint64_t n);
+void stats_since(int c, uint64_t start);
+struct stats *stats_current(void);
+void stats_attach(struct stats *s);
+void stats_file_begin(struct stats *s);
+void stats_file_end(struct stats *s, const char *src, const char *dest,
+                const char *method, int files);
+void stats_open(const char *path);
+
+/* remote.c */
+
+int remote_can_deflate(void);
+void remote_serve(const char *addr);
+int remote_copy(char **sources, int nsources, const char *dest, int rflag,
+                const char *rsh, const char *addr, int zflag);
+
+/* walk.c */
+
+/* Copy of one directory entry, run by a tree walk worker. */
+struct walk_task {
+        char *src;
+        char *dest;
+        int *key;       /* Entry indexes from the root, orders output. */
+        int keylen;
+        unsigned type;  /* File type bits of src from readdir, 0 if unknown. */
+        void (*fn)(void *arg);  /* Runs instead of visit if set. */
+        void *arg;
+};
+
+typedef void (*walk_visit)(struct walk_task *t);
+
+int walk_run(int threads, int ordered, walk_visit visit,
+                char **roots, int nroots, const char *dest);
+void walk_spawn(char *src, char *dest, int index, unsigned type);
+void walk_spawn_fn(void (*fn)(void *arg), void *arg);
+void walk_printf(const char *fmt, ...);
+void walk_printf_entry(int index, const char *fmt, ...);
+int walk_active(void);
+
+#endif /* LCOPY_H */
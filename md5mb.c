@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lcopy.h"
+
+/*
+ * Multi-buffer MD5. MD5 is serial within one message, but the chunks of
+ * a range are independent: a kernel runs the MD5 compression of several
+ * messages at once, one message per 32-bit lane of a vector, 4 lanes
+ * with SSE2, 8 with AVX2 and 16 with AVX-512. The kernel is picked at
+ * run time by the cpu, with a scalar one as fallback. Digests are plain
+ * MD5, byte-identical to OpenSSL's.
+ *
+ * Lanes run in lockstep over the full blocks all messages of a group
+ * have, the rest of each message and its padding are done one lane at
+ * a time. Messages are grouped by length, so chunks of equal size,
+ * nearly all of them, run in lockstep to their end.
+ */
+
+#define MD5_BLOCK 64
+
+/* Most lanes of a kernel. */
+#define MD5_MAX_LANES 16
+
+/* Round functions, for scalars and vectors alike. */
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define MD5_STEP(f, a, b, c, d, x, t, s) \
+        (a) += f((b), (c), (d)) + (x) + (t); \
+        (a) = ((a) << (s)) | ((a) >> (32 - (s))); \
+        (a) += (b);
+
+/* The 64 steps of one block of message words x[0..15]. */
+#define MD5_ROUNDS(a, b, c, d, x) \
+        MD5_STEP(MD5_F, a, b, c, d, x[0], 0xd76aa478, 7) \
+        MD5_STEP(MD5_F, d, a, b, c, x[1], 0xe8c7b756, 12) \
+        MD5_STEP(MD5_F, c, d, a, b, x[2], 0x242070db, 17) \
+        MD5_STEP(MD5_F, b, c, d, a, x[3], 0xc1bdceee, 22) \
+        MD5_STEP(MD5_F, a, b, c, d, x[4], 0xf57c0faf, 7) \
+        MD5_STEP(MD5_F, d, a, b, c, x[5], 0x4787c62a, 12) \
+        MD5_STEP(MD5_F, c, d, a, b, x[6], 0xa8304613, 17) \
+        MD5_STEP(MD5_F, b, c, d, a, x[7], 0xfd469501, 22) \
+        MD5_STEP(MD5_F, a, b, c, d, x[8], 0x698098d8, 7) \
+        MD5_STEP(MD5_F, d, a, b, c, x[9], 0x8b44f7af, 12) \
+        MD5_STEP(MD5_F, c, d, a, b, x[10], 0xffff5bb1, 17) \
+        MD5_STEP(MD5_F, b, c, d, a, x[11], 0x895cd7be, 22) \
+        MD5_STEP(MD5_F, a, b, c, d, x[12], 0x6b901122, 7) \
+        MD5_STEP(MD5_F, d, a, b, c, x[13], 0xfd987193, 12) \
+        MD5_STEP(MD5_F, c, d, a, b, x[14], 0xa679438e, 17) \
+        MD5_STEP(MD5_F, b, c, d, a, x[15], 0x49b40821, 22) \
+        MD5_STEP(MD5_G, a, b, c, d, x[1], 0xf61e2562, 5) \
+        MD5_STEP(MD5_G, d, a, b, c, x[6], 0xc040b340, 9) \
+        MD5_STEP(MD5_G, c, d, a, b, x[11], 0x265e5a51, 14) \
+        MD5_STEP(MD5_G, b, c, d, a, x[0], 0xe9b6c7aa, 20) \
+        MD5_STEP(MD5_G, a, b, c, d, x[5], 0xd62f105d, 5) \
+        MD5_STEP(MD5_G, d, a, b, c, x[10], 0x02441453, 9) \
+        MD5_STEP(MD5_G, c, d, a, b, x[15], 0xd8a1e681, 14) \
+        MD5_STEP(MD5_G, b, c, d, a, x[4], 0xe7d3fbc8, 20) \
+        MD5_STEP(MD5_G, a, b, c, d, x[9], 0x21e1cde6, 5) \
+        MD5_STEP(MD5_G, d, a, b, c, x[14], 0xc33707d6, 9) \
+        MD5_STEP(MD5_G, c, d, a, b, x[3], 0xf4d50d87, 14) \
+        MD5_STEP(MD5_G, b, c, d, a, x[8], 0x455a14ed, 20) \
+        MD5_STEP(MD5_G, a, b, c, d, x[13], 0xa9e3e905, 5) \
+        MD5_STEP(MD5_G, d, a, b, c, x[2], 0xfcefa3f8, 9) \
+        MD5_STEP(MD5_G, c, d, a, b, x[7], 0x676f02d9, 14) \
+        MD5_STEP(MD5_G, b, c, d, a, x[12], 0x8d2a4c8a, 20) \
+        MD5_STEP(MD5_H, a, b, c, d, x[5], 0xfffa3942, 4) \
+        MD5_STEP(MD5_H, d, a, b, c, x[8], 0x8771f681, 11) \
+        MD5_STEP(MD5_H, c, d, a, b, x[11], 0x6d9d6122, 16) \
+        MD5_STEP(MD5_H, b, c, d, a, x[14], 0xfde5380c, 23) \
+        MD5_STEP(MD5_H, a, b, c, d, x[1], 0xa4beea44, 4) \
+        MD5_STEP(MD5_H, d, a, b, c, x[4], 0x4bdecfa9, 11) \
+        MD5_STEP(MD5_H, c, d, a, b, x[7], 0xf6bb4b60, 16) \
+        MD5_STEP(MD5_H, b, c, d, a, x[10], 0xbebfbc70, 23) \
+        MD5_STEP(MD5_H, a, b, c, d, x[13], 0x289b7ec6, 4) \
+        MD5_STEP(MD5_H, d, a, b, c, x[0], 0xeaa127fa, 11) \
+        MD5_STEP(MD5_H, c, d, a, b, x[3], 0xd4ef3085, 16) \
+        MD5_STEP(MD5_H, b, c, d, a, x[6], 0x04881d05, 23) \
+        MD5_STEP(MD5_H, a, b, c, d, x[9], 0xd9d4d039, 4) \
+        MD5_STEP(MD5_H, d, a, b, c, x[12], 0xe6db99e5, 11) \
+        MD5_STEP(MD5_H, c, d, a, b, x[15], 0x1fa27cf8, 16) \
+        MD5_STEP(MD5_H, b, c, d, a, x[2], 0xc4ac5665, 23) \
+        MD5_STEP(MD5_I, a, b, c, d, x[0], 0xf4292244, 6) \
+        MD5_STEP(MD5_I, d, a, b, c, x[7], 0x432aff97, 10) \
+        MD5_STEP(MD5_I, c, d, a, b, x[14], 0xab9423a7, 15) \
+        MD5_STEP(MD5_I, b, c, d, a, x[5], 0xfc93a039, 21) \
+        MD5_STEP(MD5_I, a, b, c, d, x[12], 0x655b59c3, 6) \
+        MD5_STEP(MD5_I, d, a, b, c, x[3], 0x8f0ccc92, 10) \
+        MD5_STEP(MD5_I, c, d, a, b, x[10], 0xffeff47d, 15) \
+        MD5_STEP(MD5_I, b, c, d, a, x[1], 0x85845dd1, 21) \
+        MD5_STEP(MD5_I, a, b, c, d, x[8], 0x6fa87e4f, 6) \
+        MD5_STEP(MD5_I, d, a, b, c, x[15], 0xfe2ce6e0, 10) \
+        MD5_STEP(MD5_I, c, d, a, b, x[6], 0xa3014314, 15) \
+        MD5_STEP(MD5_I, b, c, d, a, x[13], 0x4e0811a1, 21) \
+        MD5_STEP(MD5_I, a, b, c, d, x[4], 0xf7537e82, 6) \
+        MD5_STEP(MD5_I, d, a, b, c, x[11], 0xbd3af235, 10) \
+        MD5_STEP(MD5_I, c, d, a, b, x[2], 0x2ad7d2bb, 15) \
+        MD5_STEP(MD5_I, b, c, d, a, x[9], 0xeb86d391, 21)
+
+/* Little endian 32-bit word at p. */
+static inline uint32_t md5_le32(const unsigned char *p) {
+        uint32_t v;
+
+        memcpy(&v, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap32(v);
+#endif
+
+        return v;
+}
+
+/*
+ * Compresses nblocks blocks of each lane into its state. Block k of
+ * lane l is at p[l] + k * step[l], a step of 0 repeats one block for
+ * unused lanes.
+ */
+typedef void (*md5_blocks)(uint32_t (*state)[4], const unsigned char **p,
+                const size_t *step, size_t nblocks);
+
+/*
+ * Defines kernel name of lanes lanes, as vectors of GCC's vector
+ * extension compiled for the instruction set of attr.
+ */
+#define MD5_KERNEL(name, lanes, attr) \
+typedef uint32_t name##_vec __attribute__((vector_size(4 * (lanes)))); \
+attr static void name(uint32_t (*state)[4], const unsigned char **p, \
+                const size_t *step, size_t nblocks) { \
+        name##_vec a, b, c, d, a0, b0, c0, d0, x[16]; \
+        size_t k; \
+        int j, l; \
+ \
+        for (l = 0; l < (lanes); l++) { \
+                a[l] = state[l][0]; \
+                b[l] = state[l][1]; \
+                c[l] = state[l][2]; \
+                d[l] = state[l][3]; \
+        } \
+        for (k = 0; k < nblocks; k++) { \
+                for (j = 0; j < 16; j++) \
+                        for (l = 0; l < (lanes); l++) \
+                                x[j][l] = md5_le32(p[l] + k * step[l] + \
+                                        4 * j); \
+                a0 = a; \
+                b0 = b; \
+                c0 = c; \
+                d0 = d; \
+                MD5_ROUNDS(a, b, c, d, x) \
+                a += a0; \
+                b += b0; \
+                c += c0; \
+                d += d0; \
+        } \
+        for (l = 0; l < (lanes); l++) { \
+                state[l][0] = a[l]; \
+                state[l][1] = b[l]; \
+                state[l][2] = c[l]; \
+                state[l][3] = d[l]; \
+        } \
+}
+
+MD5_KERNEL(md5_x1, 1, )
+#if defined(__x86_64__) || defined(__i386__)
+MD5_KERNEL(md5_x4, 4, __attribute__((target("sse2"))))
+MD5_KERNEL(md5_x8, 8, __attribute__((target("avx2"))))
+MD5_KERNEL(md5_x16, 16, __attribute__((target("avx512f"))))
+#else
+MD5_KERNEL(md5_x4, 4, )
+#endif
+
+struct md5_kernel {
+        const char *name;
+        int lanes;
+        md5_blocks blocks;
+};
+
+/* Kernels, widest first, the first the cpu supports is used. */
+static const struct md5_kernel md5_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+        {"avx512", 16, md5_x16},
+        {"avx2", 8, md5_x8},
+        {"sse2", 4, md5_x4},
+#else
+        {"vector", 4, md5_x4},
+#endif
+        {"scalar", 1, md5_x1},
+        {NULL, 0, NULL}
+};
+
+/* Kernel in use, picked on first use. */
+static const struct md5_kernel *md5_kernel;
+
+/* Returns non-zero if the cpu runs kernel k. */
+static int md5_supported(const struct md5_kernel *k) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (k->blocks == md5_x16)
+                return __builtin_cpu_supports("avx512f");
+        if (k->blocks == md5_x8)
+                return __builtin_cpu_supports("avx2");
+        if (k->blocks == md5_x4)
+                return __builtin_cpu_supports("sse2");
+#endif
+
+        return 1;
+}
+
+static const struct md5_kernel *md5_pick(void) {
+        const struct md5_kernel *k;
+
+        k = __atomic_load_n(&md5_kernel, __ATOMIC_ACQUIRE);
+        if (k != NULL)
+                return k;
+        for (k = md5_kernels; !md5_supported(k); k++)
+                ;
+        __atomic_store_n(&md5_kernel, k, __ATOMIC_RELEASE);
+
+        return k;
+}
+
+/* Compresses the rest of msg of len bytes and its padding into state. */
+static void md5_tail(uint32_t *state, const unsigned char *msg, size_t len,
+                size_t total, unsigned char *digest) {
+        unsigned char last[2 * MD5_BLOCK];
+        const unsigned char *p = msg;
+        size_t step = MD5_BLOCK;
+        uint64_t bits = (uint64_t)total * 8;
+        size_t n;
+        int i;
+
+        md5_x1((uint32_t (*)[4])state, &p, &step, len / MD5_BLOCK);
+
+        /* Last bytes, 0x80, zeros and the bit length in one or two blocks. */
+        n = len % MD5_BLOCK;
+        memset(last, 0, sizeof(last));
+        memcpy(last, msg + len - n, n);
+        last[n] = 0x80;
+        n = n < MD5_BLOCK - 8 ? MD5_BLOCK : 2 * MD5_BLOCK;
+        for (i = 0; i < 8; i++)
+                last[n - 8 + i] = bits >> (8 * i);
+        p = last;
+        md5_x1((uint32_t (*)[4])state, &p, &step, n / MD5_BLOCK);
+
+        for (i = 0; i < 16; i++)
+                digest[i] = state[i / 4] >> (8 * (i % 4));
+}
+
+/* Sorts message indexes by length, longest first. */
+static void md5_order(const size_t *lens, int n, int *order) {
+        int i, j, t;
+
+        for (i = 0; i < n; i++) {
+                for (j = i, t = i; j > 0 && lens[order[j - 1]] < lens[t]; j--)
+                        order[j] = order[j - 1];
+                order[j] = t;
+        }
+}
+
+/*
+ * Digests n messages, msgs[i] of lens[i] bytes, into digests[i], 16
+ * bytes each, as many at once as the kernel has lanes.
+ */
+void md5_many(const unsigned char **msgs, const size_t *lens, int n,
+                unsigned char **digests) {
+        static const unsigned char zero_block[MD5_BLOCK];
+        const struct md5_kernel *k = md5_pick();
+        uint32_t state[MD5_MAX_LANES][4];
+        const unsigned char *p[MD5_MAX_LANES];
+        size_t step[MD5_MAX_LANES];
+        size_t nblocks;
+        int order[n + 1];
+        int first;
+        int m;
+        int l;
+
+        md5_order(lens, n, order);
+
+        for (first = 0; first < n; first += k->lanes) {
+                m = n - first < k->lanes ? n - first : k->lanes;
+                nblocks = lens[order[first + m - 1]] / MD5_BLOCK;
+                for (l = 0; l < k->lanes; l++) {
+                        state[l][0] = 0x67452301;
+                        state[l][1] = 0xefcdab89;
+                        state[l][2] = 0x98badcfe;
+                        state[l][3] = 0x10325476;
+                        p[l] = l < m ? msgs[order[first + l]] : zero_block;
+                        step[l] = l < m ? MD5_BLOCK : 0;
+                }
+
+                k->blocks(state, p, step, nblocks);
+
+                for (l = 0; l < m; l++)
+                        md5_tail(state[l], p[l] + nblocks * MD5_BLOCK,
+                                lens[order[first + l]] - nblocks * MD5_BLOCK,
+                                lens[order[first + l]],
+                                digests[order[first + l]]);
+        }
+}
+
+/* Returns the name of the kernel md5_many uses. */
+const char *md5_kernel_name(void) {
+        return md5_pick()->name;
+}
+
+#ifdef MD5MB_TEST
+#include <openssl/evp.h>
+#include <time.h>
+
+/*
+ * Checks every kernel the cpu supports against OpenSSL on messages of
+ * lengths around block boundaries, then times 128K chunks.
+ */
+int main(int argc, char *argv[]) {
+        static unsigned char buf[64 * 131072];
+        const unsigned char *msgs[64];
+        unsigned char out[64][16];
+        unsigned char *digests[64];
+        unsigned char want[16];
+        size_t lens[64];
+        const struct md5_kernel *k;
+        struct timespec t0, t1;
+        unsigned int ds;
+        int fails = 0;
+        int i, r;
+
+        srand(1);
+        for (i = 0; i < (int)sizeof(buf); i++)
+                buf[i] = rand();
+
+        for (k = md5_kernels; k->name != NULL; k++) {
+                if (!md5_supported(k))
+                        continue;
+                md5_kernel = k;
+                for (r = 0; r < 200; r++) {
+                        for (i = 0; i < 64; i++) {
+                                lens[i] = r < 100 ? (size_t)(r + i) % 200 :
+                                        (size_t)rand() % 131072;
+                                msgs[i] = buf + (size_t)i * 131072;
+                                digests[i] = out[i];
+                        }
+                        md5_many(msgs, lens, 1 + r % 64, digests);
+                        for (i = 0; i < 1 + r % 64; i++) {
+                                EVP_Digest(msgs[i], lens[i], want, &ds,
+                                        EVP_md5(), NULL);
+                                if (memcmp(want, out[i], 16)) {
+                                        printf("%s: len %zu differs\n",
+                                                k->name, lens[i]);
+                                        fails++;
+                                }
+                        }
+                }
+
+                for (i = 0; i < 64; i++)
+                        lens[i] = 131072;
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                for (r = 0; r < 20; r++)
+                        md5_many(msgs, lens, 64, digests);
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                printf("%s, %d lanes: %.0f MB/s\n", k->name, k->lanes,
+                        20.0 * sizeof(buf) / 1e6 / (t1.tv_sec - t0.tv_sec +
+                                (t1.tv_nsec - t0.tv_nsec) / 1e9));
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (r = 0; r < 20; r++)
+                for (i = 0; i < 64; i++)
+                        EVP_Digest(msgs[i], lens[i], want, &ds, EVP_md5(),
+                                NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        printf("openssl: %.0f MB/s\n", 20.0 * sizeof(buf) / 1e6 /
+                (t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9));
+
+        return fails != 0;
+}
+#endif /* MD5MB_TEST */
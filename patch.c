@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lcopy.h"
+
+/*
+ * Offline patches. --make-patch diffs a source against a base file, a
+ * copy of what the replicas hold, and writes the changed chunks to a
+ * patch file instead of the base. --apply-patch checks that a replica
+ * is the base, by root and size of its digests, and writes the chunks.
+ *
+ * A patch is a header, the digests of the new file, the indexes of the
+ * changed chunks and, from the next PATCH_ALIGN boundary, the data of
+ * the changed chunks that are not zero chunks, in index order. Like
+ * digest files it is in host byte order.
+ */
+
+#define PATCH_MAGIC "LCPATCH\0"
+#define PATCH_VERSION 1
+#define PATCH_HEADER_SIZE 128
+
+/* Chunk data starts aligned, so that it can be cloned to and from. */
+#define PATCH_ALIGN 4096
+
+struct patch_header {
+        char magic[8];          /* PATCH_MAGIC */
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t algo;          /* HashAlgo of the digests. */
+        uint32_t digest_size;
+        uint64_t chunk_size;
+        uint64_t base_size;     /* Size of the base file. */
+        uint64_t size;          /* Size of the new file. */
+        uint64_t count;         /* Digests of the new file. */
+        uint64_t changed;       /* Changed chunks. */
+        unsigned char base_root[MAX_DIGEST_SIZE];
+        unsigned char root[MAX_DIGEST_SIZE];
+};
+
+/* Offset of chunk data in a patch. */
+static off_t patch_data_off(const struct patch_header *h) {
+        off_t off = PATCH_HEADER_SIZE + h->count * h->digest_size +
+                h->changed * sizeof(uint64_t);
+
+        return (off + PATCH_ALIGN - 1) & ~(off_t)(PATCH_ALIGN - 1);
+}
+
+/*
+ * Writes the patch turning base into src to patch. Chunk data is
+ * copied from src in kernel where possible.
+ * Returns number of changed chunks.
+ */
+long make_patch(const char *patch, const char *src, const char *base) {
+        struct worker *w = pool_local_worker();
+        struct patch_header h;
+        struct digs src_digs;
+        struct digs base_digs;
+        uint64_t *bitmap;
+        uint64_t index;
+        FILE *src_f;
+        FILE *base_f;
+        FILE *src_digs_f;
+        FILE *base_digs_f;
+        FILE *out;
+        off_t off;
+        off_t run_in = 0;
+        off_t run_off = 0;
+        off_t run_len = 0;
+        off_t len;
+        long i;
+
+        src_f = fopen(src, "r");
+        if (src_f == NULL)
+                handle_error(src);
+        base_f = fopen(base, "r");
+        if (base_f == NULL)
+                handle_error(base);
+        src_digs_f = open_digest_file(src, src_f);
+        base_digs_f = open_digest_file(base, base_f);
+        if (digs_map(fileno(src_digs_f), &src_digs) != 0 ||
+                        digs_map(fileno(base_digs_f), &base_digs) != 0)
+                handle_error("mmap");
+
+        bitmap = calloc(BITMAP_WORDS(src_digs.count) + 1, sizeof(uint64_t));
+        if (bitmap == NULL)
+                handle_error("calloc");
+
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, PATCH_MAGIC, sizeof(h.magic));
+        h.version = PATCH_VERSION;
+        h.header_size = PATCH_HEADER_SIZE;
+        h.algo = hash_algo;
+        h.digest_size = digest_size;
+        h.chunk_size = chunk_size;
+        h.base_size = base_digs.file_size;
+        h.size = src_digs.file_size;
+        h.count = src_digs.count;
+        memcpy(h.base_root, base_digs.root, digest_size);
+        memcpy(h.root, src_digs.root, digest_size);
+        if (!digs_same(&src_digs, &base_digs))
+                h.changed = digs_diff(&src_digs, &base_digs, bitmap);
+
+        out = fopen(patch, "w");
+        if (out == NULL)
+                handle_error(patch);
+        if (fwrite(&h, sizeof(h), 1, out) != 1 ||
+                        (h.count && fwrite(src_digs.digests, h.count *
+                                        digest_size, 1, out) != 1))
+                handle_error("fwrite");
+        for (i = 0; i < src_digs.count; i++) {
+                index = i;
+                if (BITMAP_TEST(bitmap, i) &&
+                                fwrite(&index, sizeof(index), 1, out) != 1)
+                        handle_error("fwrite");
+        }
+        if (fflush(out) != 0)
+                handle_error("fflush");
+
+        /* Data of runs of changed chunks, zero chunks have none. */
+        off = patch_data_off(&h);
+        for (i = 0; i < src_digs.count; i++) {
+                if (!BITMAP_TEST(bitmap, i) ||
+                                digs_is_zero(src_digs.digests +
+                                        i * digest_size))
+                        continue;
+                len = (off_t)h.size - CHUNK_OFF(i) < chunk_size ?
+                        (off_t)h.size - CHUNK_OFF(i) : chunk_size;
+                if (run_len && run_in + run_len != CHUNK_OFF(i)) {
+                        copy_extent(w, fileno(src_f), run_in, fileno(out),
+                                run_off, run_len);
+                        run_len = 0;
+                }
+                if (run_len == 0) {
+                        run_in = CHUNK_OFF(i);
+                        run_off = off;
+                }
+                run_len += len;
+                off += len;
+        }
+        if (run_len)
+                copy_extent(w, fileno(src_f), run_in, fileno(out), run_off,
+                        run_len);
+        if (ftruncate(fileno(out), off) != 0)
+                handle_error("ftruncate");
+
+        if (fclose(out) != 0)
+                handle_error(patch);
+        free(bitmap);
+        digs_unmap(&src_digs);
+        digs_unmap(&base_digs);
+        store_close(src_digs_f, src);
+        store_close(base_digs_f, base);
+        fclose(src_f);
+        fclose(base_f);
+
+        return h.changed;
+}
+
+/* Changed chunks of a mapped patch, checked before anything is written. */
+struct verify_job {
+        const struct patch_header *h;
+        const unsigned char *digests;
+        const uint64_t *indexes;
+        off_t *offs;            /* Offset of the data of each changed chunk. */
+        long bad;
+        pthread_mutex_t lock;
+};
+
+/* Checks data of changed chunks [start, end) against their digests. */
+static void verify_range(void *arg, struct worker *w, long start, long end) {
+        struct verify_job *vj = arg;
+        const unsigned char *base = (const unsigned char *)vj->h;
+        unsigned char digest[MAX_DIGEST_SIZE];
+        const unsigned char *expect;
+        off_t len;
+        long i;
+
+        for (i = start; i < end; i++) {
+                expect = vj->digests + vj->indexes[i] * digest_size;
+                if (digs_is_zero(expect))
+                        continue;
+                len = vj->offs[i + 1] - vj->offs[i];
+                if (hash_digest(w->hash, base + vj->offs[i], len, digest)
+                                != digest_size)
+                        handle_error("hash_digest");
+                if (memcmp(digest, expect, digest_size)) {
+                        pthread_mutex_lock(&vj->lock);
+                        vj->bad++;
+                        pthread_mutex_unlock(&vj->lock);
+                }
+        }
+}
+
+/*
+ * Applies patch to dest, which must have the root and size of the base
+ * the patch was made from. All chunk data is checked against the new
+ * digests first, then runs of changed chunks are written with one write
+ * each. Digests of dest are taken from the patch.
+ * Returns number of chunks written, -1 if the patch does not apply.
+ */
+long apply_patch(const char *patch, const char *dest) {
+        struct worker *w;
+        const struct patch_header *h;
+        struct verify_job vj;
+        struct io_req req;
+        unsigned char root[MAX_DIGEST_SIZE];
+        unsigned char *map;
+        struct stat st;
+        FILE *dest_f;
+        FILE *dest_digs_f;
+        off_t map_size;
+        off_t len;
+        long i;
+        long j;
+        int fd;
+
+        fd = open(patch, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                handle_error(patch);
+        if (fstat(fd, &st) != 0)
+                handle_error("fstat");
+        map_size = st.st_size;
+        if (map_size < PATCH_HEADER_SIZE)
+                goto corrupt;
+        map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+                handle_error("mmap");
+        h = (const struct patch_header *)map;
+
+        /* The patch sets hash and chunk size. */
+        if (memcmp(h->magic, PATCH_MAGIC, sizeof(h->magic)) ||
+                        h->version != PATCH_VERSION ||
+                        h->header_size != PATCH_HEADER_SIZE ||
+                        h->algo >= HASH_COUNT || !hash_available(h->algo) ||
+                        h->digest_size != (uint32_t)hash_size(h->algo) ||
+                        set_chunk_size(h->chunk_size) != 0)
+                goto corrupt;
+        hash_algo = h->algo;
+        digest_size = h->digest_size;
+        if (h->count != (uint64_t)CHUNK_COUNT(h->size) ||
+                        h->count > (uint64_t)map_size / digest_size ||
+                        h->changed > h->count ||
+                        PATCH_HEADER_SIZE + h->count * digest_size +
+                        h->changed * sizeof(uint64_t) > (uint64_t)map_size)
+                goto corrupt;
+
+        vj.h = h;
+        vj.digests = map + PATCH_HEADER_SIZE;
+        vj.indexes = (const uint64_t *)(vj.digests + h->count * digest_size);
+        vj.offs = malloc((h->changed + 1) * sizeof(off_t));
+        if (vj.offs == NULL)
+                handle_error("malloc");
+        vj.bad = 0;
+        pthread_mutex_init(&vj.lock, NULL);
+
+        vj.offs[0] = patch_data_off(h);
+        for (i = 0; i < (long)h->changed; i++) {
+                j = vj.indexes[i];
+                if (j >= (long)h->count || (i && j <= (long)vj.indexes[i - 1]))
+                        goto corrupt;
+                len = 0;
+                if (!digs_is_zero(vj.digests + j * digest_size))
+                        len = (off_t)h->size - CHUNK_OFF(j) < chunk_size ?
+                                (off_t)h->size - CHUNK_OFF(j) : chunk_size;
+                vj.offs[i + 1] = vj.offs[i] + len;
+        }
+        if (vj.offs[h->changed] > map_size)
+                goto corrupt;
+
+        pool_run(h->changed, nthreads, verify_range, &vj);
+        if (vj.bad)
+                goto corrupt;
+
+        dest_f = fopen(dest, "r+");
+        if (dest_f == NULL)
+                handle_error(dest);
+        dest_digs_f = open_digest_file(dest, dest_f);
+        if (fstat(fileno(dest_f), &st) != 0)
+                handle_error("fstat");
+        if ((uint64_t)st.st_size != h->base_size ||
+                        !digs_root(fileno(dest_digs_f), fileno(dest_f), root) ||
+                        memcmp(root, h->base_root, digest_size)) {
+                printf("Patch %s does not apply to %s.\n", patch, dest);
+                store_close(dest_digs_f, dest);
+                fclose(dest_f);
+                free(vj.offs);
+                munmap(map, map_size);
+                close(fd);
+                return -1;
+        }
+
+        /* Runs of adjacent chunks with data are written at once. */
+        w = pool_local_worker();
+        for (i = 0; i < (long)h->changed; i = j) {
+                for (j = i + 1; j < (long)h->changed &&
+                                vj.indexes[j] == vj.indexes[j - 1] + 1 &&
+                                vj.offs[j + 1] > vj.offs[j]; j++)
+                        ;
+                if (vj.offs[i + 1] == vj.offs[i]) {
+                        /* Zero chunk, a hole. */
+                        j = i + 1;
+                        len = (off_t)h->size - CHUNK_OFF(vj.indexes[i]);
+                        zero_range(fileno(dest_f), CHUNK_OFF(vj.indexes[i]),
+                                len < chunk_size ? len : chunk_size);
+                        continue;
+                }
+                req.fd = fileno(dest_f);
+                req.write = 1;
+                req.buf = map + vj.offs[i];
+                req.len = vj.offs[j] - vj.offs[i];
+                req.off = CHUNK_OFF(vj.indexes[i]);
+                io_batch(w->io, &req, 1);
+        }
+        resize_to(fileno(dest_f), h->size);
+
+        fflush(dest_digs_f);
+        digs_write(fileno(dest_digs_f), fileno(dest_f), vj.digests, NULL,
+                h->count);
+        if (!digs_root(fileno(dest_digs_f), fileno(dest_f), root) ||
+                        memcmp(root, h->root, digest_size)) {
+                fprintf(stderr, "Patch %s: root mismatch after apply.\n",
+                        patch);
+                exit(EXIT_FAILURE);
+        }
+
+        i = h->changed;
+        store_close(dest_digs_f, dest);
+        if (fclose(dest_f) != 0)
+                handle_error(dest);
+        free(vj.offs);
+        pthread_mutex_destroy(&vj.lock);
+        munmap(map, map_size);
+        close(fd);
+
+        return i;
+
+corrupt:
+        fprintf(stderr, "Patch %s is corrupt.\n", patch);
+        exit(EXIT_FAILURE);
+}
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "lcopy.h"
+
+struct pool {
+        pthread_mutex_t lock;
+        long next;              /* First chunk of the next free range. */
+        long nchunks;
+        range_job job;
+        void *arg;
+        struct stats *stats;    /* File of the caller, for --stats. */
+};
+
+/*
+ * Takes the next free chunk range [*start, *end).
+ * Returns 0 when all ranges are taken.
+ */
+static int pool_next_range(struct pool *p, long *start, long *end) {
+        int ret = 0;
+
+        pthread_mutex_lock(&p->lock);
+        if (p->next < p->nchunks) {
+                *start = p->next;
+                *end = p->next + range_chunks;
+                if (*end > p->nchunks)
+                        *end = p->nchunks;
+                p->next = *end;
+                ret = 1;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        return ret;
+}
+
+struct worker_arg {
+        struct pool *pool;
+        struct worker worker;
+};
+
+static void *pool_worker(void *data) {
+        struct worker_arg *wa = data;
+        struct pool *p = wa->pool;
+        long start, end;
+
+        stats_attach(p->stats);
+        while (pool_next_range(p, &start, &end))
+                p->job(p->arg, &wa->worker, start, end);
+
+        return NULL;
+}
+
+/*
+ * Sets up hash context, buffer and I/O engine of w. Chunks of the
+ * buffer are DIRECT_ALIGN aligned for O_DIRECT.
+ */
+static void worker_init(struct worker *w, int id) {
+        void *buf;
+
+        w->id = id;
+        w->hash = hash_ctx_new(hash_algo);
+        if (posix_memalign(&buf, DIRECT_ALIGN, 
+                                (size_t)range_chunks * chunk_size) != 0)
+                buf = NULL;
+        w->buf = buf;
+        if (w->hash == NULL || w->buf == NULL)
+                handle_error("malloc");
+        w->io = io_open(io_engine, IO_QUEUE_DEPTH);
+}
+
+static void worker_destroy(struct worker *w) {
+        hash_ctx_free(w->hash);
+        free(w->buf);
+        io_close(w->io);
+}
+
+/*
+ * Workers of finished runs on many threads, reused by the next runs so
+ * that copying many files does not set up workers per file. Workers
+ * kept for another chunk size, hash or I/O engine are dropped.
+ */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct worker *idle;
+static int nidle;
+static int idle_size;
+static long idle_chunk_size;
+static int idle_hash;
+static int idle_engine;
+
+/* Returns non-zero if idle workers fit the current settings. */
+static int idle_fits(void) {
+        return idle_chunk_size == chunk_size && idle_hash == hash_algo &&
+                idle_engine == io_engine;
+}
+
+/* Takes an idle worker, or sets up a new one, as worker id. */
+static void worker_get(struct worker *w, int id) {
+        pthread_mutex_lock(&idle_lock);
+        if (nidle && idle_fits()) {
+                *w = idle[--nidle];
+                w->id = id;
+                pthread_mutex_unlock(&idle_lock);
+                return;
+        }
+        pthread_mutex_unlock(&idle_lock);
+
+        worker_init(w, id);
+}
+
+/* Keeps w for the next run. */
+static void worker_put(struct worker *w) {
+        pthread_mutex_lock(&idle_lock);
+        if (!idle_fits()) {
+                while (nidle)
+                        worker_destroy(&idle[--nidle]);
+                idle_chunk_size = chunk_size;
+                idle_hash = hash_algo;
+                idle_engine = io_engine;
+        }
+        if (nidle == idle_size) {
+                idle_size = idle_size ? idle_size * 2 : 8;
+                idle = realloc(idle, idle_size * sizeof(*idle));
+                if (idle == NULL)
+                        handle_error("realloc");
+        }
+        idle[nidle++] = *w;
+        pthread_mutex_unlock(&idle_lock);
+}
+
+/*
+ * Worker of single threaded runs, kept by each calling thread so that
+ * copying many small files does not set up a worker per file. It is
+ * freed when its thread exits, through local_key.
+ */
+static __thread struct worker *local_worker;
+static pthread_key_t local_key;
+static pthread_once_t local_once = PTHREAD_ONCE_INIT;
+
+static void local_worker_free(void *data) {
+        struct worker *w = data;
+
+        worker_destroy(w);
+        free(w);
+        local_worker = NULL;
+}
+
+static void local_key_init(void) {
+        int rc = pthread_key_create(&local_key, local_worker_free);
+
+        if (rc)
+                handle_error_en(rc, "pthread_key_create");
+}
+
+/* Returns the worker of single threaded runs of the calling thread. */
+struct worker *pool_local_worker(void) {
+        if (local_worker == NULL) {
+                pthread_once(&local_once, local_key_init);
+                local_worker = malloc(sizeof(struct worker));
+                if (local_worker == NULL)
+                        handle_error("malloc");
+                worker_init(local_worker, 0);
+                pthread_setspecific(local_key, local_worker);
+        }
+
+        return local_worker;
+}
+
+/*
+ * Runs job over [0, nchunks) in ranges of range_chunks chunks on
+ * threads workers. Each worker owns its hash context, chunk buffers
+ * and I/O engine for the whole run, they are kept for the next run.
+ * With a single worker the job runs on the caller thread.
+ * Returns 0 on success.
+ */
+int pool_run(long nchunks, int threads, range_job job, void *arg) {
+        struct pool p;
+        struct worker_arg *wa;
+        pthread_t *tids;
+        int i, rc;
+
+        if (nchunks <= 0)
+                return 0;
+
+        if (threads < 1)
+                threads = 1;
+        if (threads > (nchunks + range_chunks - 1) / range_chunks)
+                threads = (nchunks + range_chunks - 1) / range_chunks;
+
+        pthread_mutex_init(&p.lock, NULL);
+        p.next = 0;
+        p.nchunks = nchunks;
+        p.job = job;
+        p.arg = arg;
+        p.stats = stats_current();
+
+        if (threads == 1) {
+                struct worker_arg local;
+
+                local.pool = &p;
+                local.worker = *pool_local_worker();
+                pool_worker(&local);
+                pthread_mutex_destroy(&p.lock);
+                return 0;
+        }
+
+        wa = calloc(threads, sizeof(*wa));
+        tids = calloc(threads, sizeof(*tids));
+        if (wa == NULL || tids == NULL)
+                handle_error("calloc");
+
+        for (i = 0; i < threads; i++) {
+                wa[i].pool = &p;
+                worker_get(&wa[i].worker, i);
+        }
+
+        for (i = 0; i < threads; i++) {
+                rc = pthread_create(&tids[i], NULL, pool_worker, &wa[i]);
+                if (rc)
+                        handle_error_en(rc, "pthread_create");
+        }
+        for (i = 0; i < threads; i++)
+                pthread_join(tids[i], NULL);
+
+        for (i = 0; i < threads; i++)
+                worker_put(&wa[i].worker);
+        free(wa);
+        free(tids);
+        pthread_mutex_destroy(&p.lock);
+
+        return 0;
+}
@@ -0,0 +1,1467 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <endian.h>
+#include <signal.h>
+#include <netdb.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/openat2.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "lcopy.h"
+
+/*
+ * Remote copy. A client holding the sources talks to a server holding
+ * the destination over a pipe or a socket. For each file the server
+ * sends the digests of its destination file, the client sends back the
+ * chunks whose digests differ and then all source digests, which become
+ * the destination digests. A destination already having the Merkle
+ * root of the source is not diffed at all.
+ *
+ * A message is a header of type, flags, two reserved bytes, file id
+ * and payload length followed by the payload, integers are big endian.
+ * Payloads are capped by msg_max(), digests of a file are sent in
+ * blocks of DIGS_BLOCK. The server handles messages in order and
+ * replies in order. The client keeps up to REMOTE_WINDOW files
+ * requested ahead of the one it sends chunks of, so that the server
+ * digests them while chunks are on the wire, and drains replies on a
+ * thread of its own.
+ *
+ * Paths of files and directories must lie under the destination of
+ * HELLO and have no ".." component. They are opened beneath the
+ * destination without following symbolic links, so a link under it
+ * cannot lead out. A server listening on a socket takes destinations
+ * relative to its working directory only.
+ */
+
+#define PROTO_MAGIC "LCPROTO\0"
+#define PROTO_VERSION 2
+#define MSG_HEADER_SIZE 12
+
+/* Message types. */
+enum {
+        MSG_HELLO = 1,  /* Parameters and destination, HELLO reply. */
+        MSG_DIR,        /* Directory to create, no reply. */
+        MSG_FILE,       /* File to update, DIGS, SAME or ERR reply. */
+        MSG_DIGS,       /* Block of digests of a destination file. */
+        MSG_SAME,       /* Destination has the root of the source. */
+        MSG_CHUNK,      /* Chunk index and data, ERR reply if they do
+                           not fit the file. */
+        MSG_END,        /* Source size and block of its digests, OK or
+                           ERR reply after the last block. */
+        MSG_OK,
+        MSG_ERR,        /* Error text. */
+        MSG_BYE,        /* End of session, BYE reply. */
+};
+
+/* Message flags. */
+#define HELLO_DEFLATE 1         /* Chunk data is one deflate stream. */
+#define HELLO_DEST_DIR 1        /* Reply, destination is a directory. */
+#define FILE_ROOT 1             /* Source root is valid. */
+#define CHUNK_ZERO 1            /* Chunk of zeros, without data. */
+#define DIGS_MORE 1             /* DIGS or END, more blocks follow. */
+
+/* Digests per DIGS or END message. */
+#define DIGS_BLOCK 65536
+
+/* Payload sizes before paths and digests. */
+#define HELLO_SIZE 28           /* magic, version, algo, chunk size */
+#define FILE_SIZE (8 + MAX_DIGEST_SIZE) /* size, root */
+
+struct conn {
+        FILE *in;
+        FILE *out;
+        pthread_mutex_t lock;   /* Held while a message is written. */
+        int deflate;
+#ifdef HAVE_ZLIB
+        z_stream zs;            /* Deflate on clients, inflate on servers. */
+#endif
+        unsigned char *zbuf;
+        size_t zbuf_size;
+};
+
+struct msg {
+        int type;
+        int flags;
+        uint32_t id;
+        uint32_t len;
+        unsigned char *data;    /* Payload, NUL terminated. */
+        size_t size;
+};
+
+static void put32(unsigned char *p, uint32_t v) {
+        v = htobe32(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+        v = htobe64(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get32(const unsigned char *p) {
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return be32toh(v);
+}
+
+static uint64_t get64(const unsigned char *p) {
+        uint64_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return be64toh(v);
+}
+
+/* Exits on a malformed message or a peer not following the protocol. */
+static void proto_error(const char *what) {
+        fprintf(stderr, "Protocol error: %s.\n", what);
+        exit(EXIT_FAILURE);
+}
+
+/* Returns non-zero if chunk data can be deflated, -z. */
+int remote_can_deflate(void) {
+#ifdef HAVE_ZLIB
+        return 1;
+#else
+        return 0;
+#endif
+}
+
+static void conn_init(struct conn *c, int in, int out) {
+        c->in = fdopen(in, "r");
+        c->out = fdopen(out, "w");
+        if (c->in == NULL || c->out == NULL)
+                handle_error("fdopen");
+        pthread_mutex_init(&c->lock, NULL);
+        c->deflate = 0;
+        c->zbuf = NULL;
+        c->zbuf_size = 0;
+}
+
+/* Starts the chunk data stream, deflated if zflag is set. */
+static void conn_deflate(struct conn *c, int zflag, int inflating) {
+        c->deflate = zflag;
+        if (!zflag)
+                return;
+#ifdef HAVE_ZLIB
+        memset(&c->zs, 0, sizeof(c->zs));
+        if ((inflating ? inflateInit(&c->zs) :
+                                deflateInit(&c->zs, Z_BEST_SPEED)) != Z_OK)
+                proto_error("zlib init");
+#else
+        (void)inflating;
+        proto_error("deflate not available");
+#endif
+}
+
+/* Writes a message of payload a and b, with c->lock held. */
+static void msg_write(struct conn *c, int type, int flags, uint32_t id,
+                const void *a, size_t alen, const void *b, size_t blen) {
+        unsigned char h[MSG_HEADER_SIZE];
+
+        h[0] = type;
+        h[1] = flags;
+        h[2] = h[3] = 0;
+        put32(h + 4, id);
+        put32(h + 8, alen + blen);
+        if (fwrite(h, sizeof(h), 1, c->out) != 1 ||
+                        (alen && fwrite(a, alen, 1, c->out) != 1) ||
+                        (blen && fwrite(b, blen, 1, c->out) != 1))
+                handle_error("fwrite");
+}
+
+static void msg_send(struct conn *c, int type, int flags, uint32_t id,
+                const void *a, size_t alen, const void *b, size_t blen) {
+        pthread_mutex_lock(&c->lock);
+        msg_write(c, type, flags, id, a, alen, b, blen);
+        pthread_mutex_unlock(&c->lock);
+}
+
+static void conn_flush(struct conn *c) {
+        pthread_mutex_lock(&c->lock);
+        if (fflush(c->out) != 0)
+                handle_error("fflush");
+        pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Returns the largest payload a peer may send at the chunk size: a
+ * chunk with its index, deflated or not, a block of digests, or a path
+ * with the parameters or an error text.
+ */
+static size_t msg_max(void) {
+        size_t max = FILE_SIZE + PATH_MAX + 256;
+
+        if (max < 8 + (size_t)chunk_size + (chunk_size >> 11) + 128)
+                max = 8 + (size_t)chunk_size + (chunk_size >> 11) + 128;
+        if (max < 8 + (size_t)DIGS_BLOCK * MAX_DIGEST_SIZE)
+                max = 8 + (size_t)DIGS_BLOCK * MAX_DIGEST_SIZE;
+
+        return max;
+}
+
+/* Reads the next message into m. Returns -1 at end of stream. */
+static int msg_read(struct conn *c, struct msg *m) {
+        unsigned char h[MSG_HEADER_SIZE];
+
+        if (fread(h, sizeof(h), 1, c->in) != 1) {
+                if (ferror(c->in))
+                        handle_error("fread");
+                return -1;
+        }
+        m->type = h[0];
+        m->flags = h[1];
+        m->id = get32(h + 4);
+        m->len = get32(h + 8);
+        if (m->len > msg_max())
+                proto_error("message too long");
+
+        if (m->data == NULL || m->len >= m->size) {
+                free(m->data);
+                m->size = (size_t)m->len + 1;
+                m->data = malloc(m->size);
+                if (m->data == NULL)
+                        handle_error("malloc");
+        }
+        if (m->len && fread(m->data, m->len, 1, c->in) != 1) {
+                if (ferror(c->in))
+                        handle_error("fread");
+                return -1;
+        }
+        m->data[m->len] = '\0';
+
+        return 0;
+}
+
+/* Sends chunk i of file id, deflated if the stream is. */
+static void send_chunk(struct conn *c, uint32_t id, long i,
+                const unsigned char *buf, size_t len, int zero) {
+        unsigned char index[8];
+
+        put64(index, i);
+        pthread_mutex_lock(&c->lock);
+        if (zero) {
+                msg_write(c, MSG_CHUNK, CHUNK_ZERO, id, index, 8, NULL, 0);
+        } else if (c->deflate) {
+#ifdef HAVE_ZLIB
+                size_t bound = deflateBound(&c->zs, len) + 64;
+
+                if (c->zbuf_size < bound) {
+                        free(c->zbuf);
+                        c->zbuf_size = bound;
+                        c->zbuf = malloc(bound);
+                        if (c->zbuf == NULL)
+                                handle_error("malloc");
+                }
+                c->zs.next_in = (unsigned char *)buf;
+                c->zs.avail_in = len;
+                c->zs.next_out = c->zbuf;
+                c->zs.avail_out = c->zbuf_size;
+                if (deflate(&c->zs, Z_SYNC_FLUSH) != Z_OK ||
+                                c->zs.avail_in || !c->zs.avail_out)
+                        proto_error("deflate");
+                msg_write(c, MSG_CHUNK, 0, id, index, 8, c->zbuf,
+                        c->zbuf_size - c->zs.avail_out);
+#endif
+        } else {
+                msg_write(c, MSG_CHUNK, 0, id, index, 8, buf, len);
+        }
+        pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Sends count digests of file id as messages of type of DIGS_BLOCK
+ * digests each, all but the last flagged DIGS_MORE, each after head of
+ * hlen bytes. No digests are sent as one message of head only.
+ */
+static void send_digests(struct conn *c, int type, uint32_t id,
+                const void *head, size_t hlen, const unsigned char *digests,
+                long count) {
+        long i = 0;
+        long n;
+
+        do {
+                n = count - i < DIGS_BLOCK ? count - i : DIGS_BLOCK;
+                msg_send(c, type, i + n < count ? DIGS_MORE : 0, id, head,
+                        hlen, digests + i * digest_size, 
+                        (size_t)n * digest_size);
+                i += n;
+        } while (i < count);
+}
+
+/*
+ * Connects to or, if listening, listens on addr, a Unix socket path if
+ * it has a '/', [host]:port otherwise. Without a host, the socket is
+ * on the loopback interface, an IPv6 host can be put in brackets.
+ * Returns the socket.
+ */
+static int remote_socket(const char *addr, int listening) {
+        struct addrinfo hints;
+        struct addrinfo *res;
+        struct addrinfo *ai;
+        char *host;
+        char *node;
+        char *port;
+        int fd = -1;
+        int one = 1;
+        int rc;
+
+        if (strchr(addr, '/') != NULL) {
+                struct sockaddr_un un;
+
+                if (strlen(addr) >= sizeof(un.sun_path)) {
+                        fprintf(stderr, "Socket path too long: %s.\n", addr);
+                        exit(EXIT_FAILURE);
+                }
+                memset(&un, 0, sizeof(un));
+                un.sun_family = AF_UNIX;
+                strcpy(un.sun_path, addr);
+                fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (fd < 0)
+                        handle_error("socket");
+                if (listening) {
+                        unlink(addr);
+                        if (bind(fd, (struct sockaddr *)&un, sizeof(un)) != 0
+                                        || listen(fd, SOMAXCONN) != 0)
+                                handle_error(addr);
+                } else if (connect(fd, (struct sockaddr *)&un,
+                                        sizeof(un)) != 0) {
+                        handle_error(addr);
+                }
+                return fd;
+        }
+
+        host = strdup(addr);
+        if (host == NULL)
+                handle_error("strdup");
+        port = strrchr(host, ':');
+        if (port == NULL) {
+                fprintf(stderr, "Address is not [host]:port: %s.\n", addr);
+                exit(EXIT_FAILURE);
+        }
+        *port++ = '\0';
+        node = host;
+        if (*node == '[' && port - host >= 3 && port[-2] == ']') {
+                port[-2] = '\0';
+                node++;
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        /* A server without host listens on 127.0.0.1, clients try all. */
+        hints.ai_family = listening && !*node ? AF_INET : AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        rc = getaddrinfo(*node ? node : NULL, port, &hints, &res);
+        if (rc != 0) {
+                fprintf(stderr, "%s: %s.\n", addr, gai_strerror(rc));
+                exit(EXIT_FAILURE);
+        }
+
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+                fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                        ai->ai_protocol);
+                if (fd < 0)
+                        continue;
+                if (listening) {
+                        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one,
+                                sizeof(one));
+                        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+                                        listen(fd, SOMAXCONN) == 0)
+                                break;
+                } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                        break;
+                }
+                close(fd);
+                fd = -1;
+        }
+        if (fd < 0)
+                handle_error(addr);
+
+        freeaddrinfo(res);
+        free(host);
+
+        return fd;
+}
+
+/* Destination file of the server, by file id modulo REMOTE_WINDOW. */
+struct rfile {
+        char *path;
+        FILE *f;
+        FILE *digs_f;
+        off_t size;             /* Size of the source. */
+        unsigned char *sums;    /* Source digests of END blocks so far. */
+        long nsums;
+};
+
+/* Destination of the session, set by HELLO. */
+static char *serve_dest;
+
+/* Destinations are relative to the working directory, for --listen. */
+static int serve_confined;
+
+/*
+ * Directory paths of the session are opened beneath: the destination
+ * if it is a directory, else its parent, then serve_base is its last
+ * component. Set by HELLO.
+ */
+static int serve_root = -1;
+static char *serve_base;
+
+/*
+ * Returns non-zero if path has no ".." component and, unless absolute
+ * is set, does not start with '/'.
+ */
+static int path_safe(const char *path, int absolute) {
+        const char *p;
+
+        if (!absolute && *path == '/')
+                return 0;
+        for (p = path; p != NULL; p = strchr(p, '/')) {
+                if (*p == '/')
+                        p++;
+                if (p[0] == '.' && p[1] == '.' && 
+                                (p[2] == '/' || p[2] == '\0'))
+                        return 0;
+        }
+
+        return 1;
+}
+
+/*
+ * Returns non-zero if path of a DIR or FILE message is the destination
+ * of the session or lies under it. Sets errno otherwise.
+ */
+static int serve_path_ok(const char *path) {
+        size_t n = strlen(serve_dest);
+
+        if (!strncmp(path, serve_dest, n) && (path[n] == '\0' || 
+                                path[n] == '/' || path[n - 1] == '/') &&
+                        path_safe(path + n, 1))
+                return 1;
+
+        errno = EACCES;
+        return 0;
+}
+
+/*
+ * Opens rel beneath dirfd like openat, failing if a component is a
+ * symbolic link or rel leaves dirfd. Uses openat2 where the kernel has
+ * it, otherwise opens rel one component at a time with O_NOFOLLOW.
+ */
+static int open_beneath(int dirfd, const char *rel, int flags, mode_t mode) {
+#ifdef __NR_openat2
+        struct open_how how;
+#endif
+        char *copy;
+        char *comp;
+        char *next;
+        int dfd;
+        int fd;
+
+#ifdef __NR_openat2
+        memset(&how, 0, sizeof(how));
+        how.flags = flags | O_CLOEXEC;
+        how.mode = flags & O_CREAT ? mode : 0;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+        fd = syscall(__NR_openat2, dirfd, rel, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS)
+                return fd;
+#endif
+
+        copy = strdup(rel);
+        if (copy == NULL)
+                handle_error("strdup");
+        dfd = dirfd;
+        fd = -1;
+        for (comp = copy; ; comp = next) {
+                while (*comp == '/')
+                        comp++;
+                next = strchr(comp, '/');
+                if (next != NULL)
+                        *next++ = '\0';
+                while (next != NULL && *next == '/')
+                        next++;
+                if (next != NULL && *next == '\0')
+                        next = NULL;
+                if (next == NULL) {
+                        fd = openat(dfd, *comp ? comp : ".", 
+                                flags | O_NOFOLLOW | O_CLOEXEC, mode);
+                        break;
+                }
+                fd = openat(dfd, comp, O_PATH | O_DIRECTORY | O_NOFOLLOW |
+                        O_CLOEXEC);
+                if (dfd != dirfd)
+                        close(dfd);
+                if (fd < 0)
+                        break;
+                dfd = fd;
+        }
+        if (next == NULL && dfd != dirfd)
+                close(dfd);
+        free(copy);
+
+        return fd;
+}
+
+/*
+ * Opens the directory holding path of a DIR or FILE message, beneath
+ * the destination, and sets name to the last component of path.
+ * Returns -1 on failure.
+ */
+static int serve_parent(const char *path, char **name) {
+        const char *rest = path + strlen(serve_dest);
+        char *slash;
+        char *rel;
+        size_t len;
+        int fd;
+
+        while (*rest == '/')
+                rest++;
+        if (asprintf(&rel, "%s%s%s", serve_base, 
+                                *serve_base && *rest ? "/" : "", rest) < 0)
+                handle_error("asprintf");
+        len = strlen(rel);
+        while (len > 0 && rel[len - 1] == '/')
+                rel[--len] = '\0';
+
+        slash = strrchr(rel, '/');
+        if (slash != NULL)
+                *slash = '\0';
+        *name = strdup(slash != NULL ? slash + 1 : *rel ? rel : ".");
+        if (*name == NULL)
+                handle_error("strdup");
+        fd = open_beneath(serve_root, slash != NULL ? rel : ".", 
+                O_PATH | O_DIRECTORY, 0);
+        free(rel);
+        if (fd < 0) {
+                free(*name);
+                *name = NULL;
+        }
+
+        return fd;
+}
+
+/*
+ * Opens the digest file of name in dirfd like store_open, without
+ * following a symbolic link.
+ */
+static FILE *serve_digs_open(int dirfd, const char *name, const char *mode) {
+        char *digs_name = get_digs_filepath(name);
+        FILE *f = NULL;
+        int fd;
+
+        fd = openat(dirfd, digs_name, (mode[0] == 'w' ? 
+                                O_RDWR | O_CREAT | O_TRUNC : O_RDWR) | 
+                        O_NOFOLLOW | O_CLOEXEC, 0666);
+        free(digs_name);
+        if (fd >= 0 && (f = fdopen(fd, mode)) == NULL)
+                close(fd);
+
+        return f;
+}
+
+/* Sends an error reply of file id for path. */
+static void serve_error(struct conn *c, uint32_t id, const char *path) {
+        char text[PATH_MAX + 256];
+
+        snprintf(text, sizeof(text), "%s: %s", path, strerror(errno));
+        msg_send(c, MSG_ERR, 0, id, text, strlen(text), NULL, 0);
+}
+
+/*
+ * Gives up the destination file of rf, whose chunks or digests do not
+ * match its FILE message, most likely as the source changed meanwhile.
+ * Replies an error, later messages of the file are ignored.
+ */
+static void serve_fail(struct conn *c, uint32_t id, struct rfile *rf,
+                const char *what) {
+        char text[PATH_MAX + 256];
+
+        snprintf(text, sizeof(text), "%s: %s", rf->path, what);
+        msg_send(c, MSG_ERR, 0, id, text, strlen(text), NULL, 0);
+        fclose(rf->f);
+        fclose(rf->digs_f);
+        free(rf->path);
+        free(rf->sums);
+        rf->path = NULL;
+}
+
+/* Checks parameters of the client and replies whether dest is a dir. */
+static void serve_hello(struct conn *c, struct msg *m) {
+        unsigned char reply[8];
+        uint32_t algo;
+        const char *dest;
+        char *parent;
+        char *slash;
+
+        if (m->len < HELLO_SIZE || memcmp(m->data, PROTO_MAGIC, 8) ||
+                        get32(m->data + 8) != PROTO_VERSION)
+                proto_error("bad hello");
+        algo = get32(m->data + 12);
+        if (algo >= HASH_COUNT || !hash_available(algo) ||
+                        set_chunk_size(get64(m->data + 16)) != 0) {
+                errno = EINVAL;
+                serve_error(c, 0, "hash or chunk size");
+                conn_flush(c);
+                exit(EXIT_FAILURE);
+        }
+        hash_algo = algo;
+        digest_size = hash_size(algo);
+        conn_deflate(c, get32(m->data + 24) & HELLO_DEFLATE, 1);
+
+        dest = (const char *)m->data + HELLO_SIZE;
+        if (*dest == '\0' || !path_safe(dest, !serve_confined)) {
+                errno = EACCES;
+                serve_error(c, 0, dest);
+                conn_flush(c);
+                exit(EXIT_FAILURE);
+        }
+        serve_dest = strdup(dest);
+        parent = strdup(dest);
+        if (serve_dest == NULL || parent == NULL)
+                handle_error("strdup");
+
+        /* Dest itself is the operator's, a link there is followed. */
+        if (is_directory(dest)) {
+                serve_base = strdup("");
+                serve_root = open(dest, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        } else {
+                slash = parent + strlen(parent);
+                while (slash > parent + 1 && slash[-1] == '/')
+                        *--slash = '\0';
+                slash = strrchr(parent, '/');
+                if (slash == NULL) {
+                        serve_base = strdup(parent);
+                        strcpy(parent, ".");
+                } else {
+                        serve_base = strdup(slash + 1);
+                        slash[slash == parent] = '\0';
+                }
+                serve_root = open(parent, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        }
+        free(parent);
+        if (serve_base == NULL)
+                handle_error("strdup");
+        if (serve_root < 0) {
+                serve_error(c, 0, dest);
+                conn_flush(c);
+                exit(EXIT_FAILURE);
+        }
+
+        put32(reply, PROTO_VERSION);
+        put32(reply + 4, is_directory(dest) ? HELLO_DEST_DIR : 0);
+        msg_send(c, MSG_HELLO, 0, 0, reply, sizeof(reply), NULL, 0);
+}
+
+/*
+ * Opens destination file of a FILE message and replies its digests,
+ * generated first unless fresh, or SAME if they have the root of the
+ * source.
+ */
+static void serve_file(struct conn *c, struct msg *m, struct rfile *rf) {
+        unsigned char root[MAX_DIGEST_SIZE];
+        struct digs digs;
+        struct stat st;
+        char *name = NULL;
+        int dirfd = -1;
+        int fd = -1;
+
+        if (m->len < FILE_SIZE)
+                proto_error("bad file");
+        rf->size = get64(m->data);
+        if (!serve_path_ok((const char *)m->data + FILE_SIZE)) {
+                serve_error(c, m->id, (const char *)m->data + FILE_SIZE);
+                return;
+        }
+        rf->path = strdup((const char *)m->data + FILE_SIZE);
+        if (rf->path == NULL)
+                handle_error("strdup");
+        rf->sums = NULL;
+        rf->nsums = 0;
+
+        rf->f = NULL;
+        rf->digs_f = NULL;
+        dirfd = serve_parent(rf->path, &name);
+        if (dirfd >= 0)
+                fd = openat(dirfd, name, O_RDWR | O_CREAT | O_NOFOLLOW | 
+                        O_CLOEXEC, 0666);
+        if (fd >= 0 && (rf->f = fdopen(fd, "r+")) != NULL) {
+                rf->digs_f = serve_digs_open(dirfd, name, "r+");
+                if (rf->digs_f != NULL && 
+                                !digs_fresh(fileno(rf->digs_f), fd)) {
+                        fclose(rf->digs_f);
+                        rf->digs_f = NULL;
+                }
+                if (rf->digs_f == NULL && (rf->digs_f = 
+                                serve_digs_open(dirfd, name, "w+")) != NULL)
+                        write_digest_file(rf->f, rf->digs_f);
+        }
+        if (rf->digs_f == NULL) {
+                serve_error(c, m->id, rf->path);
+                if (rf->f != NULL)
+                        fclose(rf->f);
+                else if (fd >= 0)
+                        close(fd);
+                if (dirfd >= 0)
+                        close(dirfd);
+                free(name);
+                free(rf->path);
+                rf->path = NULL;
+                return;
+        }
+        close(dirfd);
+        free(name);
+
+        if (fstat(fd, &st) != 0)
+                handle_error("fstat");
+        if ((m->flags & FILE_ROOT) && st.st_size == rf->size &&
+                        digs_root(fileno(rf->digs_f), fd, root) &&
+                        !memcmp(root, m->data + 8, digest_size)) {
+                msg_send(c, MSG_SAME, 0, m->id, NULL, 0, NULL, 0);
+                fclose(rf->f);
+                fclose(rf->digs_f);
+                free(rf->path);
+                rf->path = NULL;
+                return;
+        }
+
+        if (digs_map(fileno(rf->digs_f), &digs) != 0)
+                handle_error("mmap");
+        send_digests(c, MSG_DIGS, m->id, NULL, 0, digs.digests, digs.count);
+        digs_unmap(&digs);
+}
+
+/*
+ * Writes the chunk of a CHUNK message to its destination file. Chunk
+ * data is inflated first even if the file was given up, to keep the
+ * deflate stream in step.
+ */
+static void serve_chunk(struct conn *c, struct msg *m, struct rfile *rf) {
+        struct worker *w = pool_local_worker();
+        struct io_req req;
+        unsigned char *data;
+        size_t n;
+        long i;
+        off_t len;
+
+        if (m->len < 8)
+                proto_error("bad chunk");
+        i = get64(m->data);
+        data = m->data + 8;
+        n = m->len - 8;
+
+        if (c->deflate && !(m->flags & CHUNK_ZERO)) {
+#ifdef HAVE_ZLIB
+                /* One byte more than a chunk catches overlong data. */
+                if (c->zbuf == NULL) {
+                        c->zbuf_size = chunk_size + 1;
+                        c->zbuf = malloc(c->zbuf_size);
+                        if (c->zbuf == NULL)
+                                handle_error("malloc");
+                }
+                c->zs.next_in = m->data + 8;
+                c->zs.avail_in = m->len - 8;
+                c->zs.next_out = c->zbuf;
+                c->zs.avail_out = c->zbuf_size;
+                if (inflate(&c->zs, Z_SYNC_FLUSH) != Z_OK ||
+                                c->zs.avail_in || !c->zs.avail_out)
+                        proto_error("corrupt chunk data");
+                data = c->zbuf;
+                n = c->zbuf_size - c->zs.avail_out;
+#endif
+        }
+
+        /* Destination could not be opened or was given up. */
+        if (rf->path == NULL)
+                return;
+
+        len = rf->size - CHUNK_OFF(i);
+        if (i < 0 || len <= 0) {
+                serve_fail(c, m->id, rf, "chunk out of file");
+                return;
+        }
+        if (len > chunk_size)
+                len = chunk_size;
+
+        if (m->flags & CHUNK_ZERO) {
+                zero_range(fileno(rf->f), CHUNK_OFF(i), len);
+                return;
+        }
+        if ((off_t)n != len) {
+                serve_fail(c, m->id, rf, "source changed while copied");
+                return;
+        }
+
+        req.fd = fileno(rf->f);
+        req.buf = data;
+        req.write = 1;
+        req.len = len;
+        req.off = CHUNK_OFF(i);
+        io_batch(w->io, &req, 1);
+}
+
+/*
+ * Takes a block of source digests of an END message. On the last one
+ * finishes the destination file: sets its size to the source size and
+ * writes the source digests as its digests.
+ * Returns non-zero if more blocks follow.
+ */
+static int serve_end(struct conn *c, struct msg *m, struct rfile *rf) {
+        long count;
+
+        if (m->len < 8 || (m->len - 8) % digest_size)
+                proto_error("bad end");
+        if (rf->path == NULL)
+                return m->flags & DIGS_MORE;
+
+        count = (m->len - 8) / digest_size;
+        if ((off_t)get64(m->data) != rf->size ||
+                        rf->nsums + count > CHUNK_COUNT(rf->size)) {
+                serve_fail(c, m->id, rf, "end does not match file");
+                return m->flags & DIGS_MORE;
+        }
+        rf->sums = realloc(rf->sums, (size_t)(rf->nsums + count) * 
+                        digest_size + 1);
+        if (rf->sums == NULL)
+                handle_error("realloc");
+        memcpy(rf->sums + rf->nsums * digest_size, m->data + 8, 
+                (size_t)count * digest_size);
+        rf->nsums += count;
+        if (m->flags & DIGS_MORE)
+                return 1;
+        if (rf->nsums != CHUNK_COUNT(rf->size)) {
+                serve_fail(c, m->id, rf, "end does not match file");
+                return 0;
+        }
+
+        resize_to(fileno(rf->f), rf->size);
+        fflush(rf->digs_f);
+        digs_write(fileno(rf->digs_f), fileno(rf->f), rf->sums, NULL,
+                rf->nsums);
+        if (fclose(rf->f) != 0) {
+                serve_error(c, m->id, rf->path);
+        } else {
+                msg_send(c, MSG_OK, 0, m->id, NULL, 0, NULL, 0);
+        }
+        fclose(rf->digs_f);
+        free(rf->path);
+        free(rf->sums);
+        rf->path = NULL;
+
+        return 0;
+}
+
+/* Creates the directory of a DIR message unless it exists. */
+static void serve_mkdir(struct conn *c, struct msg *m) {
+        const char *path = (const char *)m->data;
+        struct stat st;
+        char *name;
+        int dirfd;
+
+        if (!serve_path_ok(path) || (dirfd = serve_parent(path, &name)) < 0) {
+                serve_error(c, m->id, path);
+                return;
+        }
+        if (mkdirat(dirfd, name, 0777) != 0 && (errno != EEXIST ||
+                                fstatat(dirfd, name, &st, 
+                                        AT_SYMLINK_NOFOLLOW) != 0 ||
+                                !S_ISDIR(st.st_mode))) {
+                if (errno == EEXIST)
+                        errno = ENOTDIR;
+                serve_error(c, m->id, path);
+        }
+        free(name);
+        close(dirfd);
+}
+
+/* Serves one client on in and out until it says BYE. */
+static void serve(int in, int out) {
+        struct rfile files[REMOTE_WINDOW];
+        struct conn c;
+        struct msg m;
+        struct rfile *rf;
+
+        memset(files, 0, sizeof(files));
+        memset(&m, 0, sizeof(m));
+        conn_init(&c, in, out);
+
+        if (msg_read(&c, &m) != 0 || m.type != MSG_HELLO)
+                proto_error("no hello");
+        serve_hello(&c, &m);
+        conn_flush(&c);
+
+        while (msg_read(&c, &m) == 0) {
+                rf = &files[m.id % REMOTE_WINDOW];
+                switch (m.type) {
+                case MSG_DIR:
+                        serve_mkdir(&c, &m);
+                        break;
+                case MSG_FILE:
+                        if (rf->path != NULL)
+                                proto_error("file id in use");
+                        serve_file(&c, &m, rf);
+                        break;
+                case MSG_CHUNK:
+                        serve_chunk(&c, &m, rf);
+                        continue;
+                case MSG_END:
+                        if (serve_end(&c, &m, rf))
+                                continue;
+                        break;
+                case MSG_BYE:
+                        msg_send(&c, MSG_BYE, 0, 0, NULL, 0, NULL, 0);
+                        conn_flush(&c);
+                        store_finish();
+                        free(m.data);
+                        free(serve_dest);
+                        free(serve_base);
+                        close(serve_root);
+                        return;
+                default:
+                        proto_error("unknown message");
+                }
+                conn_flush(&c);
+        }
+
+        proto_error("connection closed");
+}
+
+/*
+ * Serves clients on stdin and stdout, or if addr is set, each client
+ * connecting to addr in a process of its own.
+ */
+void remote_serve(const char *addr) {
+        int lfd;
+        int fd;
+        int out;
+
+        signal(SIGPIPE, SIG_IGN);
+
+        if (addr == NULL) {
+                /* Output of shared code must not end up in the stream. */
+                out = dup(STDOUT_FILENO);
+                if (out < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+                        handle_error("dup");
+                serve(STDIN_FILENO, out);
+                return;
+        }
+
+        signal(SIGCHLD, SIG_IGN);
+        serve_confined = 1;
+        lfd = remote_socket(addr, 1);
+        for (;;) {
+                fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        handle_error("accept");
+                }
+                switch (fork()) {
+                case -1:
+                        handle_error("fork");
+                case 0:
+                        close(lfd);
+                        out = dup(fd);
+                        if (out < 0)
+                                handle_error("dup");
+                        serve(fd, out);
+                        exit(EXIT_SUCCESS);
+                default:
+                        close(fd);
+                }
+        }
+}
+
+/* Reply queued by the reader thread of a client. */
+struct reply {
+        struct msg m;
+        struct reply *next;
+};
+
+/* Source file requested from the server, chunks not yet sent. */
+struct pending {
+        char *src;
+        char *dest;
+        uint32_t id;
+        off_t size;             /* Source size sent in FILE. */
+        FILE *f;
+        FILE *digs_f;           /* Fresh source digests, or NULL. */
+};
+
+struct client {
+        struct conn c;
+        pthread_t reader;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        struct reply *head;     /* Replies not yet taken. */
+        struct reply *tail;
+        int closed;             /* Reader is done. */
+        struct pending files[REMOTE_WINDOW];
+        uint32_t next_id;       /* Id of the next file requested. */
+        uint32_t first_id;      /* Oldest file of files. */
+        int errors;
+};
+
+/* Queues replies of the server until BYE or end of stream. */
+static void *client_reader(void *arg) {
+        struct client *cl = arg;
+        struct reply *r;
+        int bye = 0;
+
+        while (!bye) {
+                r = calloc(1, sizeof(*r));
+                if (r == NULL)
+                        handle_error("calloc");
+                if (msg_read(&cl->c, &r->m) != 0) {
+                        free(r->m.data);
+                        free(r);
+                        break;
+                }
+                bye = r->m.type == MSG_BYE;
+
+                pthread_mutex_lock(&cl->lock);
+                if (cl->tail != NULL)
+                        cl->tail->next = r;
+                else
+                        cl->head = r;
+                cl->tail = r;
+                pthread_cond_signal(&cl->cond);
+                pthread_mutex_unlock(&cl->lock);
+        }
+
+        pthread_mutex_lock(&cl->lock);
+        cl->closed = 1;
+        pthread_cond_signal(&cl->cond);
+        pthread_mutex_unlock(&cl->lock);
+
+        return NULL;
+}
+
+/*
+ * Takes the next reply, error replies are reported and counted.
+ * The caller frees it.
+ */
+static struct reply *client_reply(struct client *cl) {
+        struct reply *r;
+
+        pthread_mutex_lock(&cl->lock);
+        while (cl->head == NULL && !cl->closed)
+                pthread_cond_wait(&cl->cond, &cl->lock);
+        r = cl->head;
+        if (r != NULL) {
+                cl->head = r->next;
+                if (cl->head == NULL)
+                        cl->tail = NULL;
+        }
+        pthread_mutex_unlock(&cl->lock);
+
+        if (r == NULL)
+                proto_error("connection closed");
+        if (r->m.type == MSG_ERR) {
+                printf("%s.\n", (char *)r->m.data);
+                cl->errors++;
+        }
+
+        return r;
+}
+
+static void reply_free(struct reply *r) {
+        free(r->m.data);
+        free(r);
+}
+
+/* Chunks of a source file diffed against destination digests. */
+struct send_job {
+        struct client *cl;
+        uint32_t id;
+        int fd;
+        off_t size;
+        int fresh;              /* Digests are read, not computed. */
+        unsigned char *digests;
+        const unsigned char *dest_digests;
+        long dest_count;
+};
+
+static int chunk_dirty(const struct send_job *sj, long i) {
+        return i >= sj->dest_count || memcmp(sj->digests + i * digest_size,
+                sj->dest_digests + i * digest_size, digest_size);
+}
+
+/* Reads a range of source chunks, digests them and sends changed ones. */
+static void send_range(void *arg, struct worker *w, long start, long end) {
+        struct send_job *sj = arg;
+        ssize_t lens[MAX_CHUNKS_PER_RANGE];
+        char holes[MAX_CHUNKS_PER_RANGE];
+        long i;
+
+        /* Ranges of known digests are read only if a chunk changed. */
+        if (sj->fresh) {
+                for (i = start; i < end && !chunk_dirty(sj, i); i++)
+                        ;
+                if (i == end)
+                        return;
+        }
+
+        read_chunks(w, sj->fd, sj->size, start, end, lens, holes);
+        if (!sj->fresh)
+                digest_chunks(w, start, end, lens, holes,
+                        sj->digests + start * digest_size);
+        for (i = start; i < end; i++) {
+                if (chunk_dirty(sj, i))
+                        send_chunk(&sj->cl->c, sj->id, i,
+                                w->buf + CHUNK_OFF(i - start),
+                                lens[i - start], digs_is_zero(sj->digests +
+                                        i * digest_size));
+        }
+}
+
+/*
+ * Sends changed chunks and digests of the oldest requested file once
+ * the server replied to its request. Only the size sent in FILE is
+ * read, the server expects that many bytes. Source digests that are
+ * no longer fresh are computed again, and kept only if the source
+ * still has that size.
+ */
+static void client_send(struct client *cl) {
+        struct pending *p = &cl->files[cl->first_id % REMOTE_WINDOW];
+        unsigned char size[8];
+        struct send_job sj;
+        struct reply *r;
+        struct digs digs;
+        struct stat st;
+        unsigned char *dest_digests = NULL;
+        size_t dest_len = 0;
+        long nchunks;
+
+        /* Replies of earlier files come first. */
+        for (;;) {
+                r = client_reply(cl);
+                if (r->m.id == p->id && (r->m.type == MSG_DIGS ||
+                                r->m.type == MSG_SAME ||
+                                r->m.type == MSG_ERR))
+                        break;
+                if (r->m.type != MSG_OK && r->m.type != MSG_ERR)
+                        proto_error("unexpected reply");
+                reply_free(r);
+        }
+
+        /* Digests of large files come in blocks. */
+        while (r->m.type == MSG_DIGS && (r->m.flags & DIGS_MORE)) {
+                dest_digests = realloc(dest_digests, dest_len + r->m.len);
+                if (dest_digests == NULL)
+                        handle_error("realloc");
+                memcpy(dest_digests + dest_len, r->m.data, r->m.len);
+                dest_len += r->m.len;
+                reply_free(r);
+                r = client_reply(cl);
+                if (r->m.id != p->id || r->m.type != MSG_DIGS)
+                        proto_error("unexpected reply");
+        }
+        if (dest_digests != NULL) {
+                dest_digests = realloc(dest_digests, dest_len + r->m.len);
+                if (dest_digests == NULL)
+                        handle_error("realloc");
+                memcpy(dest_digests + dest_len, r->m.data, r->m.len);
+                dest_len += r->m.len;
+        }
+
+        if (r->m.type == MSG_DIGS) {
+                if (p->digs_f != NULL && !digs_fresh(fileno(p->digs_f), 
+                                        fileno(p->f))) {
+                        store_close(p->digs_f, p->src);
+                        p->digs_f = NULL;
+                }
+                sj.cl = cl;
+                sj.id = p->id;
+                sj.fd = fileno(p->f);
+                sj.size = p->size;
+                sj.fresh = p->digs_f != NULL;
+                sj.dest_digests = dest_digests != NULL ? dest_digests :
+                        r->m.data;
+                sj.dest_count = (dest_digests != NULL ? dest_len :
+                        r->m.len) / digest_size;
+                nchunks = CHUNK_COUNT(p->size);
+
+                if (sj.fresh) {
+                        if (digs_map(fileno(p->digs_f), &digs) != 0)
+                                handle_error("mmap");
+                        sj.digests = digs.digests;
+                } else {
+                        sj.digests = malloc((size_t)nchunks * digest_size + 1);
+                        if (sj.digests == NULL)
+                                handle_error("malloc");
+                }
+
+                pool_run(nchunks, nthreads, send_range, &sj);
+                put64(size, p->size);
+                send_digests(&cl->c, MSG_END, p->id, size, sizeof(size),
+                        sj.digests, nchunks);
+                conn_flush(&cl->c);
+
+                /* Source digests computed on the way are kept. */
+                if (fstat(sj.fd, &st) != 0)
+                        handle_error("fstat");
+                if (sj.fresh) {
+                        digs_unmap(&digs);
+                } else if (st.st_size != p->size) {
+                        free(sj.digests);
+                } else {
+                        p->digs_f = store_open(p->src, "w+");
+                        if (p->digs_f == NULL)
+                                handle_error("fopen");
+                        digs_write(fileno(p->digs_f), sj.fd, sj.digests,
+                                NULL, nchunks);
+                        free(sj.digests);
+                }
+        }
+        if (r->m.type != MSG_ERR)
+                printf("Copied from %s to %s.\n", p->src, p->dest);
+        reply_free(r);
+        free(dest_digests);
+
+        fclose(p->f);
+        if (p->digs_f != NULL)
+                store_close(p->digs_f, p->src);
+        free(p->src);
+        free(p->dest);
+        cl->first_id++;
+}
+
+/* Requests the digests of dest, to be updated from src. */
+static void client_file(struct client *cl, const char *src,
+                const char *dest) {
+        unsigned char head[FILE_SIZE];
+        struct pending *p;
+        struct stat st;
+        int flags = 0;
+
+        if (cl->next_id - cl->first_id == REMOTE_WINDOW)
+                client_send(cl);
+
+        p = &cl->files[cl->next_id % REMOTE_WINDOW];
+        p->f = fopen(src, "r");
+        if (p->f == NULL) {
+                perror(src);
+                cl->errors++;
+                return;
+        }
+        if (fstat(fileno(p->f), &st) != 0)
+                handle_error("fstat");
+        p->src = strdup(src);
+        p->dest = strdup(dest);
+        if (p->src == NULL || p->dest == NULL)
+                handle_error("strdup");
+        p->id = cl->next_id++;
+        p->size = st.st_size;
+
+        /* A fresh root lets the server skip an equal file. */
+        memset(head, 0, sizeof(head));
+        put64(head, st.st_size);
+        p->digs_f = store_open(src, "r");
+        if (p->digs_f != NULL && digs_root(fileno(p->digs_f), fileno(p->f),
+                                head + 8)) {
+                flags = FILE_ROOT;
+        } else if (p->digs_f != NULL) {
+                store_close(p->digs_f, src);
+                p->digs_f = NULL;
+        }
+
+        msg_send(&cl->c, MSG_FILE, flags, p->id, head, sizeof(head),
+                dest, strlen(dest));
+        conn_flush(&cl->c);
+}
+
+/* Copies src, a file or with rflag a tree, to dest of the server. */
+static int client_entry(struct client *cl, const char *src,
+                const char *dest, int rflag) {
+        struct dirent **entries;
+        struct stat st;
+        char *s;
+        char *d;
+        int n;
+        int i;
+
+        stat_entry(AT_FDCWD, src, &st);
+        if (st.st_mode == 0) {
+                printf("Source does not exists: %s.\n", src);
+                return -1;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+                /* Digest files are kept by each side, as for local copies. */
+                if (!strcmp(get_extension(src), "digs")) {
+                        printf("Omitting source file with extension .digs:"
+                                " src:%s dest:%s.\n", src, dest);
+                        return -1;
+                }
+                client_file(cl, src, dest);
+                return 0;
+        }
+        if (!rflag) {
+                printf("Omitting source directory: %s.\n", src);
+                return -1;
+        }
+
+        msg_send(&cl->c, MSG_DIR, 0, 0, dest, strlen(dest), NULL, 0);
+        n = scandir(src, &entries, NULL, alphasort);
+        if (n < 0)
+                handle_error("scandir");
+        for (i = 0; i < n; i++) {
+                if (strcmp(entries[i]->d_name, ".") &&
+                                strcmp(entries[i]->d_name, "..") &&
+                                strcmp(entries[i]->d_name, INDEX_NAME)) {
+                        if (asprintf(&s, "%s/%s", src,
+                                                entries[i]->d_name) < 0 ||
+                                        asprintf(&d, "%s/%s", dest,
+                                                entries[i]->d_name) < 0)
+                                handle_error("asprintf");
+                        client_entry(cl, s, d, rflag);
+                        free(s);
+                        free(d);
+                }
+                free(entries[i]);
+        }
+        free(entries);
+
+        return 0;
+}
+
+/* Starts the command line rsh with a pipe to its stdin and stdout. */
+static pid_t rsh_open(const char *rsh, int *in, int *out) {
+        int to[2];
+        int from[2];
+        pid_t pid;
+
+        if (pipe2(to, O_CLOEXEC) != 0 || pipe2(from, O_CLOEXEC) != 0)
+                handle_error("pipe");
+        pid = fork();
+        if (pid < 0)
+                handle_error("fork");
+        if (pid == 0) {
+                if (dup2(to[0], STDIN_FILENO) < 0 ||
+                                dup2(from[1], STDOUT_FILENO) < 0)
+                        handle_error("dup2");
+                execl("/bin/sh", "sh", "-c", rsh, (char *)NULL);
+                handle_error("execl");
+        }
+        close(to[0]);
+        close(from[1]);
+        *in = from[0];
+        *out = to[1];
+
+        return pid;
+}
+
+/*
+ * Copies sources to dest of a server started by the command rsh, which
+ * runs lcopy --serve, or listening on addr. Like local copies, dest is
+ * the parent of the copies if it is a directory of the server.
+ * Returns the number of files that failed.
+ */
+int remote_copy(char **sources, int nsources, const char *dest, int rflag,
+                const char *rsh, const char *addr, int zflag) {
+        unsigned char hello[HELLO_SIZE];
+        struct client cl;
+        struct reply *r;
+        struct stat st;
+        pid_t pid = -1;
+        char *target;
+        char *base;
+        int dest_dir;
+        int in;
+        int out;
+        int rc;
+        int i;
+
+        signal(SIGPIPE, SIG_IGN);
+
+        if (rsh != NULL) {
+                pid = rsh_open(rsh, &in, &out);
+        } else {
+                in = remote_socket(addr, 0);
+                out = dup(in);
+                if (out < 0)
+                        handle_error("dup");
+        }
+
+        /* Id 0 is left to directories. */
+        memset(&cl, 0, sizeof(cl));
+        cl.next_id = cl.first_id = 1;
+        conn_init(&cl.c, in, out);
+        pthread_mutex_init(&cl.lock, NULL);
+        pthread_cond_init(&cl.cond, NULL);
+
+        memcpy(hello, PROTO_MAGIC, 8);
+        put32(hello + 8, PROTO_VERSION);
+        put32(hello + 12, hash_algo);
+        put64(hello + 16, chunk_size);
+        put32(hello + 24, zflag ? HELLO_DEFLATE : 0);
+        msg_send(&cl.c, MSG_HELLO, 0, 0, hello, sizeof(hello),
+                dest, strlen(dest));
+        conn_flush(&cl.c);
+        conn_deflate(&cl.c, zflag, 0);
+
+        rc = pthread_create(&cl.reader, NULL, client_reader, &cl);
+        if (rc)
+                handle_error_en(rc, "pthread_create");
+
+        r = client_reply(&cl);
+        if (r->m.type != MSG_HELLO || r->m.len < 8)
+                exit(EXIT_FAILURE);
+        dest_dir = get32(r->m.data + 4) & HELLO_DEST_DIR;
+        reply_free(r);
+
+        if (nsources > 1 && !dest_dir) {
+                printf("Destination is not a directory: %s.\n", dest);
+                exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < nsources; i++) {
+                stat_entry(AT_FDCWD, sources[i], &st);
+                base = get_basename(sources[i]);
+                if (!dest_dir)
+                        target = strdup(dest);
+                else if (S_ISDIR(st.st_mode))
+                        target = dest_dir_path(sources[i], dest);
+                else if (asprintf(&target, "%s/%s", dest, base) < 0)
+                        target = NULL;
+                if (target == NULL)
+                        handle_error("malloc");
+                if (use_index && rflag && S_ISDIR(st.st_mode))
+                        store_add_tree(sources[i]);
+                if (client_entry(&cl, sources[i], target, rflag) != 0)
+                        cl.errors++;
+                free(target);
+        }
+
+        while (cl.first_id != cl.next_id)
+                client_send(&cl);
+        msg_send(&cl.c, MSG_BYE, 0, 0, NULL, 0, NULL, 0);
+        conn_flush(&cl.c);
+
+        /* Replies of the last files, then BYE. */
+        do {
+                r = client_reply(&cl);
+                rc = r->m.type;
+                reply_free(r);
+        } while (rc != MSG_BYE);
+
+        pthread_join(cl.reader, NULL);
+        fclose(cl.c.out);
+        fclose(cl.c.in);
+        if (pid > 0)
+                waitpid(pid, NULL, 0);
+
+        return cl.errors;
+}
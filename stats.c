@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "lcopy.h"
+
+/*
+ * Run statistics of --stats. Counters are added to the file being
+ * copied by the calling thread, if any, and to the totals of the run.
+ * Pool workers count for the file of the thread that started the pool.
+ * Times are taken around the leaf operations only (stat, chunk reads,
+ * hashing, digest comparison, writes), so they do not overlap; they are
+ * summed over all threads working on a file and with -j can exceed its
+ * wall time. A record is written per file as it is done, the totals
+ * when the program exits, all of it as one JSON document.
+ */
+
+/* Statistics are kept, set by --stats. */
+int stats_on = 0;
+
+/* Names of the counters in records, times are printed in seconds. */
+static const char *stat_names[STAT_COUNT] = {
+        "stat_s",
+        "read_s",
+        "digest_s",
+        "compare_s",
+        "copy_s",
+        "bytes",
+        "bytes_hashed",
+        "bytes_written",
+        "chunks",
+        "chunks_changed",
+        "digs_hits",
+        "digs_misses"
+};
+
+/* Counters up to STAT_TIMES are times in nanoseconds. */
+#define STAT_TIMES STAT_BYTES
+
+static FILE *stats_out;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats total;
+static long nrecords;
+static long nfiles;
+
+/* File of the calling thread, NULL between files. */
+static __thread struct stats *current;
+
+/* Stat time of the calling thread before its next file begins. */
+static __thread uint64_t pending_stat;
+
+/* Returns a monotonic time in nanoseconds, 0 without --stats. */
+uint64_t stats_clock(void) {
+        struct timespec ts;
+
+        if (!stats_on)
+                return 0;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Adds n to counter c of the current file and of the run. */
+void stats_add(int c, uint64_t n) {
+        if (!stats_on)
+                return;
+
+        __atomic_fetch_add(&total.v[c], n, __ATOMIC_RELAXED);
+        if (current != NULL)
+                __atomic_fetch_add(&current->v[c], n, __ATOMIC_RELAXED);
+        else if (c == STAT_STAT)
+                pending_stat += n;
+}
+
+/* Adds the time since start, taken by stats_clock, to counter c. */
+void stats_since(int c, uint64_t start) {
+        if (stats_on)
+                stats_add(c, stats_clock() - start);
+}
+
+/* Returns the file of the calling thread, for pool workers. */
+struct stats *stats_current(void) {
+        return current;
+}
+
+/* Counts the calling thread for file s, NULL for none. */
+void stats_attach(struct stats *s) {
+        current = s;
+}
+
+/*
+ * Starts the record of a file copied by the calling thread. The stat
+ * time since the last file, the lookups of this one, is counted for it.
+ */
+void stats_file_begin(struct stats *s) {
+        if (!stats_on)
+                return;
+
+        memset(s, 0, sizeof(*s));
+        s->start = stats_clock();
+        s->v[STAT_STAT] = pending_stat;
+        pending_stat = 0;
+        current = s;
+}
+
+/* Writes s as JSON string. */
+static void json_string(FILE *f, const char *s) {
+        fputc('"', f);
+        for (; *s; s++) {
+                if (*s == '"' || *s == '\\')
+                        fprintf(f, "\\%c", *s);
+                else if ((unsigned char)*s < 0x20)
+                        fprintf(f, "\\u%04x", *s);
+                else
+                        fputc(*s, f);
+        }
+        fputc('"', f);
+}
+
+/* Writes the counters of s, and throughput over wall nanoseconds. */
+static void json_counters(FILE *f, const struct stats *s, uint64_t wall) {
+        int c;
+
+        fprintf(f, "\"wall_s\": %.6f", wall / 1e9);
+        for (c = 0; c < STAT_COUNT; c++) {
+                if (c < STAT_TIMES)
+                        fprintf(f, ", \"%s\": %.6f", stat_names[c],
+                                s->v[c] / 1e9);
+                else
+                        fprintf(f, ", \"%s\": %llu", stat_names[c],
+                                (unsigned long long)s->v[c]);
+        }
+        fprintf(f, ", \"chunks_skipped\": %llu, \"throughput_mbs\": %.1f",
+                (unsigned long long)(s->v[STAT_CHUNKS] -
+                        s->v[STAT_CHANGED]),
+                wall ? s->v[STAT_BYTES] * 1e3 / wall : 0.0);
+}
+
+/*
+ * Ends the record of file s and writes it. method names the way it was
+ * copied, files is the number of files it covers, more than one for
+ * batches of small files.
+ */
+void stats_file_end(struct stats *s, const char *src, const char *dest,
+                const char *method, int files) {
+        uint64_t wall;
+
+        if (!stats_on)
+                return;
+
+        current = NULL;
+        wall = stats_clock() - s->start;
+
+        pthread_mutex_lock(&stats_lock);
+        fprintf(stats_out, "%s\n    {\"src\": ", nrecords++ ? "," : "");
+        json_string(stats_out, src);
+        fprintf(stats_out, ", \"dest\": ");
+        json_string(stats_out, dest);
+        fprintf(stats_out, ", \"method\": \"%s\", \"files\": %d, ", method,
+                files);
+        json_counters(stats_out, s, wall);
+        fprintf(stats_out, "}");
+        nfiles += files;
+        pthread_mutex_unlock(&stats_lock);
+}
+
+/* Writes the totals and ends the document, at exit. */
+static void stats_finish(void) {
+        fprintf(stats_out, "\n  ],\n  \"total\": {\"files\": %ld, ", nfiles);
+        json_counters(stats_out, &total, stats_clock() - total.start);
+        fprintf(stats_out, "}\n}\n");
+        fflush(stats_out);
+        if (stats_out != stderr)
+                fclose(stats_out);
+}
+
+/*
+ * Turns statistics on, written to path or, if NULL, to stderr. The
+ * totals cover the run from here to exit.
+ */
+void stats_open(const char *path) {
+        stats_out = path != NULL ? fopen(path, "w") : stderr;
+        if (stats_out == NULL)
+                handle_error(path);
+
+        stats_on = 1;
+        total.start = stats_clock();
+        fprintf(stats_out, "{\n  \"files\": [");
+        if (atexit(stats_finish) != 0)
+                handle_error("atexit");
+}
@@ -0,0 +1,613 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lcopy.h"
+
+/*
+ * Digest store. Digest files are kept next to their file as <file>.digs
+ * or, with --index, as records of one index file per tree at
+ * <root>/INDEX_NAME. The index is a log: a header followed by records
+ * of a path relative to the root and the image of its digest file, the
+ * last record of a path wins. The header of the image holds inode,
+ * size and times of the file, so freshness is decided as for .digs
+ * files. The index is read through one mmap when first used, new
+ * records are appended as digests change and dead ones are dropped by
+ * store_finish once they outweigh live ones. Processes sharing a tree
+ * hold flock on the index while they use it and first read records the
+ * others appended meanwhile, so appends never interleave and a
+ * compaction keeps every record.
+ *
+ * Either way a digest file is handed out as a FILE. Digest files of an
+ * index are memfds seeded with the record and appended back on
+ * store_close if they were written. A path without record takes its
+ * <file>.digs, which is removed once the index holds it.
+ */
+
+#define INDEX_MAGIC "LCINDEX\0"
+#define INDEX_VERSION 1
+
+struct index_header {
+        char magic[8];          /* INDEX_MAGIC */
+        uint32_t version;
+        uint32_t header_size;
+};
+
+/* Record header, path and digest file image follow, each 8 aligned. */
+struct index_rec {
+        uint32_t path_len;
+        uint32_t reserved;
+        uint64_t len;           /* Bytes of the digest file image. */
+};
+
+#define INDEX_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+/* Bytes of a record of path and a len bytes image. */
+#define INDEX_REC_SIZE(path, len) (sizeof(struct index_rec) + \
+        INDEX_ALIGN(strlen(path)) + INDEX_ALIGN(len))
+
+/* Latest record of a path. */
+struct slot {
+        char *path;             /* NULL if empty. */
+        off_t off;              /* Offset of the image in the index. */
+        uint64_t len;
+};
+
+/* Tree of an index. */
+struct tree {
+        char *root;
+        size_t root_len;
+        char *index_path;
+        pthread_mutex_t lock;
+        int fd;                 /* Index file, -1 until it exists. */
+        ino_t ino;              /* Inode of fd, tells a compacted index. */
+        off_t end;              /* End of the last whole record read. */
+        off_t live;             /* Bytes of latest records. */
+        struct slot *slots;
+        size_t mask;
+        size_t used;
+};
+
+/* Digests of trees are kept in an index, set by --index. */
+int use_index = 0;
+
+static struct tree *trees;
+static int ntrees;
+
+/* Marks of store memfds, kept in their stat. */
+#define STORE_IMPORTED 0400     /* Mode of a memfd seeded from .digs. */
+
+static uint64_t path_hash(const char *path) {
+        uint64_t h = 14695981039346656037ULL;
+
+        while (*path)
+                h = (h ^ (unsigned char)*path++) * 1099511628211ULL;
+
+        return h;
+}
+
+/* Returns the slot of path, an empty one if path has no record. */
+static struct slot *tree_slot(struct tree *t, const char *path) {
+        size_t i = path_hash(path) & t->mask;
+
+        while (t->slots[i].path != NULL && strcmp(t->slots[i].path, path))
+                i = (i + 1) & t->mask;
+
+        return &t->slots[i];
+}
+
+/* Makes the record of path at off the latest one. */
+static void tree_set(struct tree *t, const char *path, off_t off,
+                uint64_t len) {
+        struct slot *old;
+        struct slot *s;
+        size_t size;
+        size_t i;
+
+        if (2 * (t->used + 1) > t->mask + 1) {
+                old = t->slots;
+                size = old ? t->mask + 1 : 0;
+                t->mask = size ? 2 * size - 1 : 1023;
+                t->slots = calloc(t->mask + 1, sizeof(struct slot));
+                if (t->slots == NULL)
+                        handle_error("calloc");
+                for (i = 0; i < size; i++) {
+                        if (old[i].path != NULL)
+                                *tree_slot(t, old[i].path) = old[i];
+                }
+                free(old);
+        }
+
+        s = tree_slot(t, path);
+        if (s->path == NULL) {
+                s->path = strdup(path);
+                if (s->path == NULL)
+                        handle_error("strdup");
+                t->used++;
+        } else {
+                t->live -= INDEX_REC_SIZE(path, s->len);
+        }
+        s->off = off;
+        s->len = len;
+        t->live += INDEX_REC_SIZE(path, len);
+}
+
+/* Forgets the records of t, before its index is read again. */
+static void tree_reset(struct tree *t) {
+        size_t i;
+
+        for (i = 0; t->slots != NULL && i <= t->mask; i++)
+                free(t->slots[i].path);
+        free(t->slots);
+        t->slots = NULL;
+        t->mask = 0;
+        t->used = 0;
+        t->live = 0;
+        t->end = 0;
+}
+
+/*
+ * Reads the records of the index of t from t->end on, the ones other
+ * processes appended since it was last read. A record torn by an
+ * interrupted append ends the index, it is cut off. An index of another
+ * version is emptied. Called with the index locked.
+ */
+static void tree_scan(struct tree *t) {
+        struct index_header *h;
+        struct index_rec *r;
+        struct stat st;
+        char *map;
+        char *path;
+        off_t base;
+        off_t off;
+
+        if (fstat(t->fd, &st) != 0)
+                handle_error("fstat");
+        if (st.st_size == t->end)
+                return;
+
+        if (t->end == 0 && st.st_size < (off_t)sizeof(*h))
+                goto cut;
+
+        base = t->end & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        map = mmap(NULL, st.st_size - base, PROT_READ, MAP_SHARED, t->fd, 
+                base);
+        if (map == MAP_FAILED)
+                handle_error("mmap");
+        map -= base;
+
+        off = t->end;
+        if (off == 0) {
+                h = (struct index_header *)map;
+                if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) ||
+                                h->version != INDEX_VERSION ||
+                                h->header_size != sizeof(*h)) {
+                        /* Not an index of this version, it is rewritten. */
+                        munmap(map + base, st.st_size - base);
+                        goto cut;
+                }
+                off = sizeof(*h);
+        }
+
+        while (off + (off_t)sizeof(*r) <= st.st_size) {
+                r = (struct index_rec *)(map + off);
+                if (r->path_len >= PATH_MAX || off + (off_t)sizeof(*r) +
+                                (off_t)INDEX_ALIGN(r->path_len) +
+                                (off_t)INDEX_ALIGN(r->len) > st.st_size)
+                        break;
+                path = strndup(map + off + sizeof(*r), r->path_len);
+                if (path == NULL)
+                        handle_error("strndup");
+                off += sizeof(*r) + INDEX_ALIGN(r->path_len);
+                tree_set(t, path, off, r->len);
+                free(path);
+                off += INDEX_ALIGN(r->len);
+        }
+        t->end = off;
+
+        munmap(map + base, st.st_size - base);
+cut:
+        if (t->end < st.st_size && ftruncate(t->fd, t->end) != 0)
+                handle_error("ftruncate");
+}
+
+/*
+ * Locks the index of t against other processes and brings the records
+ * of t up to date with it. Reopens the index if another process
+ * compacted it meanwhile. Returns 0 if there is no index and create is
+ * not set, 1 with the index locked otherwise. Called with t->lock held.
+ */
+static int tree_lock(struct tree *t, int create) {
+        struct stat st;
+
+        for (;;) {
+                if (t->fd < 0) {
+                        t->fd = open(t->index_path, O_RDWR | O_CLOEXEC | 
+                                (create ? O_CREAT : 0), 0666);
+                        if (t->fd < 0) {
+                                if (errno == ENOENT && !create)
+                                        return 0;
+                                handle_error(t->index_path);
+                        }
+                        if (fstat(t->fd, &st) != 0)
+                                handle_error("fstat");
+                        t->ino = st.st_ino;
+                        tree_reset(t);
+                }
+                if (flock(t->fd, LOCK_EX) != 0)
+                        handle_error("flock");
+
+                /* Still the index at index_path, not a compacted one. */
+                if (stat(t->index_path, &st) == 0 && st.st_ino == t->ino)
+                        break;
+                close(t->fd);
+                t->fd = -1;
+        }
+
+        tree_scan(t);
+
+        return 1;
+}
+
+/* Unlocks the index of t locked by tree_lock. */
+static void tree_unlock(struct tree *t) {
+        if (flock(t->fd, LOCK_UN) != 0)
+                handle_error("flock");
+}
+
+/* Writes len bytes of buf at off of fd. */
+static void store_pwrite(int fd, const void *buf, size_t len, off_t off) {
+        size_t n;
+        ssize_t r;
+
+        for (n = 0; n < len; n += r) {
+                r = pwrite(fd, (const char *)buf + n, len - n, off + n);
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                r = 0;
+                                continue;
+                        }
+                        handle_error("pwrite");
+                }
+        }
+}
+
+/* Reads len bytes at off of fd into buf. */
+static void store_pread(int fd, void *buf, size_t len, off_t off) {
+        size_t n;
+        ssize_t r;
+
+        for (n = 0; n < len; n += r) {
+                r = pread(fd, (char *)buf + n, len - n, off + n);
+                if (r < 0 && errno == EINTR) {
+                        r = 0;
+                        continue;
+                }
+                if (r <= 0)
+                        handle_error("pread");
+        }
+}
+
+/*
+ * Appends a record of path with the len bytes of data to the index,
+ * which is locked and read to its end.
+ */
+static void tree_append(struct tree *t, const char *path,
+                const void *data, uint64_t len) {
+        struct index_header h;
+        struct index_rec r;
+        char pad[8] = { 0 };
+        off_t off;
+
+        if (t->end == 0) {
+                memset(&h, 0, sizeof(h));
+                memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+                h.version = INDEX_VERSION;
+                h.header_size = sizeof(h);
+                store_pwrite(t->fd, &h, sizeof(h), 0);
+                t->end = sizeof(h);
+        }
+
+        memset(&r, 0, sizeof(r));
+        r.path_len = strlen(path);
+        r.len = len;
+        off = t->end;
+        store_pwrite(t->fd, &r, sizeof(r), off);
+        off += sizeof(r);
+        store_pwrite(t->fd, path, r.path_len, off);
+        store_pwrite(t->fd, pad, INDEX_ALIGN(r.path_len) - r.path_len,
+                off + r.path_len);
+        off += INDEX_ALIGN(r.path_len);
+        store_pwrite(t->fd, data, len, off);
+        store_pwrite(t->fd, pad, INDEX_ALIGN(len) - len, off + len);
+
+        tree_set(t, path, off, len);
+        t->end = off + INDEX_ALIGN(len);
+}
+
+/*
+ * Keeps digest files below the directory root in an index at
+ * root/INDEX_NAME. Called before any digest file is opened.
+ */
+void store_add_tree(const char *root) {
+        struct tree *t;
+        size_t len = strlen(root);
+
+        while (len > 1 && root[len - 1] == '/')
+                len--;
+
+        trees = realloc(trees, (ntrees + 1) * sizeof(struct tree));
+        if (trees == NULL)
+                handle_error("realloc");
+        t = &trees[ntrees++];
+        memset(t, 0, sizeof(*t));
+        t->root = strndup(root, len);
+        t->root_len = len;
+        t->index_path = malloc(len + strlen(INDEX_NAME) + 2);
+        if (t->root == NULL || t->index_path == NULL)
+                handle_error("malloc");
+        strcpy(t->index_path, t->root);
+        strcat(t->index_path, "/");
+        strcat(t->index_path, INDEX_NAME);
+        t->fd = -1;
+        pthread_mutex_init(&t->lock, NULL);
+}
+
+/*
+ * Returns the tree whose index keeps the digests of path, the deepest
+ * one, and sets *key to path relative to its root. NULL if there is none.
+ */
+static struct tree *store_tree(const char *path, const char **key) {
+        struct tree *best = NULL;
+        int i;
+
+        if (!use_index)
+                return NULL;
+
+        for (i = 0; i < ntrees; i++) {
+                if (strncmp(path, trees[i].root, trees[i].root_len) ||
+                                (path[trees[i].root_len] != '\0' &&
+                                 path[trees[i].root_len] != '/'))
+                        continue;
+                if (best == NULL || trees[i].root_len > best->root_len)
+                        best = &trees[i];
+        }
+
+        if (best != NULL) {
+                *key = path + best->root_len;
+                while (**key == '/')
+                        (*key)++;
+        }
+
+        return best;
+}
+
+/* Copies len bytes at off of in to the start of memfd out. */
+static void store_fill(int out, int in, off_t off, uint64_t len) {
+        void *map;
+
+        if (len == 0)
+                return;
+        if (ftruncate(out, len) != 0)
+                handle_error("ftruncate");
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+        if (map == MAP_FAILED)
+                handle_error("mmap");
+        store_pread(in, map, len, off);
+        munmap(map, len);
+}
+
+/*
+ * Opens the digest file of path with fopen mode, of its <path>.digs file
+ * or of the index of its tree. Returns NULL with errno set if it is
+ * opened for reading and does not exist.
+ */
+FILE *store_open(const char *path, const char *mode) {
+        struct timespec times[2];
+        struct tree *t;
+        struct slot *s;
+        struct stat st;
+        const char *key;
+        char *digs_path;
+        FILE *f;
+        int imported = 0;
+        int fd;
+        int in;
+
+        t = store_tree(path, &key);
+        if (t == NULL) {
+                digs_path = get_digs_filepath(path);
+                f = fopen(digs_path, mode);
+                free(digs_path);
+                return f;
+        }
+
+        fd = memfd_create("digs", MFD_CLOEXEC);
+        if (fd < 0)
+                handle_error("memfd_create");
+
+        if (mode[0] == 'r') {
+                pthread_mutex_lock(&t->lock);
+                s = NULL;
+                if (tree_lock(t, 0)) {
+                        s = t->slots ? tree_slot(t, key) : NULL;
+                        if (s != NULL && s->path != NULL)
+                                store_fill(fd, t->fd, s->off, s->len);
+                        tree_unlock(t);
+                }
+                pthread_mutex_unlock(&t->lock);
+
+                /* No record yet, migrate the .digs file of path. */
+                if (s == NULL || s->path == NULL) {
+                        digs_path = get_digs_filepath(path);
+                        in = open(digs_path, O_RDONLY | O_CLOEXEC);
+                        free(digs_path);
+                        if (in < 0 || fstat(in, &st) != 0) {
+                                close(fd);
+                                if (in >= 0)
+                                        close(in);
+                                errno = ENOENT;
+                                return NULL;
+                        }
+                        store_fill(fd, in, 0, st.st_size);
+                        close(in);
+                        imported = 1;
+                }
+        }
+
+        /* A write sets mtime, store_close appends only then. */
+        if (imported && fchmod(fd, STORE_IMPORTED) != 0)
+                handle_error("fchmod");
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = 0;
+        times[1].tv_nsec = 0;
+        if (futimens(fd, times) != 0)
+                handle_error("futimens");
+
+        f = fdopen(fd, "r+");
+        if (f == NULL)
+                handle_error("fdopen");
+
+        return f;
+}
+
+/*
+ * Closes a digest file of path opened with store_open. Digest files of
+ * an index that were written, or migrated, are appended to it.
+ */
+void store_close(FILE *f, const char *path) {
+        struct tree *t;
+        struct stat st;
+        const char *key;
+        char *digs_path;
+        void *map = NULL;
+
+        t = store_tree(path, &key);
+        if (t == NULL) {
+                fclose(f);
+                return;
+        }
+
+        fflush(f);
+        if (fstat(fileno(f), &st) != 0)
+                handle_error("fstat");
+        if (st.st_mtim.tv_sec == 0 && st.st_mtim.tv_nsec == 0 &&
+                        (st.st_mode & 0777) != STORE_IMPORTED) {
+                fclose(f);
+                return;
+        }
+
+        if (st.st_size > 0) {
+                map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                        fileno(f), 0);
+                if (map == MAP_FAILED)
+                        handle_error("mmap");
+        }
+
+        pthread_mutex_lock(&t->lock);
+        tree_lock(t, 1);
+        tree_append(t, key, map, st.st_size);
+        tree_unlock(t);
+        pthread_mutex_unlock(&t->lock);
+
+        if (map != NULL)
+                munmap(map, st.st_size);
+        fclose(f);
+
+        if ((st.st_mode & 0777) == STORE_IMPORTED) {
+                digs_path = get_digs_filepath(path);
+                unlink(digs_path);
+                free(digs_path);
+        }
+}
+
+/*
+ * Rewrites the index of t with its latest records only, into a new file
+ * renamed over it. Called with the index locked and read to its end, so
+ * records of other processes are kept; they reopen the new index.
+ */
+static void tree_compact(struct tree *t) {
+        struct tree c;
+        struct stat st;
+        char *tmp_path;
+        void *buf;
+        size_t i;
+
+        tmp_path = malloc(strlen(t->index_path) + 8);
+        if (tmp_path == NULL)
+                handle_error("malloc");
+        strcpy(tmp_path, t->index_path);
+        strcat(tmp_path, ".XXXXXX");
+
+        memset(&c, 0, sizeof(c));
+        c.index_path = tmp_path;
+        c.fd = mkostemp(tmp_path, O_CLOEXEC);
+        if (c.fd < 0)
+                handle_error(tmp_path);
+        if (fstat(t->fd, &st) != 0 || fchmod(c.fd, st.st_mode & 07777) != 0)
+                handle_error("fchmod");
+
+        for (i = 0; i <= t->mask; i++) {
+                if (t->slots[i].path == NULL)
+                        continue;
+                buf = malloc(t->slots[i].len + 1);
+                if (buf == NULL)
+                        handle_error("malloc");
+                store_pread(t->fd, buf, t->slots[i].len, t->slots[i].off);
+                tree_append(&c, t->slots[i].path, buf, t->slots[i].len);
+                free(buf);
+        }
+
+        /* Lock the new index before others can open it. */
+        if (flock(c.fd, LOCK_EX) != 0)
+                handle_error("flock");
+        if (rename(tmp_path, t->index_path) != 0)
+                handle_error("rename");
+        if (fstat(c.fd, &st) != 0)
+                handle_error("fstat");
+
+        close(t->fd);
+        for (i = 0; i <= t->mask; i++)
+                free(t->slots[i].path);
+        free(t->slots);
+        t->fd = c.fd;
+        t->ino = st.st_ino;
+        t->slots = c.slots;
+        t->mask = c.mask;
+        t->used = c.used;
+        t->live = c.live;
+        t->end = c.end;
+        free(tmp_path);
+}
+
+/* Compacts and closes the indexes, called once all copies are done. */
+void store_finish(void) {
+        struct tree *t;
+        int n;
+
+        for (n = 0; n < ntrees; n++) {
+                t = &trees[n];
+                if (t->fd >= 0 && tree_lock(t, 0)) {
+                        if (t->end - (off_t)sizeof(struct index_header) >
+                                        2 * t->live)
+                                tree_compact(t);
+                        tree_unlock(t);
+                        close(t->fd);
+                }
+                tree_reset(t);
+                free(t->root);
+                free(t->index_path);
+                pthread_mutex_destroy(&t->lock);
+        }
+        free(trees);
+        trees = NULL;
+        ntrees = 0;
+}
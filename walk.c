@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include "lcopy.h"
+
+/*
+ * Parallel tree walk. Every directory entry is a task, tasks are kept
+ * in per worker deques. A worker pops its own newest task and, when
+ * its deque is empty, steals the oldest task of another worker.
+ * A task spawned into a full deque runs inline on the spawning worker,
+ * which bounds memory to WALK_QUEUE_DEPTH tasks per worker.
+ */
+
+/* Bounded circular deque of tasks. */
+struct deque {
+        pthread_mutex_t lock;
+        struct walk_task *tasks[WALK_QUEUE_DEPTH];
+        int top;        /* Oldest task, stolen by other workers. */
+        int count;
+};
+
+/* Output line kept until the walk ends in ordered mode. */
+struct record {
+        int *key;
+        int keylen;
+        long seq;       /* Keeps lines of one task in print order. */
+        char *text;
+};
+
+struct walk {
+        int threads;
+        int ordered;
+        walk_visit visit;
+        struct deque *deques;
+
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        long pending;   /* Spawned but not finished tasks. */
+        long pushes;    /* Tasks queued so far, detects missed wakeups. */
+        int idle;       /* Workers waiting for tasks. */
+
+        pthread_mutex_t out_lock;
+        struct record *records;
+        long nrecords;
+        long records_size;
+};
+
+static struct walk *walk;
+
+/* Deque index of the calling worker, -1 outside of the walk. */
+static __thread int walk_self = -1;
+
+/* Task that the calling worker is running. */
+static __thread struct walk_task *walk_current;
+
+/* Returns non-zero if called from a walk worker. */
+int walk_active(void) {
+        return walk_self >= 0;
+}
+
+static void task_free(struct walk_task *t) {
+        free(t->src);
+        free(t->dest);
+        free(t->key);
+        free(t);
+}
+
+/* Runs a task on the calling worker and accounts its completion. */
+static void task_run(struct walk_task *t) {
+        struct walk_task *saved = walk_current;
+
+        walk_current = t;
+        if (t->fn != NULL)
+                t->fn(t->arg);
+        else
+                walk->visit(t);
+        walk_current = saved;
+        task_free(t);
+
+        pthread_mutex_lock(&walk->lock);
+        if (--walk->pending == 0)
+                pthread_cond_broadcast(&walk->cond);
+        pthread_mutex_unlock(&walk->lock);
+}
+
+/* Pushes t as newest task of deque q. Returns 0 if q is full. */
+static int deque_push(struct deque *q, struct walk_task *t) {
+        int ret = 0;
+
+        pthread_mutex_lock(&q->lock);
+        if (q->count < WALK_QUEUE_DEPTH) {
+                q->tasks[(q->top + q->count) % WALK_QUEUE_DEPTH] = t;
+                q->count++;
+                ret = 1;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        return ret;
+}
+
+/* Pops newest (own deque) or oldest (stealing) task of q. */
+static struct walk_task *deque_pop(struct deque *q, int steal) {
+        struct walk_task *t = NULL;
+
+        pthread_mutex_lock(&q->lock);
+        if (q->count > 0) {
+                if (steal) {
+                        t = q->tasks[q->top];
+                        q->top = (q->top + 1) % WALK_QUEUE_DEPTH;
+                } else {
+                        t = q->tasks[(q->top + q->count - 1) %
+                                WALK_QUEUE_DEPTH];
+                }
+                q->count--;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        return t;
+}
+
+/* Finds a task for worker self, own deque first. */
+static struct walk_task *walk_find(int self) {
+        struct walk_task *t;
+        int i;
+
+        t = deque_pop(&walk->deques[self], 0);
+        for (i = 1; t == NULL && i < walk->threads; i++)
+                t = deque_pop(&walk->deques[(self + i) % walk->threads], 1);
+
+        return t;
+}
+
+static void *walk_worker(void *arg) {
+        struct walk_task *t;
+        long seen;
+
+        walk_self = (int)(long)arg;
+
+        for (;;) {
+                pthread_mutex_lock(&walk->lock);
+                seen = walk->pushes;
+                pthread_mutex_unlock(&walk->lock);
+
+                t = walk_find(walk_self);
+                if (t != NULL) {
+                        task_run(t);
+                        continue;
+                }
+
+                pthread_mutex_lock(&walk->lock);
+                if (walk->pending == 0) {
+                        pthread_mutex_unlock(&walk->lock);
+                        break;
+                }
+                /* Sleep unless a task was queued while searching. */
+                if (walk->pushes == seen) {
+                        walk->idle++;
+                        pthread_cond_wait(&walk->cond, &walk->lock);
+                        walk->idle--;
+                }
+                pthread_mutex_unlock(&walk->lock);
+        }
+
+        walk_self = -1;
+
+        return NULL;
+}
+
+/* Queues t on the calling worker, runs it inline if the deque is full. */
+static void walk_push(struct walk_task *t) {
+        int self = walk_self >= 0 ? walk_self : 0;
+
+        pthread_mutex_lock(&walk->lock);
+        walk->pending++;
+        pthread_mutex_unlock(&walk->lock);
+
+        if (!deque_push(&walk->deques[self], t)) {
+                task_run(t);
+                return;
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        walk->pushes++;
+        if (walk->idle)
+                pthread_cond_signal(&walk->cond);
+        pthread_mutex_unlock(&walk->lock);
+}
+
+/*
+ * Spawns a task copying src to dest, takes ownership of both paths.
+ * index is the position of the entry in its parent directory, it orders
+ * output in ordered mode. type is the file type of src if known.
+ * Runs the task inline if the deque is full.
+ */
+void walk_spawn(char *src, char *dest, int index, unsigned type) {
+        struct walk_task *t;
+        struct walk_task *parent = walk_current;
+
+        t = malloc(sizeof(*t));
+        if (t == NULL)
+                handle_error("malloc");
+        t->src = src;
+        t->dest = dest;
+        t->type = type;
+        t->fn = NULL;
+        t->arg = NULL;
+        t->keylen = parent ? parent->keylen + 1 : 1;
+        t->key = malloc(sizeof(int) * t->keylen);
+        if (t->key == NULL)
+                handle_error("malloc");
+        if (parent)
+                memcpy(t->key, parent->key, sizeof(int) * parent->keylen);
+        t->key[t->keylen - 1] = index;
+
+        walk_push(t);
+}
+
+/*
+ * Spawns a task running fn(arg) on behalf of the running task. Its
+ * output lines are ordered as lines of the running task, so fn prints
+ * entries of the same directory with walk_printf_entry.
+ */
+void walk_spawn_fn(void (*fn)(void *arg), void *arg) {
+        struct walk_task *t;
+        struct walk_task *parent = walk_current;
+
+        t = malloc(sizeof(*t));
+        if (t == NULL)
+                handle_error("malloc");
+        t->src = NULL;
+        t->dest = NULL;
+        t->type = 0;
+        t->fn = fn;
+        t->arg = arg;
+        t->keylen = parent ? parent->keylen : 0;
+        t->key = malloc(sizeof(int) * (t->keylen + 1));
+        if (t->key == NULL)
+                handle_error("malloc");
+        if (parent)
+                memcpy(t->key, parent->key, sizeof(int) * parent->keylen);
+
+        walk_push(t);
+}
+
+/*
+ * Prints an output line of the running task, or of its entry index
+ * if index is not negative.
+ */
+static void walk_vprintf(int index, const char *fmt, va_list ap) {
+        struct walk_task *t = walk_current;
+        struct record *r;
+
+        if (walk == NULL || !walk->ordered || t == NULL) {
+                vprintf(fmt, ap);
+                return;
+        }
+
+        pthread_mutex_lock(&walk->out_lock);
+        if (walk->nrecords == walk->records_size) {
+                walk->records_size = walk->records_size ?
+                        walk->records_size * 2 : 1024;
+                walk->records = realloc(walk->records,
+                        sizeof(struct record) * walk->records_size);
+                if (walk->records == NULL)
+                        handle_error("realloc");
+        }
+        r = &walk->records[walk->nrecords];
+        r->keylen = t->keylen + (index >= 0);
+        r->seq = walk->nrecords++;
+        r->key = malloc(sizeof(int) * r->keylen);
+        if (r->key == NULL || vasprintf(&r->text, fmt, ap) < 0)
+                handle_error("malloc");
+        memcpy(r->key, t->key, sizeof(int) * t->keylen);
+        if (index >= 0)
+                r->key[t->keylen] = index;
+        pthread_mutex_unlock(&walk->out_lock);
+}
+
+/*
+ * Prints an output line of the running task. In ordered mode lines are
+ * kept and printed by walk_run in the order of a sequential walk, that
+ * is an entry after all entries below it.
+ */
+void walk_printf(const char *fmt, ...) {
+        va_list ap;
+
+        va_start(ap, fmt);
+        walk_vprintf(-1, fmt, ap);
+        va_end(ap);
+}
+
+/*
+ * Prints an output line of entry index of the directory of the running
+ * task, as if a task of that entry printed it. For entries the task
+ * copies itself instead of spawning them.
+ */
+void walk_printf_entry(int index, const char *fmt, ...) {
+        va_list ap;
+
+        va_start(ap, fmt);
+        walk_vprintf(index, fmt, ap);
+        va_end(ap);
+}
+
+/* Post-order: a record sorts after every record below it. */
+static int record_cmp(const void *a, const void *b) {
+        const struct record *ra = a;
+        const struct record *rb = b;
+        int i;
+
+        for (i = 0; i < ra->keylen && i < rb->keylen; i++) {
+                if (ra->key[i] != rb->key[i])
+                        return ra->key[i] < rb->key[i] ? -1 : 1;
+        }
+
+        if (ra->keylen != rb->keylen)
+                return rb->keylen - ra->keylen;
+
+        return ra->seq < rb->seq ? -1 : 1;
+}
+
+/*
+ * Runs visit for every task spawned with walk_spawn, starting with
+ * roots[0..nroots) copied to dest, on threads workers.
+ * Returns after all tasks are done.
+ */
+int walk_run(int threads, int ordered, walk_visit visit,
+                char **roots, int nroots, const char *dest) {
+        struct walk w;
+        pthread_t *tids;
+        long i;
+        int rc;
+
+        memset(&w, 0, sizeof(w));
+        w.threads = threads < 1 ? 1 : threads;
+        w.ordered = ordered;
+        w.visit = visit;
+        w.deques = calloc(w.threads, sizeof(struct deque));
+        tids = calloc(w.threads, sizeof(pthread_t));
+        if (w.deques == NULL || tids == NULL)
+                handle_error("calloc");
+        for (i = 0; i < w.threads; i++)
+                pthread_mutex_init(&w.deques[i].lock, NULL);
+        pthread_mutex_init(&w.lock, NULL);
+        pthread_cond_init(&w.cond, NULL);
+        pthread_mutex_init(&w.out_lock, NULL);
+        walk = &w;
+
+        for (i = 0; i < nroots; i++)
+                walk_spawn(strdup(roots[i]), strdup(dest), i, 0);
+
+        for (i = 0; i < w.threads; i++) {
+                rc = pthread_create(&tids[i], NULL, walk_worker, (void *)i);
+                if (rc)
+                        handle_error_en(rc, "pthread_create");
+        }
+        for (i = 0; i < w.threads; i++)
+                pthread_join(tids[i], NULL);
+
+        if (w.ordered) {
+                qsort(w.records, w.nrecords, sizeof(struct record),
+                        record_cmp);
+                for (i = 0; i < w.nrecords; i++) {
+                        fputs(w.records[i].text, stdout);
+                        free(w.records[i].text);
+                        free(w.records[i].key);
+                }
+                free(w.records);
+        }
+
+        walk = NULL;
+        for (i = 0; i < w.threads; i++)
+                pthread_mutex_destroy(&w.deques[i].lock);
+        pthread_mutex_destroy(&w.lock);
+        pthread_cond_destroy(&w.cond);
+        pthread_mutex_destroy(&w.out_lock);
+        free(w.deques);
+        free(tids);
+
+        return 0;
+}